@@ -41,6 +41,19 @@
 #include <errno.h>
 #include <dirent.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <linux/netlink.h>
+#endif
 
 #include <dahdi/user.h>
 #include "tonezone.h"
@@ -48,6 +61,9 @@
 
 #define CONFIG_FILENAME "/etc/dahdi/system.conf"
 #define MASTER_DEVICE   "/dev/dahdi/ctl"
+#define STATE_DIR       "/run/dahdi"
+#define STATE_FILENAME  STATE_DIR "/dahdi_cfg.state"
+#define CACHE_FILENAME  STATE_DIR "/system.conf.cache"
 
 #define NUM_SPANS DAHDI_MAX_SPANS
 
@@ -63,9 +79,65 @@
 /* Assume no more than 1024 dynamics */
 #define NUM_DYNAMIC	1024
 
-static int lineno=0;
+/*
+ * A set of channel numbers, as a bitmap.
+ */
+#define CHANSET_WORD_BITS	(8 * sizeof(unsigned long))
+#define CHANSET_WORDS	\
+	((DAHDI_MAX_CHANNELS + CHANSET_WORD_BITS - 1) / CHANSET_WORD_BITS)
+
+struct chanset {
+	unsigned long bits[CHANSET_WORDS];
+};
+
+static inline bool chanset_has(const struct chanset *set, int chan)
+{
+	return (set->bits[chan / CHANSET_WORD_BITS] >>
+		(chan % CHANSET_WORD_BITS)) & 1;
+}
+
+/* Add channels start..finish (inclusive) */
+static void chanset_add_range(struct chanset *set, int start, int finish)
+{
+	unsigned long mask;
+	int word;
+
+	while (start <= finish) {
+		word = start / CHANSET_WORD_BITS;
+		mask = ~0UL << (start % CHANSET_WORD_BITS);
+		if (finish / CHANSET_WORD_BITS == word)
+			mask &= ~0UL >> (CHANSET_WORD_BITS - 1 -
+					 finish % CHANSET_WORD_BITS);
+		set->bits[word] |= mask;
+		start = (word + 1) * CHANSET_WORD_BITS;
+	}
+}
+
+/* Returns the first channel in the set after prev, or -1 */
+static int chanset_next(const struct chanset *set, int prev)
+{
+	int chan = prev + 1;
+	unsigned long word;
+	int x;
 
-static FILE *cf;
+	if (chan >= DAHDI_MAX_CHANNELS)
+		return -1;
+	x = chan / CHANSET_WORD_BITS;
+	word = set->bits[x] & (~0UL << (chan % CHANSET_WORD_BITS));
+	while (!word) {
+		if (++x >= CHANSET_WORDS)
+			return -1;
+		word = set->bits[x];
+	}
+	chan = x * CHANSET_WORD_BITS + __builtin_ctzl(word);
+	return (chan < DAHDI_MAX_CHANNELS) ? chan : -1;
+}
+
+#define chanset_foreach(set, chan) \
+	for ((chan) = chanset_next((set), 0); (chan) > 0; \
+	     (chan) = chanset_next((set), (chan)))
+
+static int lineno=0;
 
 static char *filename=CONFIG_FILENAME;
 
@@ -75,6 +147,17 @@ int txgain = 0, rxgain = 0, deemp = 0, preemp = 0;
 
 int corthreshes[] = {3125,6250,9375,12500,15625,18750,21875,25000,0} ;
 
+/* Radio settings of a channel, from its "channel=" line */
+struct rad_params {
+	int rxtones[NUM_TONES + 1];
+	int rxtags[NUM_TONES + 1];
+	int txtones[NUM_TONES + 1];
+	int bursttime, debouncetime, invertcor, exttone, corthresh;
+	int txgain, rxgain, deemp, preemp;
+};
+
+static struct rad_params *rad[DAHDI_MAX_CHANNELS];
+
 static int toneindex = 1;
 
 #define DEBUG_READER (1 << 0)
@@ -90,9 +173,10 @@ static struct dahdi_lineconfig lc[DAHDI_MAX_SPANS];
 
 static struct dahdi_chanconfig cc[DAHDI_MAX_CHANNELS];
 
-static int only_span = 0;
+static int restrict_spans = 0;
+static bool selected_spans[DAHDI_MAX_SPANS];
 static int restrict_channels = 0;
-static int selected_channels[DAHDI_MAX_CHANNELS];
+static struct chanset selected_channels;
 static int declared_spans[DAHDI_MAX_SPANS];
 
 static struct dahdi_attach_echocan ae[DAHDI_MAX_CHANNELS];
@@ -103,7 +187,7 @@ static const char *sig[DAHDI_MAX_CHANNELS];		/* Signalling */
 
 static int slineno[DAHDI_MAX_CHANNELS];	/* Line number where signalling specified */
 
-static int fiftysixkhdlc[DAHDI_MAX_CHANNELS];
+static struct chanset fiftysixkhdlc;
 
 static int spans=0;
 
@@ -115,14 +199,333 @@ static int force = 0;
 
 static int stopmode = 0;
 
+static int workers = 1;
+
 static int numdynamic = 0;
 
 static char zonestoload[DAHDI_TONE_ZONE_MAX][10];
 
 static int numzones = 0;
 
+/* Built DAHDI_LOADZONE images of zonestoload[] */
+struct zone_image {
+	void *data;
+	size_t len;
+};
+
+static struct zone_image zone_images[DAHDI_TONE_ZONE_MAX];
+
+/* The cache mapping zone_images[] and sig[] point into, if any */
+static void *cache_map;
+static size_t cache_map_len;
+
 static int fd = -1;
 
+/* Set from DAHDI_VIRT_TOP to work on a fake sysfs tree */
+static const char *virt_top = "";
+
+/*
+ * --profile: time spent and ioctls issued in each phase of the run, and
+ * by each span job, written out as JSON when dahdi_cfg exits.
+ *
+ * All ioctl() calls below go through profile_ioctl() to be counted.
+ * Those made inside libtonezone (tone zone loading) are not.
+ */
+enum profile_phase {
+	PROF_ASSIGN_WAIT,
+	PROF_PARSE,
+	PROF_LOCK,
+	PROF_STATE,
+	PROF_SHUTDOWN,
+	PROF_DYNAMIC,
+	PROF_SPANCONFIG,
+	PROF_CHANNELS,
+	PROF_ZONES,
+	PROF_STARTUP,
+	PROF_CHANSETUP,
+	PROF_NUM_PHASES
+};
+
+static const char *profile_phase_names[PROF_NUM_PHASES] = {
+	[PROF_ASSIGN_WAIT]	= "assign_wait",
+	[PROF_PARSE]		= "parse",
+	[PROF_LOCK]		= "lock",
+	[PROF_STATE]		= "state",
+	[PROF_SHUTDOWN]		= "shutdown",
+	[PROF_DYNAMIC]		= "dynamic",
+	[PROF_SPANCONFIG]	= "spanconfig",
+	[PROF_CHANNELS]		= "channels",
+	[PROF_ZONES]		= "zones",
+	[PROF_STARTUP]		= "startup",
+	[PROF_CHANSETUP]	= "chansetup",
+};
+
+/*
+ * The ioctls dahdi_cfg issues, counted by exact request code: several
+ * share a number byte, e.g. DAHDI_SPECIFY and DAHDI_GETVERSION. Others
+ * are counted together in the last slot.
+ */
+static const struct {
+	unsigned long request;
+	const char *name;
+} profile_ioctl_names[] = {
+	{ DAHDI_GET_PARAMS, "DAHDI_GET_PARAMS" },
+	{ DAHDI_SPANSTAT, "DAHDI_SPANSTAT" },
+	{ DAHDI_GETVERSION, "DAHDI_GETVERSION" },
+	{ DAHDI_SPANCONFIG, "DAHDI_SPANCONFIG" },
+	{ DAHDI_CHANCONFIG, "DAHDI_CHANCONFIG" },
+	{ DAHDI_ATTACH_ECHOCAN, "DAHDI_ATTACH_ECHOCAN" },
+	{ DAHDI_STARTUP, "DAHDI_STARTUP" },
+	{ DAHDI_SHUTDOWN, "DAHDI_SHUTDOWN" },
+	{ DAHDI_DYNAMIC_CREATE, "DAHDI_DYNAMIC_CREATE" },
+	{ DAHDI_DYNAMIC_DESTROY, "DAHDI_DYNAMIC_DESTROY" },
+	{ DAHDI_DEFAULTZONE, "DAHDI_DEFAULTZONE" },
+	{ DAHDI_SPECIFY, "DAHDI_SPECIFY" },
+	{ DAHDI_HDLC_RATE, "DAHDI_HDLC_RATE" },
+	{ DAHDI_RADIO_GETPARAM, "DAHDI_RADIO_GETPARAM" },
+	{ DAHDI_RADIO_SETPARAM, "DAHDI_RADIO_SETPARAM" },
+};
+
+#define PROF_IOCTL_NAMES	(sizeof(profile_ioctl_names) / sizeof(profile_ioctl_names[0]))
+#define PROF_IOCTL_OTHER	PROF_IOCTL_NAMES
+#define PROF_IOCTL_NRS		(PROF_IOCTL_NAMES + 1)
+
+struct profile_phase_rec {
+	bool used;
+	long long start_us;		/* Of the first entry */
+	long long usec;			/* Accumulated over all entries */
+	long long entered_us;
+	unsigned long entered_counts[PROF_IOCTL_NRS];
+	unsigned long counts[PROF_IOCTL_NRS];
+};
+
+struct profile_span_rec {
+	enum profile_phase phase;
+	int span;			/* 0: channels not matched to a span */
+	long long start_us;
+	long long usec;
+	unsigned long ioctls;
+};
+
+static const char *profile_file;
+static struct timespec profile_epoch;
+static unsigned long ioctl_counts[PROF_IOCTL_NRS];
+static __thread unsigned long thread_ioctls;
+static struct profile_phase_rec profile_phases[PROF_NUM_PHASES];
+static struct profile_span_rec *profile_spans;
+static int profile_numspans;
+
+static int profile_ioctl_nr(unsigned long request)
+{
+	int nr;
+
+	for (nr = 0; nr < PROF_IOCTL_NAMES; nr++) {
+		if (profile_ioctl_names[nr].request == request)
+			break;
+	}
+	return nr;
+}
+
+static int profile_ioctl(int fd, unsigned long request, void *arg)
+{
+	if (profile_file) {
+		__atomic_add_fetch(&ioctl_counts[profile_ioctl_nr(request)], 1,
+				   __ATOMIC_RELAXED);
+		thread_ioctls++;
+	}
+	return ioctl(fd, request, arg);
+}
+
+#define ioctl(fd, request, arg)	profile_ioctl(fd, request, arg)
+
+static long long profile_now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - profile_epoch.tv_sec) * 1000000LL +
+		(now.tv_nsec - profile_epoch.tv_nsec) / 1000;
+}
+
+static void profile_begin(enum profile_phase phase)
+{
+	struct profile_phase_rec *p = &profile_phases[phase];
+
+	if (!profile_file)
+		return;
+	p->entered_us = profile_now_us();
+	if (!p->used)
+		p->start_us = p->entered_us;
+	p->used = true;
+	memcpy(p->entered_counts, ioctl_counts, sizeof(ioctl_counts));
+}
+
+static void profile_end(enum profile_phase phase)
+{
+	struct profile_phase_rec *p = &profile_phases[phase];
+	int x;
+
+	if (!profile_file)
+		return;
+	p->usec += profile_now_us() - p->entered_us;
+	for (x = 0; x < PROF_IOCTL_NRS; x++)
+		p->counts[x] += ioctl_counts[x] - p->entered_counts[x];
+}
+
+static void profile_span(enum profile_phase phase, int span,
+			 long long start_us, long long usec,
+			 unsigned long ioctls)
+{
+	struct profile_span_rec *tmp;
+
+	if (!profile_file)
+		return;
+	tmp = realloc(profile_spans, (profile_numspans + 1) * sizeof(*tmp));
+	if (!tmp)
+		return;
+	profile_spans = tmp;
+	tmp[profile_numspans].phase = phase;
+	tmp[profile_numspans].span = span;
+	tmp[profile_numspans].start_us = start_us;
+	tmp[profile_numspans].usec = usec;
+	tmp[profile_numspans].ioctls = ioctls;
+	profile_numspans++;
+}
+
+static void profile_print_ioctl_name(FILE *fp, int nr)
+{
+	if (nr == PROF_IOCTL_OTHER)
+		fprintf(fp, "\"other\"");
+	else
+		fprintf(fp, "\"%s\"", profile_ioctl_names[nr].name);
+}
+
+/* Called at exit, as dahdi_cfg exits from all over the place */
+static void profile_write(void)
+{
+	struct profile_phase_rec *p;
+	unsigned long total;
+	FILE *fp;
+	bool first;
+	int x, nr;
+
+	if (strcmp(profile_file, "-") == 0) {
+		fp = stdout;
+	} else {
+		fp = fopen(profile_file, "w");
+		if (!fp) {
+			fprintf(stderr, "Unable to write profile to '%s': %s\n",
+				profile_file, strerror(errno));
+			return;
+		}
+	}
+	fprintf(fp, "{\n\t\"version\": 1,\n");
+	fprintf(fp, "\t\"workers\": %d,\n", workers);
+	fprintf(fp, "\t\"total_us\": %lld,\n", profile_now_us());
+	fprintf(fp, "\t\"phases\": [");
+	first = true;
+	for (x = 0; x < PROF_NUM_PHASES; x++) {
+		p = &profile_phases[x];
+		if (!p->used)
+			continue;
+		total = 0;
+		for (nr = 0; nr < PROF_IOCTL_NRS; nr++)
+			total += p->counts[nr];
+		fprintf(fp, "%s\n\t\t{ \"name\": \"%s\", \"start_us\": %lld, "
+			"\"duration_us\": %lld, \"ioctls\": %lu, \"by_ioctl\": {",
+			first ? "" : ",", profile_phase_names[x],
+			p->start_us, p->usec, total);
+		first = false;
+		total = 0;
+		for (nr = 0; nr < PROF_IOCTL_NRS; nr++) {
+			if (!p->counts[nr])
+				continue;
+			fprintf(fp, "%s ", total++ ? "," : "");
+			profile_print_ioctl_name(fp, nr);
+			fprintf(fp, ": %lu", p->counts[nr]);
+		}
+		fprintf(fp, " } }");
+	}
+	fprintf(fp, "\n\t],\n\t\"spans\": [");
+	for (x = 0; x < profile_numspans; x++) {
+		fprintf(fp, "%s\n\t\t{ \"phase\": \"%s\", \"span\": %d, "
+			"\"start_us\": %lld, \"duration_us\": %lld, "
+			"\"ioctls\": %lu }",
+			x ? "," : "",
+			profile_phase_names[profile_spans[x].phase],
+			profile_spans[x].span, profile_spans[x].start_us,
+			profile_spans[x].usec, profile_spans[x].ioctls);
+	}
+	fprintf(fp, "\n\t]\n}\n");
+	if (fp == stdout)
+		fflush(fp);
+	else
+		fclose(fp);
+}
+
+/*
+ * Snapshot of the configuration applied by the last successful run.
+ *
+ * Spans and channels whose resolved configuration is identical to the
+ * snapshot are not touched again, unless -f is given. A span entry also
+ * keeps a fingerprint of what DAHDI_SPANSTAT reported after it was
+ * configured, so spans that were reset, unassigned or replaced by another
+ * device since then are detected (at one ioctl per span) and reapplied.
+ *
+ * The kernel does not tell which tone zone data it holds, so a digest of
+ * every zone image loaded is kept as well. A zone is not freed and loaded
+ * again while its image is unchanged.
+ */
+#define SNAPSHOT_MAGIC		0x44434653	/* "DCFS" */
+#define SNAPSHOT_VERSION	2
+
+struct snapshot_header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned long long ctl_ino;	/* Identity of the control device */
+	long long ctl_ctime;
+	int numspans;
+	int numchans;
+	int numzones;
+	int reserved;
+};
+
+struct snapshot_span {
+	int spanno;
+	int configured;			/* lc is from a 'span=' line */
+	struct dahdi_lineconfig lc;
+	/* Fingerprint from DAHDI_SPANSTAT */
+	char name[20];
+	char location[40];
+	int lineconfig;
+	int lbo;
+	int numchans;
+	int totalchans;
+};
+
+struct snapshot_chan {
+	int spanno;
+	int fiftysix;
+	struct dahdi_chanconfig cc;
+	struct dahdi_attach_echocan ae;
+};
+
+struct snapshot_zone {
+	int zone;
+	int loaded;
+	unsigned long long digest;	/* fnv1a64() of the loaded image */
+};
+
+static struct snapshot_span snap_spans[DAHDI_MAX_SPANS];
+static struct snapshot_chan snap_chans[DAHDI_MAX_CHANNELS];
+static struct snapshot_zone snap_zones[DAHDI_TONE_ZONE_MAX];
+static bool zone_touched[DAHDI_TONE_ZONE_MAX];	/* Checked this run */
+static bool snap_loaded = false;
+static bool span_valid[DAHDI_MAX_SPANS];	/* Kernel still matches snapshot */
+static bool span_dirty[DAHDI_MAX_SPANS];	/* Touched during this run */
+static bool span_reconfigured[DAHDI_MAX_SPANS];	/* DAHDI_SPANCONFIG this run */
+static bool chan_unchanged[DAHDI_MAX_CHANNELS];
+
 static const char *lbostr[] = {
 "0 db (CSU)/0-133 feet (DSX-1)",
 "133-266 feet (DSX-1)",
@@ -142,7 +545,7 @@ static const char *laws[] = {
 
 static bool _are_all_spans_assigned(const char *device_path)
 {
-	char attribute[1036];
+	char attribute[PATH_MAX + 16];
 	int res;
 	FILE *fp;
 	int span_count;
@@ -165,6 +568,8 @@ static bool _are_all_spans_assigned(const char *device_path)
 	}
 
 	dirp = opendir(device_path);
+	if (!dirp)
+		return false;
 	while (span_count) {
 		dirent = readdir(dirp);
 		if (NULL == dirent)
@@ -188,9 +593,12 @@ static bool are_all_spans_assigned(void)
 	DIR *dirp;
 	struct dirent *dirent;
 	bool res = true;
-	char device_path[1024];
+	char device_path[PATH_MAX];
+	char devices_path[PATH_MAX / 2];
 
-	dirp = opendir("/sys/bus/dahdi_devices/devices");
+	snprintf(devices_path, sizeof(devices_path),
+		 "%s/sys/bus/dahdi_devices/devices", virt_top);
+	dirp = opendir(devices_path);
 	if (!dirp) {
 		/* If we cannot open dahdi_devices, either dahdi isn't loaded,
 		 * or we're using an older version of DAHDI that doesn't use
@@ -209,7 +617,7 @@ static bool are_all_spans_assigned(void)
 			continue;
 
 		snprintf(device_path, sizeof(device_path)-1,
-			 "/sys/bus/dahdi_devices/devices/%s", dirent->d_name);
+			 "%s/%s", devices_path, dirent->d_name);
 		res = _are_all_spans_assigned(device_path);
 	}
 
@@ -218,19 +626,234 @@ static bool are_all_spans_assigned(void)
 	return res;
 }
 
+/*
+ * Waiting for span assignment.
+ *
+ * Rather than polling sysfs, we wake up on kernel uevents of the
+ * dahdi_devices / dahdi_spans subsystems (and on inotify events, which
+ * is what a fake tree under DAHDI_VIRT_TOP generates). Sysfs is checked
+ * again only when something happened. If no event source is available,
+ * or events are somehow missed, we fall back to polling.
+ */
+#define SPAN_POLL_MSEC		100	/* Without event sources */
+#define SPAN_FALLBACK_MSEC	1000	/* Recheck even without events */
+
+#ifdef __linux__
+static int open_uevent_socket(void)
+{
+	struct sockaddr_nl addr;
+	int sock;
+
+	sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		      NETLINK_KOBJECT_UEVENT);
+	if (sock < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;	/* Kernel uevents */
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* (Re)add watches on the devices directory and every device in it */
+static void watch_devices(int ifd)
+{
+	char path[PATH_MAX];
+	DIR *dirp;
+	struct dirent *dirent;
+	const uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_TO;
+
+	snprintf(path, sizeof(path), "%s/sys/bus/dahdi_devices/devices",
+		 virt_top);
+	inotify_add_watch(ifd, path, mask);
+	dirp = opendir(path);
+	if (!dirp)
+		return;
+	while ((dirent = readdir(dirp))) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path),
+			 "%s/sys/bus/dahdi_devices/devices/%s",
+			 virt_top, dirent->d_name);
+		inotify_add_watch(ifd, path, mask);
+	}
+	closedir(dirp);
+}
+
+/* Returns true if any of the uevents read is about DAHDI */
+static bool read_uevents(int sock)
+{
+	char buf[4096];
+	bool relevant = false;
+	ssize_t len;
+	ssize_t i;
+
+	while ((len = recv(sock, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[len] = '\0';
+		/* NUL separated "KEY=value" strings */
+		for (i = 0; i < len; i += strlen(buf + i) + 1) {
+			if (!strncmp(buf + i, "SUBSYSTEM=dahdi", 15))
+				relevant = true;
+		}
+	}
+	return relevant;
+}
+
+static bool read_inotify(int ifd)
+{
+	char buf[4096];
+	bool any = false;
+
+	while (read(ifd, buf, sizeof(buf)) > 0)
+		any = true;
+	return any;
+}
+#endif
+
+static long elapsed_msec(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
 static bool wait_for_all_spans_assigned(unsigned long timeout_sec)
 {
-	bool all_assigned = are_all_spans_assigned();
-	unsigned int timeout = 10*timeout_sec;
+	struct pollfd pfd[2];
+	struct timespec start;
+	int sock = -1;
+	int ifd = -1;
+	int nfds = 0;
+	long remaining;
+	int wait;
+	bool all_assigned;
+	bool check = true;
+	int x;
+
+	if (are_all_spans_assigned())
+		return true;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+#ifdef __linux__
+	sock = open_uevent_socket();
+	if (sock >= 0) {
+		pfd[nfds].fd = sock;
+		pfd[nfds++].events = POLLIN;
+	}
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd >= 0) {
+		watch_devices(ifd);
+		pfd[nfds].fd = ifd;
+		pfd[nfds++].events = POLLIN;
+	}
+#endif
 
-	while (!all_assigned && --timeout) {
-		usleep(100000);
-		all_assigned = are_all_spans_assigned();
+	/* Events may have been missed until the sources were set up */
+	while (!(all_assigned = (check && are_all_spans_assigned()))) {
+		remaining = timeout_sec * 1000 - elapsed_msec(&start);
+		if (remaining <= 0)
+			break;
+		if (!nfds) {
+			wait = (remaining < SPAN_POLL_MSEC) ? remaining : SPAN_POLL_MSEC;
+			usleep(wait * 1000);
+			continue;
+		}
+		wait = (remaining < SPAN_FALLBACK_MSEC) ? remaining : SPAN_FALLBACK_MSEC;
+		if (poll(pfd, nfds, wait) <= 0) {
+			check = true;	/* No news, recheck anyway */
+			continue;
+		}
+		check = false;
+#ifdef __linux__
+		for (x = 0; x < nfds; x++) {
+			if (!(pfd[x].revents & POLLIN))
+				continue;
+			if (pfd[x].fd == sock) {
+				if (read_uevents(sock))
+					check = true;
+			} else if (pfd[x].fd == ifd && read_inotify(ifd)) {
+				watch_devices(ifd);
+				check = true;
+			}
+		}
+#endif
 	}
 
+	for (x = 0; x < nfds; x++)
+		close(pfd[x].fd);
 	return all_assigned;
 }
 
+/*
+ * All dynamic spans are created first, and then waited for together.
+ * The wait ends as soon as the last one is assigned.
+ */
+#define DYNAMIC_WAIT_SEC	5
+#define DYNAMIC_SPANS_PER_SEC	100	/* Extra time for many spans */
+
+/**
+ * report_unassigned_dynamic - Name the dynamic spans still unassigned.
+ * @timeout_sec: how long they were waited for
+ *
+ * The kernel names a dynamic span "DYN/<driver>/<address>".
+ */
+static void report_unassigned_dynamic(unsigned long timeout_sec)
+{
+	static bool assigned[NUM_DYNAMIC];
+	char path[PATH_MAX];
+	char name[40];	/* Kernel span names are truncated to this */
+	char want[sizeof(zds[0].driver) + sizeof(zds[0].addr) + 8];
+	DIR *dirp;
+	struct dirent *dirent;
+	FILE *fp;
+	char *nl;
+	int x;
+
+	memset(assigned, 0, sizeof(assigned));
+	snprintf(path, sizeof(path), "%s/sys/bus/dahdi_spans/devices",
+		 virt_top);
+	dirp = opendir(path);
+	if (!dirp)
+		return;
+	while ((dirent = readdir(dirp))) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path),
+			 "%s/sys/bus/dahdi_spans/devices/%s/name",
+			 virt_top, dirent->d_name);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+		if (!fgets(name, sizeof(name), fp))
+			name[0] = '\0';
+		fclose(fp);
+		nl = strchr(name, '\n');
+		if (nl)
+			*nl = '\0';
+		if (strncmp(name, "DYN/", 4))
+			continue;
+		for (x = 0; x < numdynamic; x++) {
+			snprintf(want, sizeof(want), "DYN/%.*s/%.*s",
+				 (int)sizeof(zds[x].driver), zds[x].driver,
+				 (int)sizeof(zds[x].addr), zds[x].addr);
+			if (!strncmp(name, want, sizeof(name) - 1))
+				assigned[x] = true;
+		}
+	}
+	closedir(dirp);
+	for (x = 0; x < numdynamic; x++) {
+		if (!assigned[x])
+			fprintf(stderr, "Dynamic span %d (%s/%s) not assigned "
+				"after %lu seconds\n", x + 1,
+				zds[x].driver, zds[x].addr, timeout_sec);
+	}
+}
+
 static const char *sigtype_to_str(const int sig)
 {
 	switch (sig) {
@@ -329,17 +952,29 @@ static char *trim(char *buf)
 	return buf;
 }
 
+/* Is a span to be configured (not excluded by -S)? */
+static bool span_selected(int span)
+{
+	if (!restrict_spans)
+		return true;
+	return span > 0 && span < DAHDI_MAX_SPANS && selected_spans[span];
+}
+
 static int skip_channel(int x)
 {
+	int span;
+
 	if (restrict_channels) {
-		if (!selected_channels[x])
+		if (!chanset_has(&selected_channels, x))
 			return 1;
-	} else {
-		if (only_span && !declared_spans[only_span]) {
-			fprintf(stderr,
-				"Error: analog span %d given to '-S', without '-C' restriction.\n",
-				only_span);
-			exit(1);
+	} else if (restrict_spans) {
+		for (span = 1; span < DAHDI_MAX_SPANS; span++) {
+			if (selected_spans[span] && !declared_spans[span]) {
+				fprintf(stderr,
+					"Error: analog span %d given to '-S', without '-C' restriction.\n",
+					span);
+				exit(1);
+			}
 		}
 	}
 	return 0;
@@ -423,10 +1058,14 @@ int spanconfig(char *keyword, char *args)
 		return -1;
 	}
 	res = sscanf(realargs[0], "%d", &span);
-	if (res != 1) {
+	if ((res != 1) || (span < 1) || (span >= DAHDI_MAX_SPANS)) {
 		error("Span number should be a valid span number, not '%s'\n", realargs[0]);
 		return -1;
 	}
+	/* Each line is a job of its own, so with -j they may race */
+	if (declared_spans[span] && workers > 1)
+		fprintf(stderr, "Warning: line %d: span %d is configured more than once, the order of its lines is not kept with -j\n",
+			lineno, span);
 	declared_spans[span] = 1;
 	res = sscanf(realargs[1], "%d", &timing);
 	if ((res != 1) || (timing < 0) || (timing > MAX_TIMING)) {
@@ -498,62 +1137,75 @@ int spanconfig(char *keyword, char *args)
 	return 0;
 }
 
-int apply_channels(int chans[], char *argstr)
+/**
+ * apply_channels - Add a list of channels and channel ranges to a set.
+ * @chans: the set to add to
+ * @argstr: e.g. "1-15,17-31,40". Modified in place.
+ *
+ * Returns the number of list items, or -1 on error.
+ */
+int apply_channels(struct chanset *chans, char *argstr)
 {
-	char *args[DAHDI_MAX_CHANNELS+1];
-	char *range[3];
-	int res,x, res2,y;
+	char *item, *next;
+	char *dash;
+	int res = 0;
+	int res2;
 	int chan;
 	int start, finish;
-	char argcopy[256];
-	res = parseargs(argstr, args, DAHDI_MAX_CHANNELS, ',');
-	if (res < 0) {
-		error("Too many arguments...  Max is %d\n", DAHDI_MAX_CHANNELS);
-		return -1;
-	}
-	for (x=0;x<res;x++) {
-		if (strchr(args[x], '-')) {
+
+	for (item = argstr; item; item = next) {
+		next = strchr(item, ',');
+		if (next)
+			*next++ = '\0';
+		item = trim(item);
+		if (!*item) {
+			if (!next)	/* Trailing comma */
+				break;
+			error("Syntax error.  Channel should be a number from 1 to %d, not '%s'\n", DAHDI_MAX_CHANNELS - 1, item);
+			return -1;
+		}
+		res++;
+		dash = strchr(item, '-');
+		if (dash) {
 			/* It's a range */
-			dahdi_copy_string(argcopy, args[x], sizeof(argcopy));
-			res2 = parseargs(argcopy, range, 2, '-');
-			if (res2 != 2) {
-				error("Syntax error in range '%s'.  Should be <val1>-<val2>.\n", args[x]);
+			*dash++ = '\0';
+			if (strchr(dash, '-')) {
+				error("Syntax error in range '%s-%s'.  Should be <val1>-<val2>.\n", item, dash);
 				return -1;
 			}
-			res2 =sscanf(range[0], "%d", &start);
+			res2 =sscanf(item, "%d", &start);
 			if (res2 != 1) {
-				error("Syntax error.  Start of range '%s' should be a number from 1 to %d\n", args[x], DAHDI_MAX_CHANNELS - 1);
+				error("Syntax error.  Start of range '%s-%s' should be a number from 1 to %d\n", item, dash, DAHDI_MAX_CHANNELS - 1);
 				return -1;
 			} else if ((start < 1) || (start >= DAHDI_MAX_CHANNELS)) {
-				error("Start of range '%s' must be between 1 and %d (not '%d')\n", args[x], DAHDI_MAX_CHANNELS - 1, start);
+				error("Start of range '%s-%s' must be between 1 and %d (not '%d')\n", item, dash, DAHDI_MAX_CHANNELS - 1, start);
 				return -1;
 			}
-			res2 =sscanf(range[1], "%d", &finish);
+			res2 =sscanf(dash, "%d", &finish);
 			if (res2 != 1) {
-				error("Syntax error.  End of range '%s' should be a number from 1 to %d\n", args[x], DAHDI_MAX_CHANNELS - 1);
+				error("Syntax error.  End of range '%s-%s' should be a number from 1 to %d\n", item, dash, DAHDI_MAX_CHANNELS - 1);
 				return -1;
 			} else if ((finish < 1) || (finish >= DAHDI_MAX_CHANNELS)) {
-				error("end of range '%s' must be between 1 and %d (not '%d')\n", args[x], DAHDI_MAX_CHANNELS - 1, finish);
+				error("end of range '%s-%s' must be between 1 and %d (not '%d')\n", item, dash, DAHDI_MAX_CHANNELS - 1, finish);
 				return -1;
 			}
 			if (start > finish) {
-				error("Range '%s' should start before it ends\n", args[x]);
+				error("Range '%s-%s' should start before it ends\n", item, dash);
 				return -1;
 			}
-			for (y=start;y<=finish;y++)
-				chans[y]=1;
+			chanset_add_range(chans, start, finish);
 		} else {
 			/* It's a single channel */
-			res2 =sscanf(args[x], "%d", &chan);
+			res2 =sscanf(item, "%d", &chan);
 			if (res2 != 1) {
-				error("Syntax error.  Channel should be a number from 1 to %d, not '%s'\n", DAHDI_MAX_CHANNELS - 1, args[x]);
+				error("Syntax error.  Channel should be a number from 1 to %d, not '%s'\n", DAHDI_MAX_CHANNELS - 1, item);
 				return -1;
 			} else if ((chan < 1) || (chan >= DAHDI_MAX_CHANNELS)) {
 				error("Channel must be between 1 and %d (not '%d')\n", DAHDI_MAX_CHANNELS - 1, chan);
 				return -1;
 			}
-			chans[chan]=1;
-		}		
+			chanset_add_range(chans, chan, chan);
+		}
 	}
 	return res;
 }
@@ -591,155 +1243,128 @@ static int parse_channel(char *channel, int *startchan)
 	return 0;
 }
 
+/* Channel signalling keywords, see handlers[] */
+enum chan_keyword {
+	KW_NONE = 0,
+	KW_SIGTYPE,	/* Just sets the sigtype of the handler */
+	KW_CAS,
+	KW_DACS,
+	KW_CLEAR,	/* Possibly with slaves */
+	KW_NETHDLC,
+	KW_DCHAN,
+	KW_HARDHDLC,
+	KW_MTP2,
+};
+
+struct handler {
+	char *keyword;
+	int (*func)(char *keyword, char *args);
+	enum chan_keyword kw;
+	int sigtype;
+};
+
+static const struct handler *find_handler(const char *keyword);
+
 static int chanconfig(char *keyword, char *args)
 {
-	int chans[DAHDI_MAX_CHANNELS];
+	struct chanset chans;
+	const struct handler *h;
 	int res = 0;
 	int x;
 	int master=0;
 	int dacschan = 0;
 	char *idle;
-	bzero(chans, sizeof(chans));
+
+	h = find_handler(keyword);
+	if (!h || h->func != chanconfig) {
+		fprintf(stderr, "Huh? (%s)\n", keyword);
+		return -1;
+	}
+	memset(&chans, 0, sizeof(chans));
 	strtok(args, ":");
 	idle = strtok(NULL, ":");
-	if (!strcasecmp(keyword, "dacs") || !strcasecmp(keyword, "dacsrbs")) {
+	if (h->kw == KW_DACS) {
 		res = parse_channel(idle, &dacschan);
 	}
 	if (!res)
-		res = apply_channels(chans, args);
+		res = apply_channels(&chans, args);
 	if (res <= 0)
 		return -1;
-	for (x=1;x<DAHDI_MAX_CHANNELS;x++) {
-		if (chans[x]) {
-			if (slineno[x]) {
-				error("Channel %d already configured as '%s' at line %d\n", x, sig[x], slineno[x]);
-				continue;
-			}
-			if ((!strcasecmp(keyword, "dacs") || !strcasecmp(keyword, "dacsrbs")) && slineno[dacschan]) {
-				error("DACS Destination channel %d already configured as '%s' at line %d\n", dacschan, sig[dacschan], slineno[dacschan]);
-				continue;
-			} else {
-				cc[dacschan].chan = dacschan;
-				cc[dacschan].master = dacschan;
-				slineno[dacschan] = lineno;
-			}
-			cc[x].chan = x;
-			cc[x].master = x;
-			slineno[x] = lineno;
-			if (!strcasecmp(keyword, "e&m")) {
-				cc[x].sigtype = DAHDI_SIG_EM;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "e&me1")) {
-				cc[x].sigtype = DAHDI_SIG_EM_E1;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "fxsls")) {
-				cc[x].sigtype = DAHDI_SIG_FXSLS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "fxsgs")) {
-				cc[x].sigtype = DAHDI_SIG_FXSGS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "fxsks")) {
-				cc[x].sigtype = DAHDI_SIG_FXSKS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "fxols")) {
-				cc[x].sigtype = DAHDI_SIG_FXOLS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "fxogs")) {
-				cc[x].sigtype = DAHDI_SIG_FXOGS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "fxoks")) {
-				cc[x].sigtype = DAHDI_SIG_FXOKS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "cas") || !strcasecmp(keyword, "user")) {
-				if (parse_idle(&cc[x].idlebits, idle))
-					return -1;
-				cc[x].sigtype = DAHDI_SIG_CAS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "dacs")) {
-				/* Setup channel for monitor */
-				cc[x].idlebits = dacschan;
-				cc[x].sigtype = DAHDI_SIG_DACS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-				/* Setup inverse */
-				cc[dacschan].idlebits = x;
-				cc[dacschan].sigtype = DAHDI_SIG_DACS;
-				sig[x] = sigtype_to_str(cc[dacschan].sigtype);
-				dacschan++;
-			} else if (!strcasecmp(keyword, "dacsrbs")) {
-				/* Setup channel for monitor */
-				cc[x].idlebits = dacschan;
-				cc[x].sigtype = DAHDI_SIG_DACS_RBS;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-				/* Setup inverse */
-				cc[dacschan].idlebits = x;
-				cc[dacschan].sigtype = DAHDI_SIG_DACS_RBS;
-				sig[x] = sigtype_to_str(cc[dacschan].sigtype);
-				dacschan++;
-			} else if (!strcasecmp(keyword, "unused")) {
-				cc[x].sigtype = 0;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "indclear") || !strcasecmp(keyword, "bchan")) {
-				cc[x].sigtype = DAHDI_SIG_CLEAR;
-				sig[x] = sigtype_to_str(cc[x].sigtype);
-			} else if (!strcasecmp(keyword, "clear")) {
-				sig[x] = sigtype_to_str(DAHDI_SIG_CLEAR);
-				if (master) {
-					cc[x].sigtype = DAHDI_SIG_SLAVE;
-					cc[x].master = master;
-				} else {
-					cc[x].sigtype = DAHDI_SIG_CLEAR;
-					master = x;
-				}
-			} else if (!strcasecmp(keyword, "rawhdlc")) {
-				sig[x] = sigtype_to_str(DAHDI_SIG_HDLCRAW);
-				if (master) {
-					cc[x].sigtype = DAHDI_SIG_SLAVE;
-					cc[x].master = master;
-				} else {
-					cc[x].sigtype = DAHDI_SIG_HDLCRAW;
-					master = x;
-				}
-			} else if (!strcasecmp(keyword, "nethdlc")) {
-				sig[x] = sigtype_to_str(DAHDI_SIG_HDLCNET);
+	chanset_foreach(&chans, x) {
+		if (slineno[x]) {
+			error("Channel %d already configured as '%s' at line %d\n", x, sig[x], slineno[x]);
+			continue;
+		}
+		if ((h->kw == KW_DACS) && slineno[dacschan]) {
+			error("DACS Destination channel %d already configured as '%s' at line %d\n", dacschan, sig[dacschan], slineno[dacschan]);
+			continue;
+		} else {
+			cc[dacschan].chan = dacschan;
+			cc[dacschan].master = dacschan;
+			slineno[dacschan] = lineno;
+		}
+		cc[x].chan = x;
+		cc[x].master = x;
+		slineno[x] = lineno;
+		switch (h->kw) {
+		case KW_SIGTYPE:
+			cc[x].sigtype = h->sigtype;
+			sig[x] = sigtype_to_str(cc[x].sigtype);
+			break;
+		case KW_CAS:
+			if (parse_idle(&cc[x].idlebits, idle))
+				return -1;
+			cc[x].sigtype = DAHDI_SIG_CAS;
+			sig[x] = sigtype_to_str(cc[x].sigtype);
+			break;
+		case KW_DACS:
+			/* Setup channel for monitor */
+			cc[x].idlebits = dacschan;
+			cc[x].sigtype = h->sigtype;
+			sig[x] = sigtype_to_str(cc[x].sigtype);
+			/* Setup inverse */
+			cc[dacschan].idlebits = x;
+			cc[dacschan].sigtype = h->sigtype;
+			dacschan++;
+			break;
+		case KW_CLEAR:
+		case KW_NETHDLC:
+			sig[x] = sigtype_to_str(h->sigtype);
+			if (h->kw == KW_NETHDLC)
 				memset(cc[x].netdev_name, 0, sizeof(cc[x].netdev_name));
-				if (master) {
-					cc[x].sigtype = DAHDI_SIG_SLAVE;
-					cc[x].master = master;
-				} else {
-					cc[x].sigtype = DAHDI_SIG_HDLCNET;
-					if (idle) {
-					    dahdi_copy_string(cc[x].netdev_name, idle, sizeof(cc[x].netdev_name));
-					}
-					master = x;
-				}
-			} else if (!strcasecmp(keyword, "fcshdlc")) {
-				sig[x] = sigtype_to_str(DAHDI_SIG_HDLCFCS);
-				if (master) {
-					cc[x].sigtype = DAHDI_SIG_SLAVE;
-					cc[x].master = master;
-				} else {
-					cc[x].sigtype = DAHDI_SIG_HDLCFCS;
-					master = x;
-				}
-			} else if (!strcasecmp(keyword, "dchan")) {
-				sig[x] = "D-channel";
-				cc[x].sigtype = DAHDI_SIG_HDLCFCS;
-			} else if (!strcasecmp(keyword, "hardhdlc")) {
-				sig[x] = "Hardware assisted D-channel";
-				cc[x].sigtype = DAHDI_SIG_HARDHDLC;
-			} else if (!strcasecmp(keyword, "mtp2")) {
-				sig[x] = "MTP2";
-				cc[x].sigtype = DAHDI_SIG_MTP2;
+			if (master) {
+				cc[x].sigtype = DAHDI_SIG_SLAVE;
+				cc[x].master = master;
 			} else {
-				fprintf(stderr, "Huh? (%s)\n", keyword);
+				cc[x].sigtype = h->sigtype;
+				if (h->kw == KW_NETHDLC && idle) {
+				    dahdi_copy_string(cc[x].netdev_name, idle, sizeof(cc[x].netdev_name));
+				}
+				master = x;
 			}
+			break;
+		case KW_DCHAN:
+			sig[x] = "D-channel";
+			cc[x].sigtype = DAHDI_SIG_HDLCFCS;
+			break;
+		case KW_HARDHDLC:
+			sig[x] = "Hardware assisted D-channel";
+			cc[x].sigtype = DAHDI_SIG_HARDHDLC;
+			break;
+		case KW_MTP2:
+			sig[x] = "MTP2";
+			cc[x].sigtype = DAHDI_SIG_MTP2;
+			break;
+		default:
+			fprintf(stderr, "Huh? (%s)\n", keyword);
+			break;
+		}
 
-			if (cc[x].sigtype != DAHDI_SIG_CAS &&
-			    cc[x].sigtype != DAHDI_SIG_DACS &&
-			    cc[x].sigtype != DAHDI_SIG_DACS_RBS) {
-				if (NULL != idle) {
-					fprintf(stderr, "WARNING: idlebits are not valid on %s channels.\n", sig[x]);
-				}
+		if (cc[x].sigtype != DAHDI_SIG_CAS &&
+		    cc[x].sigtype != DAHDI_SIG_DACS &&
+		    cc[x].sigtype != DAHDI_SIG_DACS_RBS) {
+			if (NULL != idle) {
+				fprintf(stderr, "WARNING: idlebits are not valid on %s channels.\n", sig[x]);
 			}
 		}
 	}
@@ -751,10 +1376,10 @@ static int setlaw(char *keyword, char *args)
 	int res;
 	int law;
 	int x;
-	int chans[DAHDI_MAX_CHANNELS];
+	struct chanset chans;
 
-	bzero(chans, sizeof(chans));
-	res = apply_channels(chans, args);
+	memset(&chans, 0, sizeof(chans));
+	res = apply_channels(&chans, args);
 	if (res <= 0)
 		return -1;
 	if (!strcasecmp(keyword, "alaw")) {
@@ -767,10 +1392,8 @@ static int setlaw(char *keyword, char *args)
 		fprintf(stderr, "Huh??? Don't know about '%s' law\n", keyword);
 		return -1;
 	}
-	for (x=0;x<DAHDI_MAX_CHANNELS;x++) {
-		if (chans[x])
-			cc[x].deflaw = law;
-	}
+	chanset_foreach(&chans, x)
+		cc[x].deflaw = law;
 	return 0;
 }
 
@@ -778,73 +1401,33 @@ static int setfiftysixkhdlc(char *keyword, char *args)
 {
 	int res;
 
-	res = apply_channels(fiftysixkhdlc, args);
+	res = apply_channels(&fiftysixkhdlc, args);
 	if (res <= 0)
 		return -1;
 
 	return 0;
 }
 
-static int apply_fiftysix(void)
+static int setechocan(char *keyword, char *args)
 {
+	int res;
+	struct chanset chans;
+	char *echocan, *chanlist;
 	int x;
-	int rate;
-	int chanfd;
-
-	for (x = 1; x < DAHDI_MAX_CHANNELS; x++) {
-		if (skip_channel(x) || !cc[x].sigtype)
-			continue;
 
-		chanfd = open("/dev/dahdi/channel", O_RDWR);
-		if (chanfd == -1) {
-			fprintf(stderr, 
-			    "Couldn't open /dev/dahdi/channel: %s\n", 
-			    strerror(errno));
-			return -1;	
-		}
+	memset(&chans, 0, sizeof(chans));
+	echocan = strtok(args, ",");
 
-		if (ioctl(chanfd, DAHDI_SPECIFY, &x)) {
-			close(chanfd);
-			continue;
+	while ((chanlist = strtok(NULL, ","))) {
+		res = apply_channels(&chans, chanlist);
+		if (res <= 0) {
+			return -1;
 		}
+	}
 
-		if (fiftysixkhdlc[x]) {
-			printf("Setting channel %d to 56K mode (only valid on HDLC channels)\n", x);
-			rate = 56;
-		} else {
-			rate = 64;
-		}
-
-		if (ioctl(chanfd, DAHDI_HDLC_RATE, &rate)) {
-			fprintf(stderr, "Error setting HDLC rate\n");
-			exit(-1);
-		}
-		close(chanfd);
-	}
-	return 0;
-}
-
-static int setechocan(char *keyword, char *args)
-{
-	int res;
-	int chans[DAHDI_MAX_CHANNELS] = { 0, };
-	char *echocan, *chanlist;
-	unsigned int x;
-
-	echocan = strtok(args, ",");
-
-	while ((chanlist = strtok(NULL, ","))) {
-		res = apply_channels(chans, chanlist);
-		if (res <= 0) {
-			return -1;
-		}
-	}
-
-	for (x = 0; x < DAHDI_MAX_CHANNELS; x++) {
-		if (chans[x]) {
-			dahdi_copy_string(ae[x].echocan, echocan, sizeof(ae[x].echocan));
-		}
-	}
+	chanset_foreach(&chans, x) {
+		dahdi_copy_string(ae[x].echocan, echocan, sizeof(ae[x].echocan));
+	}
 
 	return 0;
 }
@@ -1194,131 +1777,35 @@ int cor_thresh(char *keyword, char *args)
 
 static int rad_chanconfig(char *keyword, char *args)
 {
-	int chans[DAHDI_MAX_CHANNELS];
+	struct chanset chans;
+	struct rad_params *r;
 	int res = 0;
-	int x,i,n;
-	struct dahdi_radio_param p;
-	int chanfd;
+	int x;
 
 	toneindex = 1;
-	bzero(chans, sizeof(chans));
-	res = apply_channels(chans, args);
+	memset(&chans, 0, sizeof(chans));
+	res = apply_channels(&chans, args);
 	if (res <= 0)
 		return -1;
-	for (x=1;x<DAHDI_MAX_CHANNELS;x++) {
-		if (chans[x]) {
-			const char *CHANNEL_FILENAME = "/dev/dahdi/channel";
-			chanfd = open(CHANNEL_FILENAME, O_RDWR);
-			if (-1 == chanfd) {
-				error("Failed to open '%s'.\n", CHANNEL_FILENAME);
-				exit(-1);
-			}
-
-			res = ioctl(chanfd, DAHDI_SPECIFY, &x);
-			if (res) {
-				error("Failed to open channel %d.\n", x);
-				close(chanfd);
-				continue;
-			}
-			p.radpar = DAHDI_RADPAR_NUMTONES;
-			if (ioctl(chanfd,DAHDI_RADIO_GETPARAM,&p) == -1)
-				n = 0;
-			else
-				n = p.data;
-
-			if (n)
-			{
-				p.radpar = DAHDI_RADPAR_INITTONE;
-				if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1) {
-					error("Cannot init tones for channel %d\n",x);
-				}
-				if (!rxtones[0]) for(i = 1; i <= n; i++)
-				{
-					if (rxtones[i])
-					{
-						p.radpar = DAHDI_RADPAR_RXTONE;
-						p.index = i;
-						p.data = rxtones[i];
-						if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-							error("Cannot set rxtone on channel %d\n",x);
-					}
-					if (rxtags[i])
-					{
-						p.radpar = DAHDI_RADPAR_RXTONECLASS;
-						p.index = i;
-						p.data = rxtags[i];
-						if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-							error("Cannot set rxtag on channel %d\n",x);
-					}
-					if (txtones[i])
-					{
-						p.radpar = DAHDI_RADPAR_TXTONE;
-						p.index = i;
-						p.data = txtones[i];
-						if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-							error("Cannot set txtone on channel %d\n",x);
-					}
-				} else { /* if we may have DCS receive */
-					if (rxtones[0])
-					{
-						p.radpar = DAHDI_RADPAR_RXTONE;
-						p.index = 0;
-						p.data = rxtones[0];
-						if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-							error("Cannot set DCS rxtone on channel %d\n",x);
-					}
-				}
-				if (txtones[0])
-				{
-					p.radpar = DAHDI_RADPAR_TXTONE;
-					p.index = 0;
-					p.data = txtones[0];
-					if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-						error("Cannot set default txtone on channel %d\n",x);
-				}
-			}
-			if (debouncetime)
-			{
-				p.radpar = DAHDI_RADPAR_DEBOUNCETIME;
-				p.data = debouncetime;
-				if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-					error("Cannot set debouncetime on channel %d\n",x);
-			}
-			if (bursttime)
-			{
-				p.radpar = DAHDI_RADPAR_BURSTTIME;
-				p.data = bursttime;
-				if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-					error("Cannot set bursttime on channel %d\n",x);
-			}
-			p.radpar = DAHDI_RADPAR_DEEMP;
-			p.data = deemp;
-			ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p);
-			p.radpar = DAHDI_RADPAR_PREEMP;
-			p.data = preemp;
-			ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p);
-			p.radpar = DAHDI_RADPAR_TXGAIN;
-			p.data = txgain;
-			ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p);
-			p.radpar = DAHDI_RADPAR_RXGAIN;
-			p.data = rxgain;
-			ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p);
-			p.radpar = DAHDI_RADPAR_INVERTCOR;
-			p.data = invertcor;
-			ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p);
-			p.radpar = DAHDI_RADPAR_EXTRXTONE;
-			p.data = exttone;
-			ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p);
-			if (corthresh)
-			{
-				p.radpar = DAHDI_RADPAR_CORTHRESH;
-				p.data = corthresh - 1;
-				if (ioctl(chanfd,DAHDI_RADIO_SETPARAM,&p) == -1)
-					error("Cannot set corthresh on channel %d\n",x);
-			}
-
-			close(chanfd);
+	/* Applied along with the other per-channel settings, see job_chansetup() */
+	chanset_foreach(&chans, x) {
+		if (!rad[x] && !(rad[x] = malloc(sizeof(*rad[x])))) {
+			error("Out of memory\n");
+			return -1;
 		}
+		r = rad[x];
+		memcpy(r->rxtones, rxtones, sizeof(r->rxtones));
+		memcpy(r->rxtags, rxtags, sizeof(r->rxtags));
+		memcpy(r->txtones, txtones, sizeof(r->txtones));
+		r->bursttime = bursttime;
+		r->debouncetime = debouncetime;
+		r->invertcor = invertcor;
+		r->exttone = exttone;
+		r->corthresh = corthresh;
+		r->txgain = txgain;
+		r->rxgain = rxgain;
+		r->deemp = deemp;
+		r->preemp = preemp;
 	}
 	clear_fields();
 	return 0;
@@ -1326,6 +1813,106 @@ static int rad_chanconfig(char *keyword, char *args)
 
 /* End Radio functions */
 
+/*
+ * Index of the relationships between channels, built once the whole
+ * configuration is known: slaves of each master (in channel order), DACS
+ * peers and the span each channel belongs to (from sysfs, 0 if unknown).
+ */
+struct chan_links {
+	int first_slave;	/* 0 if none */
+	int next_slave;		/* Next slave of the same master */
+	int dacs_peer;		/* 0 if not a DACS channel */
+	int span;
+};
+
+static struct chan_links links[DAHDI_MAX_CHANNELS];
+
+static int read_span_attr(int spanno, const char *attr, int *value);
+
+static void build_chan_links(void)
+{
+	static int last_slave[DAHDI_MAX_CHANNELS];
+	int basechan, channels;
+	int master;
+	int x;
+
+	memset(links, 0, sizeof(links));
+	memset(last_slave, 0, sizeof(last_slave));
+	for (x = 1; x < DAHDI_MAX_CHANNELS; x++) {
+		if (!cc[x].sigtype)
+			continue;
+		if ((cc[x].sigtype & __DAHDI_SIG_DACS) == __DAHDI_SIG_DACS) {
+			links[x].dacs_peer = cc[x].idlebits;
+			continue;
+		}
+		master = cc[x].master;
+		if (master < 1 || master >= DAHDI_MAX_CHANNELS)
+			continue;
+		if (last_slave[master])
+			links[last_slave[master]].next_slave = x;
+		else
+			links[master].first_slave = x;
+		last_slave[master] = x;
+	}
+	for (x = 1; x < DAHDI_MAX_SPANS; x++) {
+		if (read_span_attr(x, "basechan", &basechan) ||
+		    read_span_attr(x, "channels", &channels))
+			continue;
+		if (basechan < 1 || channels < 1 ||
+		    basechan + channels > DAHDI_MAX_CHANNELS)
+			continue;
+		for (master = basechan; master < basechan + channels; master++)
+			links[master].span = x;
+	}
+}
+
+#define chan_foreach_slave(master, y) \
+	for ((y) = links[master].first_slave; (y); (y) = links[y].next_slave)
+
+/* Report an inconsistency at the line that configured channel x */
+#define link_error(x, fmt, ...) \
+	do { \
+		lineno = slineno[x]; \
+		error(fmt, ## __VA_ARGS__); \
+	} while (0)
+
+/**
+ * check_chan_links - Cross-channel checks of the configuration.
+ *
+ * Every slave must belong to a configured master that is not a slave
+ * itself, every DACS channel must be the peer of its own peer, and
+ * with -S, the channels given to -C must be on the given spans.
+ */
+static void check_chan_links(void)
+{
+	int master;
+	int peer;
+	int x;
+
+	for (x = 1; x < DAHDI_MAX_CHANNELS; x++) {
+		if (!cc[x].sigtype)
+			continue;
+		if (cc[x].sigtype == DAHDI_SIG_SLAVE) {
+			master = cc[x].master;
+			if (master < 1 || master >= DAHDI_MAX_CHANNELS ||
+			    !cc[master].sigtype ||
+			    cc[master].sigtype == DAHDI_SIG_SLAVE)
+				link_error(x, "Channel %d is a slave of channel %d, which is not a master\n",
+					   x, master);
+		}
+		peer = links[x].dacs_peer;
+		if (peer && (peer >= DAHDI_MAX_CHANNELS ||
+			     links[peer].dacs_peer != x))
+			link_error(x, "DACS channel %d is connected to %d, which is not connected back\n",
+				   x, peer);
+		if (restrict_spans && restrict_channels && links[x].span &&
+		    chanset_has(&selected_channels, x) &&
+		    !span_selected(links[x].span))
+			fprintf(stderr, "Warning: channel %d given to '-C' is on span %d, not given to '-S'\n",
+				x, links[x].span);
+	}
+}
+
 static void printconfig(int fd)
 {
 	int x,y;
@@ -1344,7 +1931,7 @@ static void printconfig(int fd)
 	       "Configuration\n"
 	       "======================\n\n", vi.version, vi.echo_canceller);
 	for (x = 0; x < spans; x++) {
-		if (only_span && only_span != lc[x].span)
+		if (!span_selected(lc[x].span))
 			continue;
 		printf("SPAN %d: %3s/%4s Build-out: %s\n",
 		       lc[x].span,
@@ -1373,10 +1960,8 @@ static void printconfig(int fd)
 				else {
 					printf("Channel %02d: %s (%s)", x, sig[x], laws[cc[x].deflaw]);
 					printf(" (Echo Canceler: %s)", ae[x].echocan[0] ? ae[x].echocan : "none");
-					for (y=1;y<DAHDI_MAX_CHANNELS;y++) {
-						if (cc[y].master == x)  {
-							printf("%s%02d", ps++ ? " " : " (Slaves: ", y);
-						}
+					chan_foreach_slave(x, y) {
+						printf("%s%02d", ps++ ? " " : " (Slaves: ", y);
 					}
 				}
 				if (ps)
@@ -1397,260 +1982,2570 @@ static void printconfig(int fd)
 	printf("\n%d channels to configure.\n\n", configs);
 }
 
-static struct handler {
-	char *keyword;
-	int (*func)(char *keyword, char *args);
-} handlers[] = {
-	{ "span", spanconfig },
-	{ "dynamic", dspanconfig },
-	{ "loadzone", registerzone },
-	{ "defaultzone", defaultzone },
-	{ "e&m", chanconfig },
-	{ "e&me1", chanconfig },
-	{ "fxsls", chanconfig },
-	{ "fxsgs", chanconfig },
-	{ "fxsks", chanconfig },
-	{ "fxols", chanconfig },
-	{ "fxogs", chanconfig },
-	{ "fxoks", chanconfig },
-	{ "rawhdlc", chanconfig },
-	{ "nethdlc", chanconfig },
-	{ "fcshdlc", chanconfig },
-	{ "hardhdlc", chanconfig },
-	{ "mtp2", chanconfig },
-	{ "dchan", chanconfig },
-	{ "bchan", chanconfig },
-	{ "indclear", chanconfig },
-	{ "clear", chanconfig },
-	{ "unused", chanconfig },
-	{ "cas", chanconfig },
-	{ "dacs", chanconfig },
-	{ "dacsrbs", chanconfig },
-	{ "user", chanconfig },
-	{ "alaw", setlaw },
-	{ "mulaw", setlaw },
-	{ "deflaw", setlaw },
-	{ "ctcss", ctcss },
-	{ "dcsrx", dcsrx },
-	{ "rxdcs", dcsrx },
-	{ "tx", tx },
-	{ "debouncetime", debounce_time },
-	{ "bursttime", burst_time },
-	{ "exttone", ext_tone },
-	{ "invertcor", invert_cor },
-	{ "corthresh", cor_thresh },
-	{ "rxgain", rx_gain },
-	{ "txgain", tx_gain },
-	{ "deemp", de_emp },
-	{ "preemp", pre_emp },
-	{ "channel", rad_chanconfig },
-	{ "channels", rad_chanconfig },
-	{ "echocanceller", setechocan },
-	{ "56k", setfiftysixkhdlc },
-};
-
-static char *readline()
+static int ctl_identity(int fd, unsigned long long *ino, long long *ctime)
 {
-	static char buf[256];
-	char *c;
-	do {
-		if (!fgets(buf, sizeof(buf), cf)) 
-			return NULL;
-		/* Strip comments */
-		c = strchr(buf, '#');
-		if (c)
-			*c = '\0';
-		trim(buf);
-		lineno++;
-	} while (!strlen(buf));
-	return buf;
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -1;
+	*ino = st.st_ino;
+	*ctime = st.st_ctime;
+	return 0;
 }
 
-static void usage(char *argv0, int exitcode)
+static int span_fingerprint(int fd, int spanno, struct snapshot_span *ss)
 {
-	char *c;
-	c = strrchr(argv0, '/');
-	if (!c)
-		c = argv0;
-	else
-		c++;
-	fprintf(stderr, "%s\n", dahdi_tools_version);
-	fprintf(stderr, 
-		"Usage: %s [options]\n"
-		"    Valid options are:\n"
-		"  -c <filename>     -- Use <filename> instead of " CONFIG_FILENAME "\n"
-		"  -d [level]        -- Generate debugging output. (Default level is 1.)\n"
-		"  -f                -- Always reconfigure every channel\n"
-		"  -h                -- Generate this help statement\n"
-		"  -s                -- Shutdown spans only\n"
-		"  -t                -- Test mode only, do not apply\n"
-		"  -C <chan_list>    -- Only configure specified channels\n"
-		"  -S <spanno>       -- Only configure specified span\n"
-		"  -v                -- Verbose (more -v's means more verbose)\n"
-	,c);
-	exit(exitcode);
+	struct dahdi_spaninfo si;
+
+	memset(&si, 0, sizeof(si));
+	si.spanno = spanno;
+	if (ioctl(fd, DAHDI_SPANSTAT, &si))
+		return -1;
+	ss->spanno = spanno;
+	dahdi_copy_string(ss->name, si.name, sizeof(ss->name));
+	dahdi_copy_string(ss->location, si.location, sizeof(ss->location));
+	ss->lineconfig = si.lineconfig;
+	ss->lbo = si.lbo;
+	ss->numchans = si.numchans;
+	ss->totalchans = si.totalchans;
+	return 0;
 }
 
-static int chan_restrict(char *str)
+static bool same_fingerprint(const struct snapshot_span *a,
+			     const struct snapshot_span *b)
 {
-	if (apply_channels(selected_channels, str) < 0)
-		return 0;
-	restrict_channels = 1;
-	return 1;
+	return !strcmp(a->name, b->name) &&
+		!strcmp(a->location, b->location) &&
+		a->lineconfig == b->lineconfig &&
+		a->lbo == b->lbo &&
+		a->numchans == b->numchans &&
+		a->totalchans == b->totalchans;
 }
 
-static int span_restrict(char *str)
+/* Forget what other runs may have changed since the snapshot was loaded */
+static void snapshot_forget_others(void)
 {
-	long	spanno;
-	char	*endptr;
+	int x;
 
-	spanno = strtol(str, &endptr, 10);
-	if (endptr == str) {
-		fprintf(stderr, "Missing valid span number after '-S'\n");
-		return 0;
+	for (x = 1; x < DAHDI_MAX_SPANS; x++) {
+		if (!span_selected(x))
+			memset(&snap_spans[x], 0, sizeof(snap_spans[x]));
 	}
-	if (*endptr != '\0') {
-		fprintf(stderr, "Extra garbage after span number in '-S'\n");
-		return 0;
+	for (x = 1; x < DAHDI_MAX_CHANNELS; x++) {
+		if (skip_channel(x))
+			memset(&snap_chans[x], 0, sizeof(snap_chans[x]));
 	}
-	only_span = spanno;
-	return 1;
-}
-
-static const char *SEM_NAME = "dahdi_cfg";
-static sem_t *lock = SEM_FAILED;
-
-static void signal_handler(int signal)
-{
-	if (SEM_FAILED != lock) {
-		sem_unlink(SEM_NAME);
+	for (x = 0; x < DAHDI_TONE_ZONE_MAX; x++) {
+		if (!zone_touched[x])
+			memset(&snap_zones[x], 0, sizeof(snap_zones[x]));
 	}
-	/* The default handler should have been restored before this handler was
-	 * called, so we can let the "normal" processing finish the cleanup. */
-	raise(signal);
 }
 
-int main(int argc, char *argv[])
+/**
+ * snapshot_read - Read the state file.
+ * @fd: the control device
+ * @merge: only take the spans, channels and zones this run did not touch
+ *
+ * The snapshot is ignored if the control device was recreated since it
+ * was written (i.e. the dahdi module was reloaded).
+ *
+ * Runs restricted to other spans may have saved the file since this run
+ * loaded it. Merging their entries before saving keeps them.
+ */
+static void snapshot_read(int fd, bool merge)
 {
-	int c;
-	char *buf;
-	char *key, *value;
-	int x,found;
-	int exit_code = 0;
-	struct sigaction act;
+	struct snapshot_header h;
+	struct snapshot_span ss;
+	struct snapshot_chan sc;
+	struct snapshot_zone sz;
+	unsigned long long ino;
+	long long ctime;
+	FILE *fp;
+	int x;
 
-	while((c = getopt(argc, argv, "fthc:vsd::C:S:")) != -1) {
-		switch(c) {
-		case 'c':
-			filename=optarg;
-			break;
-		case 'h':
-			usage(argv[0], 0);
-			break;
-		case '?':
-			usage(argv[0], 1);
-			break;
-		case 'v':
-			verbose++;
-			break;
-		case 'f':
-			force++;
-			break;
-		case 't':
-			dry_run = 1;
-			break;
-		case 's':
-			stopmode = 1;
-			break;
-		case 'C':
-			if (!chan_restrict(optarg))
-				usage(argv[0], 1);
-			break;
-		case 'S':
-			if (!span_restrict(optarg))
-				usage(argv[0], 1);
-			break;
-		case 'd':
-			if (optarg)
-				debug = atoi(optarg);
-			else
-				debug = 1;	
-			break;
-		}
+	if (merge)
+		snapshot_forget_others();
+	fp = fopen(STATE_FILENAME, "r");
+	if (!fp)
+		return;
+	if (fread(&h, sizeof(h), 1, fp) != 1 ||
+	    h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION ||
+	    ctl_identity(fd, &ino, &ctime) ||
+	    h.ctl_ino != ino || h.ctl_ctime != ctime) {
+		if (verbose && !merge)
+			printf("Ignoring stale state file %s\n", STATE_FILENAME);
+		goto out;
 	}
-	
-	if (verbose) {
-		fprintf(stderr, "%s\n", dahdi_tools_version);
+	for (x = 0; x < h.numspans; x++) {
+		if (fread(&ss, sizeof(ss), 1, fp) != 1 ||
+		    ss.spanno < 1 || ss.spanno >= DAHDI_MAX_SPANS)
+			goto corrupt;
+		if (!merge || !span_selected(ss.spanno))
+			snap_spans[ss.spanno] = ss;
 	}
-
-	if (!restrict_channels && only_span) {
-		error("-S requires -C\n");
-		goto finish;
+	for (x = 0; x < h.numchans; x++) {
+		if (fread(&sc, sizeof(sc), 1, fp) != 1 ||
+		    sc.cc.chan < 1 || sc.cc.chan >= DAHDI_MAX_CHANNELS ||
+		    sc.spanno < 1 || sc.spanno >= DAHDI_MAX_SPANS)
+			goto corrupt;
+		if (!merge || skip_channel(sc.cc.chan))
+			snap_chans[sc.cc.chan] = sc;
 	}
-	if (!restrict_channels && !only_span) {
-		bool all_assigned = wait_for_all_spans_assigned(5);
-
-		if (!all_assigned) {
-			fprintf(stderr,
-				"Timeout waiting for all spans to be assigned.\n");
-		}
+	for (x = 0; x < h.numzones; x++) {
+		if (fread(&sz, sizeof(sz), 1, fp) != 1 ||
+		    sz.zone < 0 || sz.zone >= DAHDI_TONE_ZONE_MAX)
+			goto corrupt;
+		if (!merge || !zone_touched[sz.zone])
+			snap_zones[sz.zone] = sz;
 	}
-
-	if (fd == -1) fd = open(MASTER_DEVICE, O_RDWR);
-	if (fd < 0) {
-		error("Unable to open master device '%s'\n", MASTER_DEVICE);
-		goto finish;
+	if (!merge)
+		snap_loaded = true;
+	goto out;
+corrupt:
+	fprintf(stderr, "Ignoring corrupt state file %s\n", STATE_FILENAME);
+	if (merge) {
+		snapshot_forget_others();
+		goto out;
 	}
-	if (strcmp(filename, "-") == 0)
-		cf = fdopen(STDIN_FILENO, "r");
-	else
-		cf = fopen(filename, "r");
-	if (cf) {
-		while((buf = readline())) {
-			if (*buf == 10) /* skip new line */
-				continue;
+	memset(snap_spans, 0, sizeof(snap_spans));
+	memset(snap_chans, 0, sizeof(snap_chans));
+	memset(snap_zones, 0, sizeof(snap_zones));
+out:
+	fclose(fp);
+}
 
-			if (debug & DEBUG_READER) 
-				fprintf(stderr, "Line %d: %s\n", lineno, buf);
+static void snapshot_load(int fd)
+{
+	snapshot_read(fd, false);
+}
 
-			if ((value = strchr(buf, '='))) {
-				*value++ = '\0';
-				value = trim(value);
-				key = trim(buf);
-			}
+/**
+ * snapshot_validate - Check which spans of the snapshot the kernel still has.
+ *
+ * Must be called after dynamic spans were destroyed, so that their
+ * channels are always reapplied.
+ */
+static void snapshot_validate(int fd)
+{
+	struct snapshot_span cur;
+	int x;
 
-			if (!value || !*value || !*key) {
-				error("Syntax error. Should be <keyword>=<value>\n");
-				continue;
-			}
+	if (!snap_loaded)
+		return;
+	for (x = 1; x < DAHDI_MAX_SPANS; x++) {
+		if (!snap_spans[x].spanno)
+			continue;
+		memset(&cur, 0, sizeof(cur));
+		if (span_fingerprint(fd, x, &cur))
+			continue;
+		span_valid[x] = same_fingerprint(&cur, &snap_spans[x]);
+		if (!span_valid[x] && verbose > 1)
+			printf("Span %d changed since last run\n", x);
+	}
+}
 
-			if (debug & DEBUG_PARSER)
-				fprintf(stderr, "Keyword: [%s], Value: [%s]\n", key, value);
+/* Index x is into lc[] */
+static bool span_unchanged(int x)
+{
+	const struct snapshot_span *ss = &snap_spans[lc[x].span];
 
-			found = 0;
-			for (x = 0; x < sizeof(handlers) / sizeof(handlers[0]); x++) {
-				if (!strcasecmp(key, handlers[x].keyword)) {
-					found++;
-					handlers[x].func(key, value);
-					break;
-				}
-			}
+	return snap_loaded && span_valid[lc[x].span] && ss->configured &&
+		!memcmp(&ss->lc, &lc[x], sizeof(lc[x]));
+}
 
-			if (!found) 
-				error("Unknown keyword '%s'\n", key);
-		}
-		if (debug & DEBUG_READER)
-			fprintf(stderr, "<End of File>\n");
-		/* fclose(cf); // causes seg fault (double free) */
+static bool channel_unchanged(int x)
+{
+	const struct snapshot_chan *sc = &snap_chans[x];
+
+	if (!snap_loaded || !sc->spanno)
+		return false;
+	if (!span_valid[sc->spanno] || span_reconfigured[sc->spanno])
+		return false;
+	return !memcmp(&sc->cc, &cc[x], sizeof(cc[x])) &&
+		!strcmp(sc->ae.echocan, ae[x].echocan) &&
+		sc->fiftysix == chanset_has(&fiftysixkhdlc, x);
+}
+
+static void snapshot_record_span(int x)
+{
+	struct snapshot_span *ss = &snap_spans[lc[x].span];
+
+	ss->configured = 1;
+	ss->lc = lc[x];
+	span_dirty[lc[x].span] = true;
+	span_reconfigured[lc[x].span] = true;
+}
+
+static void snapshot_record_chan(int x, int spanno)
+{
+	struct snapshot_chan *sc = &snap_chans[x];
+
+	memset(sc, 0, sizeof(*sc));
+	if (spanno < 1 || spanno >= DAHDI_MAX_SPANS)
+		return;
+	sc->spanno = spanno;
+	sc->fiftysix = chanset_has(&fiftysixkhdlc, x);
+	sc->cc = cc[x];
+	sc->ae = ae[x];
+	span_dirty[spanno] = true;
+}
+
+static void snapshot_discard(void)
+{
+	if (unlink(STATE_FILENAME) && errno != ENOENT)
+		fprintf(stderr, "Failed to remove %s: %s\n",
+			STATE_FILENAME, strerror(errno));
+}
+
+/**
+ * snapshot_save - Write the state applied so far for the next run.
+ *
+ * Entries outside of a -S/-C restriction are taken from the file as it
+ * is now, since concurrent runs for other spans may have updated it.
+ */
+static void snapshot_save(int fd)
+{
+	char tmpname[] = STATE_FILENAME ".XXXXXX";
+	bool referenced[DAHDI_MAX_SPANS] = { false, };
+	struct snapshot_header h;
+	FILE *fp;
+	int tmpfd;
+	int failed;
+	int x;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = SNAPSHOT_MAGIC;
+	h.version = SNAPSHOT_VERSION;
+	if (ctl_identity(fd, &h.ctl_ino, &h.ctl_ctime))
+		return;
+	if (restrict_spans || restrict_channels)
+		snapshot_read(fd, true);
+
+	/* Forget whatever is no longer in the configuration */
+	if (!restrict_spans) {
+		for (x = 1; x < DAHDI_MAX_SPANS; x++)
+			snap_spans[x].configured = 0;
+		for (x = 0; x < spans; x++)
+			snap_spans[lc[x].span].configured = 1;
+	}
+	for (x = 1; x < DAHDI_MAX_CHANNELS; x++) {
+		if (!skip_channel(x) && !cc[x].sigtype)
+			memset(&snap_chans[x], 0, sizeof(snap_chans[x]));
+	}
+
+	for (x = 1; x < DAHDI_MAX_SPANS; x++) {
+		if (span_dirty[x] && span_fingerprint(fd, x, &snap_spans[x]))
+			memset(&snap_spans[x], 0, sizeof(snap_spans[x]));
+	}
+	for (x = 1; x < DAHDI_MAX_CHANNELS; x++) {
+		if (!snap_chans[x].spanno)
+			continue;
+		if (snap_spans[snap_chans[x].spanno].spanno) {
+			referenced[snap_chans[x].spanno] = true;
+			h.numchans++;
+		} else {
+			memset(&snap_chans[x], 0, sizeof(snap_chans[x]));
+		}
+	}
+	for (x = 1; x < DAHDI_MAX_SPANS; x++) {
+		if (snap_spans[x].spanno &&
+		    (snap_spans[x].configured || referenced[x]))
+			h.numspans++;
+		else
+			snap_spans[x].spanno = 0;
+	}
+	for (x = 0; x < DAHDI_TONE_ZONE_MAX; x++) {
+		if (snap_zones[x].loaded)
+			h.numzones++;
+	}
+
+	if (mkdir(STATE_DIR, 0755) && errno != EEXIST) {
+		if (verbose)
+			printf("Not saving state: %s: %s\n",
+			       STATE_DIR, strerror(errno));
+		return;
+	}
+	tmpfd = mkstemp(tmpname);
+	if (tmpfd < 0) {
+		if (verbose)
+			printf("Not saving state: %s: %s\n",
+			       tmpname, strerror(errno));
+		return;
+	}
+	fp = fdopen(tmpfd, "w");
+	if (!fp) {
+		close(tmpfd);
+		unlink(tmpname);
+		return;
+	}
+	fwrite(&h, sizeof(h), 1, fp);
+	for (x = 1; x < DAHDI_MAX_SPANS; x++) {
+		if (snap_spans[x].spanno)
+			fwrite(&snap_spans[x], sizeof(snap_spans[x]), 1, fp);
+	}
+	for (x = 1; x < DAHDI_MAX_CHANNELS; x++) {
+		if (snap_chans[x].spanno)
+			fwrite(&snap_chans[x], sizeof(snap_chans[x]), 1, fp);
+	}
+	for (x = 0; x < DAHDI_TONE_ZONE_MAX; x++) {
+		if (snap_zones[x].loaded)
+			fwrite(&snap_zones[x], sizeof(snap_zones[x]), 1, fp);
+	}
+	failed = ferror(fp);
+	if (fclose(fp) || failed || rename(tmpname, STATE_FILENAME)) {
+		fprintf(stderr, "Failed to save %s: %s\n",
+			STATE_FILENAME, strerror(errno));
+		unlink(tmpname);
+	}
+}
+
+/*
+ * Compiled configuration cache.
+ *
+ * After a successful parse, the resolved configuration (span, channel,
+ * dynamic span and echo canceller tables, plus the built tone zone
+ * images) is written to CACHE_FILENAME. A later run whose configuration
+ * file still has the same identity, modification time and contents maps
+ * that file instead of parsing the text and building the zones again.
+ *
+ * Every section is padded to CACHE_ALIGN bytes.
+ */
+#define CACHE_MAGIC	0x44434643	/* "DCFC" */
+#define CACHE_VERSION	2
+#define CACHE_ALIGN	8
+
+struct cache_header {
+	unsigned int magic;
+	unsigned int version;
+	char tools_version[64];
+	unsigned int sizes[4];		/* Of the kernel structures */
+	char source[PATH_MAX];
+	unsigned long long src_dev;
+	unsigned long long src_ino;
+	long long src_size;
+	long long src_mtime_sec;
+	long long src_mtime_nsec;
+	unsigned long long src_hash;
+	unsigned int numspans;
+	unsigned int numchans;
+	unsigned int numdynamic;
+	unsigned int numzones;
+	int deftonezone;
+	unsigned int payload_len;
+	unsigned long long payload_hash;
+};
+
+struct cache_chan {
+	int chan;
+	int slineno;
+	int fiftysix;
+	char sig[40];
+	struct dahdi_chanconfig cc;
+	struct dahdi_attach_echocan ae;
+	int has_rad;
+	struct rad_params rad;
+};
+
+struct cache_zone {
+	char name[sizeof(zonestoload[0])];
+	unsigned int len;
+	unsigned long long zone_hash;	/* Of the libtonezone definition */
+};
+
+#define CACHE_PAD(len)	(((len) + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1))
+
+#define FNV1A64_INIT	0xcbf29ce484222325ULL
+
+/* Continue the hash @h over more data */
+static unsigned long long fnv1a64_add(unsigned long long h,
+				      const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static unsigned long long fnv1a64(const void *data, size_t len)
+{
+	return fnv1a64_add(FNV1A64_INIT, data, len);
+}
+
+/* A string field, up to and with its NUL */
+static unsigned long long fnv1a64_str(unsigned long long h,
+				      const char *s, size_t size)
+{
+	return fnv1a64_add(fnv1a64_add(h, s, strnlen(s, size)), "", 1);
+}
+
+/* Of the fields of the definition: the padding between them is not hashed */
+static unsigned long long zone_hash(const char *name)
+{
+	struct tone_zone *z = tone_zone_find((char *)name);
+	unsigned long long h = FNV1A64_INIT;
+	int x;
+
+	if (!z)
+		return 0;
+	h = fnv1a64_add(h, &z->zone, sizeof(z->zone));
+	h = fnv1a64_str(h, z->country, sizeof(z->country));
+	h = fnv1a64_str(h, z->description, sizeof(z->description));
+	h = fnv1a64_add(h, z->ringcadence, sizeof(z->ringcadence));
+	for (x = 0; x < DAHDI_TONE_MAX; x++) {
+		h = fnv1a64_add(h, &z->tones[x].toneid,
+				sizeof(z->tones[x].toneid));
+		h = fnv1a64_str(h, z->tones[x].data, sizeof(z->tones[x].data));
+	}
+	h = fnv1a64_add(h, &z->dtmf_high_level, sizeof(z->dtmf_high_level));
+	h = fnv1a64_add(h, &z->dtmf_low_level, sizeof(z->dtmf_low_level));
+	h = fnv1a64_add(h, &z->mfr1_level, sizeof(z->mfr1_level));
+	h = fnv1a64_add(h, &z->mfr2_level, sizeof(z->mfr2_level));
+	return h;
+}
+
+/**
+ * build_zone_images - Build the images of the zones to load.
+ *
+ * Defaults to the "us" zone if none was given. A zone that fails
+ * to build is left to tone_zone_register_zones(), to report the error.
+ */
+static void build_zone_images(void)
+{
+	struct tone_zone *z;
+	char *buf;
+	int len;
+	int x;
+
+	if (0 == numzones) {
+		/* Default to the us zone if one wasn't specified. */
+		dahdi_copy_string(zonestoload[numzones++], "us", sizeof(zonestoload[0]));
+		deftonezone = 0;
+	}
+	for (x = 0; x < numzones; x++) {
+		z = tone_zone_find(zonestoload[x]);
+		if (!z)
+			continue;
+		buf = malloc(TONE_ZONE_IMAGE_MAX);
+		if (!buf)
+			continue;
+		len = tone_zone_build_image(z, buf, TONE_ZONE_IMAGE_MAX);
+		if (len < 0) {
+			free(buf);
+			continue;
+		}
+		zone_images[x].data = buf;
+		zone_images[x].len = len;
+	}
+}
+
+/**
+ * load_zone_image - Load a built zone, unless the kernel already has it.
+ * @fd: the control device to use
+ * @zi: the image to load
+ * @skipped: set when the zone was left as loaded
+ */
+static int load_zone_image(int fd, const struct zone_image *zi, bool *skipped)
+{
+	const struct dahdi_tone_def_header *h = zi->data;
+	unsigned long long digest = fnv1a64(zi->data, zi->len);
+	struct snapshot_zone *sz = NULL;
+	int res;
+
+	if (h->zone >= 0 && h->zone < DAHDI_TONE_ZONE_MAX) {
+		sz = &snap_zones[h->zone];
+		zone_touched[h->zone] = true;
+	}
+	if (sz && snap_loaded && sz->loaded && sz->digest == digest) {
+		*skipped = true;
+		return 0;
+	}
+	res = tone_zone_load_image(fd, zi->data, zi->len);
+	if (sz) {
+		memset(sz, 0, sizeof(*sz));
+		if (!res) {
+			sz->zone = h->zone;
+			sz->loaded = 1;
+			sz->digest = digest;
+		}
+	}
+	return res;
+}
+
+static void cache_header_init(struct cache_header *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->magic = CACHE_MAGIC;
+	h->version = CACHE_VERSION;
+	dahdi_copy_string(h->tools_version, dahdi_tools_version,
+			  sizeof(h->tools_version));
+	h->sizes[0] = sizeof(struct dahdi_lineconfig);
+	h->sizes[1] = sizeof(struct dahdi_chanconfig);
+	h->sizes[2] = sizeof(struct dahdi_attach_echocan);
+	h->sizes[3] = sizeof(struct dahdi_dynamic_span);
+}
+
+static void cache_source_init(struct cache_header *h, const struct stat *st,
+			      unsigned long long hash)
+{
+	dahdi_copy_string(h->source, filename, sizeof(h->source));
+	h->src_dev = st->st_dev;
+	h->src_ino = st->st_ino;
+	h->src_size = st->st_size;
+	h->src_mtime_sec = st->st_mtim.tv_sec;
+	h->src_mtime_nsec = st->st_mtim.tv_nsec;
+	h->src_hash = hash;
+}
+
+/* Take the next padded section of a mapped cache, or NULL if too short */
+static const void *cache_get(const char **pos, const char *end, size_t len)
+{
+	const char *p = *pos;
+
+	if (end - p < CACHE_PAD(len))
+		return NULL;
+	*pos = p + CACHE_PAD(len);
+	return p;
+}
+
+static void cache_put(FILE *fp, const void *data, size_t len)
+{
+	static const char pad[CACHE_ALIGN];
+
+	fwrite(data, len, 1, fp);
+	fwrite(pad, CACHE_PAD(len) - len, 1, fp);
+}
+
+/**
+ * cache_load - Take the configuration from the cache, if still valid.
+ * @hash: fnv1a64() of the contents of the configuration file
+ *
+ * The mapping is kept until reset_config(): sig[] and zone_images[]
+ * point into it.
+ *
+ * Returns true if the configuration was loaded and need not be parsed.
+ */
+static bool cache_load(unsigned long long hash)
+{
+	struct cache_header want;
+	const struct cache_header *h;
+	const struct cache_chan *cch;
+	const struct cache_zone *cz;
+	const char *pos, *end;
+	struct stat st, cst;
+	void *map;
+	int cfd;
+	int x;
+
+	if (force || !strcmp(filename, "-"))
+		return false;
+	if (stat(filename, &st))
+		return false;
+	cfd = open(CACHE_FILENAME, O_RDONLY);
+	if (cfd < 0)
+		return false;
+	if (fstat(cfd, &cst) || cst.st_size < sizeof(*h)) {
+		close(cfd);
+		return false;
+	}
+	map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+	close(cfd);
+	if (map == MAP_FAILED)
+		return false;
+	h = map;
+
+	cache_header_init(&want);
+	if (h->magic != want.magic || h->version != want.version ||
+	    strncmp(h->tools_version, want.tools_version, sizeof(h->tools_version)) ||
+	    memcmp(h->sizes, want.sizes, sizeof(h->sizes)) ||
+	    strncmp(h->source, filename, sizeof(h->source)) ||
+	    h->src_dev != st.st_dev || h->src_ino != st.st_ino ||
+	    h->src_size != st.st_size ||
+	    h->src_mtime_sec != st.st_mtim.tv_sec ||
+	    h->src_mtime_nsec != st.st_mtim.tv_nsec ||
+	    h->payload_len != cst.st_size - sizeof(*h) ||
+	    h->numspans >= DAHDI_MAX_SPANS ||
+	    h->numdynamic > NUM_DYNAMIC ||
+	    h->numzones > DAHDI_TONE_ZONE_MAX ||
+	    h->src_hash != hash)
+		goto stale;
+	pos = (const char *)(h + 1);
+	end = pos + h->payload_len;
+	if (h->payload_hash != fnv1a64(pos, h->payload_len)) {
+		fprintf(stderr, "Ignoring corrupt %s\n", CACHE_FILENAME);
+		goto stale;
+	}
+
+	spans = h->numspans;
+	for (x = 0; x < spans; x++) {
+		const struct dahdi_lineconfig *l = cache_get(&pos, end, sizeof(*l));
+
+		if (!l || l->span < 1 || l->span >= DAHDI_MAX_SPANS)
+			goto corrupt;
+		lc[x] = *l;
+		declared_spans[l->span] = 1;
+	}
+	for (x = 0; x < h->numchans; x++) {
+		cch = cache_get(&pos, end, sizeof(*cch));
+		if (!cch || cch->chan < 1 || cch->chan >= DAHDI_MAX_CHANNELS)
+			goto corrupt;
+		cc[cch->chan] = cch->cc;
+		ae[cch->chan] = cch->ae;
+		slineno[cch->chan] = cch->slineno;
+		sig[cch->chan] = cch->sig[0] ? cch->sig : NULL;
+		if (cch->fiftysix)
+			chanset_add_range(&fiftysixkhdlc, cch->chan, cch->chan);
+		if (cch->has_rad) {
+			rad[cch->chan] = malloc(sizeof(*rad[cch->chan]));
+			if (!rad[cch->chan])
+				goto corrupt;
+			*rad[cch->chan] = cch->rad;
+		}
+	}
+	numdynamic = h->numdynamic;
+	for (x = 0; x < numdynamic; x++) {
+		const struct dahdi_dynamic_span *z = cache_get(&pos, end, sizeof(*z));
+
+		if (!z)
+			goto corrupt;
+		zds[x] = *z;
+	}
+	numzones = h->numzones;
+	for (x = 0; x < numzones; x++) {
+		cz = cache_get(&pos, end, sizeof(*cz));
+		if (!cz || cz->len > TONE_ZONE_IMAGE_MAX)
+			goto corrupt;
+		dahdi_copy_string(zonestoload[x], cz->name, sizeof(zonestoload[x]));
+		if (cz->zone_hash != zone_hash(zonestoload[x]))
+			goto corrupt;	/* libtonezone was upgraded */
+		if (!cz->len)
+			continue;
+		zone_images[x].data = (void *)cache_get(&pos, end, cz->len);
+		zone_images[x].len = cz->len;
+		if (!zone_images[x].data)
+			goto corrupt;
+	}
+	deftonezone = h->deftonezone;
+	cache_map = map;
+	cache_map_len = cst.st_size;
+	if (debug & DEBUG_READER)
+		fprintf(stderr, "Using cached configuration %s\n", CACHE_FILENAME);
+	return true;
+
+corrupt:
+	/* Undo whatever was taken from it */
+	spans = 0;
+	numdynamic = 0;
+	numzones = 0;
+	memset(lc, 0, sizeof(lc));
+	memset(cc, 0, sizeof(cc));
+	memset(ae, 0, sizeof(ae));
+	memset(sig, 0, sizeof(sig));
+	memset(slineno, 0, sizeof(slineno));
+	memset(declared_spans, 0, sizeof(declared_spans));
+	memset(&fiftysixkhdlc, 0, sizeof(fiftysixkhdlc));
+	memset(zone_images, 0, sizeof(zone_images));
+	for (x = 0; x < DAHDI_MAX_CHANNELS; x++) {
+		free(rad[x]);
+		rad[x] = NULL;
+	}
+stale:
+	munmap(map, cst.st_size);
+	return false;
+}
+
+/**
+ * cache_save - Save the parsed configuration for cache_load().
+ * @hash: fnv1a64() of the text it was parsed from
+ */
+static void cache_save(unsigned long long hash)
+{
+	char tmpname[] = CACHE_FILENAME ".XXXXXX";
+	struct cache_header h;
+	struct cache_chan cch;
+	struct cache_zone cz;
+	struct stat st;
+	char *payload = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int tmpfd;
+	int failed;
+	int x;
+
+	if (!strcmp(filename, "-") || stat(filename, &st))
+		return;
+
+	cache_header_init(&h);
+	cache_source_init(&h, &st, hash);
+	fp = open_memstream(&payload, &len);
+	if (!fp)
+		return;
+	for (x = 0; x < spans; x++)
+		cache_put(fp, &lc[x], sizeof(lc[x]));
+	h.numspans = spans;
+	for (x = 1; x < DAHDI_MAX_CHANNELS; x++) {
+		if (!slineno[x] && !cc[x].chan && !cc[x].deflaw &&
+		    !ae[x].echocan[0] && !chanset_has(&fiftysixkhdlc, x) &&
+		    !rad[x])
+			continue;
+		memset(&cch, 0, sizeof(cch));
+		cch.chan = x;
+		cch.slineno = slineno[x];
+		cch.fiftysix = chanset_has(&fiftysixkhdlc, x);
+		if (sig[x])
+			dahdi_copy_string(cch.sig, sig[x], sizeof(cch.sig));
+		cch.cc = cc[x];
+		cch.ae = ae[x];
+		if (rad[x]) {
+			cch.has_rad = 1;
+			cch.rad = *rad[x];
+		}
+		cache_put(fp, &cch, sizeof(cch));
+		h.numchans++;
+	}
+	for (x = 0; x < numdynamic; x++)
+		cache_put(fp, &zds[x], sizeof(zds[x]));
+	h.numdynamic = numdynamic;
+	for (x = 0; x < numzones; x++) {
+		memset(&cz, 0, sizeof(cz));
+		dahdi_copy_string(cz.name, zonestoload[x], sizeof(cz.name));
+		cz.len = zone_images[x].len;
+		cz.zone_hash = zone_hash(zonestoload[x]);
+		cache_put(fp, &cz, sizeof(cz));
+		if (cz.len)
+			cache_put(fp, zone_images[x].data, cz.len);
+	}
+	h.numzones = numzones;
+	h.deftonezone = deftonezone;
+	failed = ferror(fp);
+	if (fclose(fp) || failed) {
+		free(payload);
+		return;
+	}
+	h.payload_len = len;
+	h.payload_hash = fnv1a64(payload, len);
+
+	if (mkdir(STATE_DIR, 0755) && errno != EEXIST) {
+		if (verbose)
+			printf("Not saving cache: %s: %s\n",
+			       STATE_DIR, strerror(errno));
+		free(payload);
+		return;
+	}
+	tmpfd = mkstemp(tmpname);
+	if (tmpfd < 0) {
+		if (verbose)
+			printf("Not saving cache: %s: %s\n",
+			       tmpname, strerror(errno));
+		free(payload);
+		return;
+	}
+	fp = fdopen(tmpfd, "w");
+	if (!fp) {
+		close(tmpfd);
+		unlink(tmpname);
+		free(payload);
+		return;
+	}
+	fwrite(&h, sizeof(h), 1, fp);
+	fwrite(payload, len, 1, fp);
+	free(payload);
+	failed = ferror(fp);
+	if (fclose(fp) || failed || rename(tmpname, CACHE_FILENAME)) {
+		fprintf(stderr, "Failed to save %s: %s\n",
+			CACHE_FILENAME, strerror(errno));
+		unlink(tmpname);
+	}
+}
+
+static const struct handler handlers[] = {
+	{ "span", spanconfig },
+	{ "dynamic", dspanconfig },
+	{ "loadzone", registerzone },
+	{ "defaultzone", defaultzone },
+	{ "e&m", chanconfig, KW_SIGTYPE, DAHDI_SIG_EM },
+	{ "e&me1", chanconfig, KW_SIGTYPE, DAHDI_SIG_EM_E1 },
+	{ "fxsls", chanconfig, KW_SIGTYPE, DAHDI_SIG_FXSLS },
+	{ "fxsgs", chanconfig, KW_SIGTYPE, DAHDI_SIG_FXSGS },
+	{ "fxsks", chanconfig, KW_SIGTYPE, DAHDI_SIG_FXSKS },
+	{ "fxols", chanconfig, KW_SIGTYPE, DAHDI_SIG_FXOLS },
+	{ "fxogs", chanconfig, KW_SIGTYPE, DAHDI_SIG_FXOGS },
+	{ "fxoks", chanconfig, KW_SIGTYPE, DAHDI_SIG_FXOKS },
+	{ "rawhdlc", chanconfig, KW_CLEAR, DAHDI_SIG_HDLCRAW },
+	{ "nethdlc", chanconfig, KW_NETHDLC, DAHDI_SIG_HDLCNET },
+	{ "fcshdlc", chanconfig, KW_CLEAR, DAHDI_SIG_HDLCFCS },
+	{ "hardhdlc", chanconfig, KW_HARDHDLC },
+	{ "mtp2", chanconfig, KW_MTP2 },
+	{ "dchan", chanconfig, KW_DCHAN },
+	{ "bchan", chanconfig, KW_SIGTYPE, DAHDI_SIG_CLEAR },
+	{ "indclear", chanconfig, KW_SIGTYPE, DAHDI_SIG_CLEAR },
+	{ "clear", chanconfig, KW_CLEAR, DAHDI_SIG_CLEAR },
+	{ "unused", chanconfig, KW_SIGTYPE, 0 },
+	{ "cas", chanconfig, KW_CAS },
+	{ "dacs", chanconfig, KW_DACS, DAHDI_SIG_DACS },
+	{ "dacsrbs", chanconfig, KW_DACS, DAHDI_SIG_DACS_RBS },
+	{ "user", chanconfig, KW_CAS },
+	{ "alaw", setlaw },
+	{ "mulaw", setlaw },
+	{ "deflaw", setlaw },
+	{ "ctcss", ctcss },
+	{ "dcsrx", dcsrx },
+	{ "rxdcs", dcsrx },
+	{ "tx", tx },
+	{ "debouncetime", debounce_time },
+	{ "bursttime", burst_time },
+	{ "exttone", ext_tone },
+	{ "invertcor", invert_cor },
+	{ "corthresh", cor_thresh },
+	{ "rxgain", rx_gain },
+	{ "txgain", tx_gain },
+	{ "deemp", de_emp },
+	{ "preemp", pre_emp },
+	{ "channel", rad_chanconfig },
+	{ "channels", rad_chanconfig },
+	{ "echocanceller", setechocan },
+	{ "56k", setfiftysixkhdlc },
+};
+
+#define NUM_HANDLERS	(sizeof(handlers) / sizeof(handlers[0]))
+
+/*
+ * Keyword lookup: a collision free hash over the (case folded) keywords,
+ * with the seed chosen once on first use. A lookup is then a single hash
+ * and a single strcasecmp instead of a scan of the whole table.
+ */
+#define HANDLER_SLOTS	256
+
+static unsigned char handler_slot[HANDLER_SLOTS];	/* handler index + 1 */
+static unsigned int handler_seed;
+
+static unsigned int keyword_hash(const char *keyword, unsigned int seed)
+{
+	unsigned int h = 2166136261u ^ seed;
+
+	while (*keyword) {
+		h ^= (unsigned char)*keyword++ | 0x20;
+		h *= 16777619u;
+	}
+	return h ^ (h >> 15);
+}
+
+static void build_handler_hash(void)
+{
+	unsigned int seed;
+	int x;
+
+	for (seed = 1; ; seed++) {
+		memset(handler_slot, 0, sizeof(handler_slot));
+		for (x = 0; x < NUM_HANDLERS; x++) {
+			unsigned int slot = keyword_hash(handlers[x].keyword, seed) % HANDLER_SLOTS;
+
+			if (handler_slot[slot])
+				break;
+			handler_slot[slot] = x + 1;
+		}
+		if (x == NUM_HANDLERS)
+			break;
+	}
+	handler_seed = seed;
+}
+
+static const struct handler *find_handler(const char *keyword)
+{
+	const struct handler *h;
+	unsigned int slot;
+
+	if (!handler_seed)
+		build_handler_hash();
+	slot = handler_slot[keyword_hash(keyword, handler_seed) % HANDLER_SLOTS];
+	if (!slot)
+		return NULL;
+	h = &handlers[slot - 1];
+	return strcasecmp(keyword, h->keyword) ? NULL : h;
+}
+
+/**
+ * read_config - Read a whole configuration file into memory.
+ * @name: file name, or "-" for the standard input
+ *
+ * Returns a NUL terminated malloc()ed buffer, or NULL on failure.
+ */
+static char *read_config(const char *name)
+{
+	int cfd;
+	char *text = NULL;
+	size_t size = 0;
+	size_t len = 0;
+	ssize_t res;
+
+	if (strcmp(name, "-") == 0)
+		cfd = STDIN_FILENO;
+	else if ((cfd = open(name, O_RDONLY)) < 0)
+		return NULL;
+	for (;;) {
+		if (len + 1 >= size) {
+			char *tmp;
+
+			size = size ? size * 2 : 65536;
+			tmp = realloc(text, size);
+			if (!tmp)
+				break;
+			text = tmp;
+		}
+		res = read(cfd, text + len, size - len - 1);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0) {
+			if (res == 0) {
+				text[len] = '\0';
+				if (cfd != STDIN_FILENO)
+					close(cfd);
+				return text;
+			}
+			break;
+		}
+		len += res;
+	}
+	if (cfd != STDIN_FILENO)
+		close(cfd);
+	free(text);
+	return NULL;
+}
+
+/**
+ * parse_config - Parse configuration text and apply each keyword.
+ * @text: the whole file contents. Modified in place.
+ *
+ * A single pass over the buffer: every line is cut at its newline,
+ * stripped of comments and split at the '=' without copying it.
+ */
+static void parse_config(char *text)
+{
+	char *buf, *next, *c;
+	char *key, *value;
+	const struct handler *h;
+
+	for (buf = text; buf; buf = next) {
+		next = strchr(buf, '\n');
+		if (next)
+			*next++ = '\0';
+		lineno++;
+		/* Strip comments */
+		c = strchr(buf, '#');
+		if (c)
+			*c = '\0';
+		buf = trim(buf);
+		if (!*buf)
+			continue;
+
+		if (debug & DEBUG_READER)
+			fprintf(stderr, "Line %d: %s\n", lineno, buf);
+
+		key = buf;
+		if ((value = strchr(buf, '='))) {
+			*value++ = '\0';
+			value = trim(value);
+			key = trim(buf);
+		}
+
+		if (!value || !*value || !*key) {
+			error("Syntax error. Should be <keyword>=<value>\n");
+			continue;
+		}
+
+		if (debug & DEBUG_PARSER)
+			fprintf(stderr, "Keyword: [%s], Value: [%s]\n", key, value);
+
+		h = find_handler(key);
+		if (h)
+			h->func(key, value);
+		else
+			error("Unknown keyword '%s'\n", key);
+	}
+	if (debug & DEBUG_READER)
+		fprintf(stderr, "<End of File>\n");
+}
+
+/**
+ * load_config - Read the configuration file, from the cache if still valid.
+ *
+ * Errors are counted in errcnt.
+ */
+static void load_config(void)
+{
+	unsigned long long hash;
+	char *text;
+
+	text = read_config(filename);
+	if (!text) {
+		error("Unable to open configuration file '%s'\n", filename);
+		return;
+	}
+	/* Hashed before parse_config() cuts it up */
+	hash = fnv1a64(text, strlen(text));
+	if (!cache_load(hash)) {
+		parse_config(text);
+		if (!errcnt) {
+			build_zone_images();
+			/* A test run leaves nothing behind */
+			if (!dry_run)
+				cache_save(hash);
+		}
+	}
+	free(text);
+	if (!errcnt) {
+		build_chan_links();
+		check_chan_links();
+	}
+}
+
+/* Forget the loaded configuration, before loading it again */
+static void reset_config(void)
+{
+	int x;
+
+	for (x = 0; x < DAHDI_MAX_CHANNELS; x++) {
+		free(rad[x]);
+		rad[x] = NULL;
+	}
+	if (cache_map) {
+		munmap(cache_map, cache_map_len);
+		cache_map = NULL;
+	} else {
+		for (x = 0; x < numzones; x++)
+			free(zone_images[x].data);
+	}
+	memset(zone_images, 0, sizeof(zone_images));
+	memset(lc, 0, sizeof(lc));
+	memset(cc, 0, sizeof(cc));
+	memset(ae, 0, sizeof(ae));
+	memset(sig, 0, sizeof(sig));
+	memset(slineno, 0, sizeof(slineno));
+	memset(declared_spans, 0, sizeof(declared_spans));
+	memset(&fiftysixkhdlc, 0, sizeof(fiftysixkhdlc));
+	memset(zonestoload, 0, sizeof(zonestoload));
+	spans = 0;
+	numdynamic = 0;
+	numzones = 0;
+	deftonezone = -1;
+	lineno = 0;
+	errcnt = 0;
+}
+
+static void usage(char *argv0, int exitcode)
+{
+	char *c;
+	c = strrchr(argv0, '/');
+	if (!c)
+		c = argv0;
+	else
+		c++;
+	fprintf(stderr, "%s\n", dahdi_tools_version);
+	fprintf(stderr, 
+		"Usage: %s [options]\n"
+		"    Valid options are:\n"
+		"  -c <filename>     -- Use <filename> instead of " CONFIG_FILENAME "\n"
+		"  -d [level]        -- Generate debugging output. (Default level is 1.)\n"
+		"  -f                -- Always reconfigure every channel\n"
+		"  -h                -- Generate this help statement\n"
+		"  -j <num>          -- Configure up to <num> spans in parallel\n"
+		"  --profile <file>  -- Write a JSON timing profile to <file> (- for stdout)\n"
+		"  --daemon          -- Stay resident, applying on request\n"
+		"  --request <req>   -- Send <req> to a resident dahdi_cfg\n"
+		"  --socket <path>   -- Socket of the resident dahdi_cfg\n"
+		"  -s                -- Shutdown spans only\n"
+		"  -t                -- Test mode only, do not apply\n"
+		"  -C <chan_list>    -- Only configure specified channels\n"
+		"  -S <spans>        -- Only configure specified spans (e.g. 1,3-8)\n"
+		"  -v                -- Verbose (more -v's means more verbose)\n"
+	,c);
+	exit(exitcode);
+}
+
+static int chan_restrict(char *str)
+{
+	if (apply_channels(&selected_channels, str) < 0)
+		return 0;
+	restrict_channels = 1;
+	return 1;
+}
+
+/**
+ * span_restrict - Add the spans given to -S.
+ * @str: a comma separated list of span numbers and ranges (e.g. "1,3-8")
+ */
+static int span_restrict(char *str)
+{
+	long	first, last;
+	char	*item, *next, *endptr;
+
+	for (item = str; item; item = next) {
+		next = strchr(item, ',');
+		if (next)
+			*next++ = '\0';
+		first = strtol(item, &endptr, 10);
+		if (endptr == item) {
+			fprintf(stderr, "Missing valid span number after '-S'\n");
+			return 0;
+		}
+		last = first;
+		if (*endptr == '-') {
+			item = endptr + 1;
+			last = strtol(item, &endptr, 10);
+			if (endptr == item) {
+				fprintf(stderr, "Missing end of span range in '-S'\n");
+				return 0;
+			}
+		}
+		if (*endptr != '\0') {
+			fprintf(stderr, "Extra garbage after span number in '-S'\n");
+			return 0;
+		}
+		if (first < 1 || last >= DAHDI_MAX_SPANS || first > last) {
+			fprintf(stderr, "Invalid span range %ld-%ld in '-S'\n",
+				first, last);
+			return 0;
+		}
+		for (; first <= last; first++)
+			selected_spans[first] = true;
+	}
+	restrict_spans = 1;
+	return 1;
+}
+
+/*
+ * Echo cancellers currently attached, from the ec_factory attribute of
+ * the channels in sysfs. Read once, by the first channel job that needs
+ * it. Channels missing from sysfs are unknown and always attached.
+ */
+static char chan_ec[DAHDI_MAX_CHANNELS][sizeof(ae[0].echocan)];
+static bool chan_ec_known[DAHDI_MAX_CHANNELS];
+static pthread_once_t chan_ec_once = PTHREAD_ONCE_INIT;
+static unsigned long ec_skipped;
+
+static int read_chan_attr(const char *dev, const char *attr,
+			  char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	char *nl;
+
+	snprintf(path, sizeof(path),
+		 "%s/sys/bus/dahdi_channels/devices/%s/%s",
+		 virt_top, dev, attr);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (!fgets(buf, size, fp))
+		buf[0] = '\0';
+	fclose(fp);
+	nl = strchr(buf, '\n');
+	if (nl)
+		*nl = '\0';
+	return 0;
+}
+
+static void load_chan_echocans(void)
+{
+	char path[PATH_MAX];
+	char buf[sizeof(chan_ec[0])];
+	DIR *dirp;
+	struct dirent *dirent;
+	int channo;
+
+	snprintf(path, sizeof(path), "%s/sys/bus/dahdi_channels/devices",
+		 virt_top);
+	dirp = opendir(path);
+	if (!dirp)
+		return;
+	while ((dirent = readdir(dirp))) {
+		if (dirent->d_name[0] == '.')
+			continue;
+		if (read_chan_attr(dirent->d_name, "channo", buf, sizeof(buf)))
+			continue;
+		channo = atoi(buf);
+		if (channo < 1 || channo >= DAHDI_MAX_CHANNELS)
+			continue;
+		if (read_chan_attr(dirent->d_name, "ec_factory",
+				   chan_ec[channo], sizeof(chan_ec[channo])))
+			continue;
+		chan_ec_known[channo] = true;
+	}
+	closedir(dirp);
+}
+
+/* Is the wanted echo canceller (or none) already attached to channel x? */
+static bool echocan_unchanged(int x)
+{
+	pthread_once(&chan_ec_once, load_chan_echocans);
+	return chan_ec_known[x] && !strcasecmp(chan_ec[x], ae[x].echocan);
+}
+
+/**
+ * apply_channel - Configure a single channel, unless it is unchanged.
+ * @fd: the control device to use
+ * @x: channel number
+ * @out, @err: where to report progress and errors
+ * @skipped: incremented when the channel is left untouched
+ */
+static int apply_channel(int fd, int x, FILE *out, FILE *err, int *skipped)
+{
+	struct dahdi_params current_state;
+	int master;
+	int spanno = 0;
+	int needupdate = force;
+
+	if (skip_channel(x)) {
+		if (debug & DEBUG_APPLY) {
+			fprintf(out, "Skip device %d\n", x);
+			fflush(out);
+		}
+		return 0;
+	}
+	if (debug & DEBUG_APPLY) {
+		fprintf(out, "Configuring device %d\n", x);
+		fflush(out);
+	}
+	if (!cc[x].sigtype)
+		return 0;
+
+	if (channel_unchanged(x)) {
+		chan_unchanged[x] = true;
+		(*skipped)++;
+		return 0;
+	}
+	
+	if (!needupdate) {
+		memset(&current_state, 0, sizeof(current_state));
+		current_state.channo = cc[x].chan | DAHDI_GET_PARAMS_RETURN_MASTER;
+		if (ioctl(fd, DAHDI_GET_PARAMS, &current_state))
+			needupdate = 1;
+		else
+			spanno = current_state.spanno;
+	}
+	
+	if (!needupdate) {
+		master = current_state.channo >> 16;
+		
+		if (cc[x].sigtype != current_state.sigtype) {
+			needupdate++;
+			if (verbose > 1)
+				fprintf(out, "Changing signalling on channel %d from %s to %s\n",
+				       cc[x].chan, sigtype_to_str(current_state.sigtype),
+				       sigtype_to_str(cc[x].sigtype));
+		}
+		
+		if ((cc[x].deflaw != DAHDI_LAW_DEFAULT) && (cc[x].deflaw != current_state.curlaw)) {
+			needupdate++;
+			if (verbose > 1)
+				fprintf(out, "Changing law on channel %d from %s to %s\n",
+				       cc[x].chan, laws[current_state.curlaw],
+				       laws[cc[x].deflaw]);
+		}
+		
+		if (cc[x].master != master) {
+			needupdate++;
+			if (verbose > 1)
+				fprintf(out, "Changing master of channel %d from %d to %d\n",
+				       cc[x].chan, master,
+				       cc[x].master);
+		}
+		
+		if (cc[x].idlebits != current_state.idlebits) {
+			needupdate++;
+			if (verbose > 1)
+				fprintf(out, "Changing idle bits of channel %d from %d to %d\n",
+				       cc[x].chan, current_state.idlebits,
+				       cc[x].idlebits);
+		}
+	}
+	
+	if (needupdate && ioctl(fd, DAHDI_CHANCONFIG, &cc[x])) {
+		fprintf(err, "DAHDI_CHANCONFIG failed on channel %d: %s (%d)\n", x, strerror(errno), errno);
+		if (errno == EINVAL) {
+			/* give helpful suggestions on signaling errors */
+			fprintf(err, "Selected signaling not "
+					"supported\n");
+			fprintf(err, "Possible causes:\n");
+			switch(cc[x].sigtype) {
+			case DAHDI_SIG_FXOKS:
+			case DAHDI_SIG_FXOLS:
+			case DAHDI_SIG_FXOGS:
+				fprintf(err, "\tFXO signaling is "
+					"being used on a FXO interface"
+					" (use a FXS signaling variant"
+					")\n");
+				fprintf(err, "\tRBS signaling is "
+					"being used on a E1 CCS span"
+					"\n");
+				break;
+			case DAHDI_SIG_FXSKS:
+			case DAHDI_SIG_FXSLS:
+			case DAHDI_SIG_FXSGS:
+				fprintf(err, "\tFXS signaling is "
+					"being used on a FXS interface"
+					" (use a FXO signaling variant"
+					")\n");
+				fprintf(err, "\tRBS signaling is "
+					"being used on a E1 CCS span"
+					"\n");
+				break;
+			case DAHDI_SIG_EM:
+				fprintf(err, "\te&m signaling is "
+					"being used on a E1 line (use"
+					" e&me1)\n");
+				break;
+			case DAHDI_SIG_EM_E1:
+				fprintf(err, "\te&me1 signaling is "
+					"being used on a T1 line (use "
+					"e&m)\n");
+				fprintf(err, "\tRBS signaling is "
+					"being used on a E1 CCS span"
+					"\n");
+				break;
+			case DAHDI_SIG_HARDHDLC:
+				fprintf(err, "\thardhdlc is being "
+					"used on a TE12x (use dchan)\n"
+					);
+				break;
+			case DAHDI_SIG_HDLCFCS:
+				fprintf(err, "\tdchan is being used"
+					" on a BRI span (use hardhdlc)"
+					"\n");
+				break;
+			default:
+				break;
+			}
+			fprintf(err, "\tSignaling is being assigned"
+				" to channel 16 of an E1 CAS span\n");
+		}
+		return -1;
+	}
+
+	ae[x].chan = x;
+	/*
+	 * DAHDI_CHANCONFIG may have released the echo canceller, and with
+	 * -f everything is attached again anyway.
+	 */
+	if (!needupdate && echocan_unchanged(x)) {
+		if (verbose > 1)
+			fprintf(out, "Echocan for channel %d is already %s\n",
+				x, ae[x].echocan[0] ? ae[x].echocan : "none");
+		__atomic_add_fetch(&ec_skipped, 1, __ATOMIC_RELAXED);
+		goto attached;
+	}
+	if (verbose) {
+		fprintf(out, "Setting echocan for channel %d to %s\n", ae[x].chan, ae[x].echocan[0] ? ae[x].echocan : "none");
+	}
+
+	if (ioctl(fd, DAHDI_ATTACH_ECHOCAN, &ae[x])) {
+		fprintf(err, "DAHDI_ATTACH_ECHOCAN failed on channel %d: %s (%d)\n", x, strerror(errno), errno);
+		return -1;
+	}
+
+attached:
+	if (!spanno) {
+		memset(&current_state, 0, sizeof(current_state));
+		current_state.channo = x;
+		if (!ioctl(fd, DAHDI_GET_PARAMS, &current_state))
+			spanno = current_state.spanno;
+	}
+	snapshot_record_chan(x, spanno);
+	return 0;
+}
+
+/*
+ * Parallel application (-j).
+ *
+ * Each phase (span configuration, channel configuration, span startup) is
+ * split into jobs of one span each. Jobs of a phase are run by a pool of
+ * threads, each with its own control device. Their output is buffered and
+ * printed in job order when the phase is over, so it does not depend on
+ * scheduling. Everything with a global ordering (dynamic spans, tone
+ * zones) is still done in between the phases, by the main thread.
+ */
+struct span_job {
+	int arg;		/* lc[] index or span number */
+	int basechan;		/* Channels of the span */
+	int numchans;
+	int res;
+	int skipped;
+	char *out;
+	size_t outlen;
+	char *err;
+	size_t errlen;
+	long long start_us;	/* For --profile */
+	long long usec;
+	unsigned long ioctls;
+};
+
+static bool chan_in_span_job[DAHDI_MAX_CHANNELS];
+
+typedef int (*span_job_func)(int fd, struct span_job *job, FILE *out, FILE *err);
+
+static int run_job(int fd, struct span_job *job, span_job_func func,
+		   FILE *out, FILE *err)
+{
+	unsigned long ioctls = thread_ioctls;
+
+	job->start_us = profile_now_us();
+	job->res = func(fd, job, out, err);
+	job->usec = profile_now_us() - job->start_us;
+	job->ioctls = thread_ioctls - ioctls;
+	return job->res;
+}
+
+struct job_queue {
+	pthread_mutex_t lock;
+	struct span_job *jobs;
+	int numjobs;
+	int next;
+	bool failed;
+	span_job_func func;
+};
+
+static void *job_worker(void *data)
+{
+	struct job_queue *q = data;
+	struct span_job *job;
+	FILE *out;
+	FILE *err;
+	int wfd;
+
+	wfd = open(MASTER_DEVICE, O_RDWR);
+	if (wfd < 0) {
+		fprintf(stderr, "Unable to open master device '%s': %s\n",
+			MASTER_DEVICE, strerror(errno));
+		pthread_mutex_lock(&q->lock);
+		q->failed = true;
+		pthread_mutex_unlock(&q->lock);
+		return NULL;
+	}
+	while (true) {
+		pthread_mutex_lock(&q->lock);
+		if (q->failed || q->next >= q->numjobs)
+			job = NULL;
+		else
+			job = &q->jobs[q->next++];
+		pthread_mutex_unlock(&q->lock);
+		if (!job)
+			break;
+
+		out = open_memstream(&job->out, &job->outlen);
+		err = open_memstream(&job->err, &job->errlen);
+		if (out && err) {
+			run_job(wfd, job, q->func, out, err);
+		} else {
+			fprintf(stderr, "Out of memory\n");
+			job->res = -1;
+		}
+		if (out)
+			fclose(out);
+		if (err)
+			fclose(err);
+
+		if (job->res) {
+			pthread_mutex_lock(&q->lock);
+			q->failed = true;
+			pthread_mutex_unlock(&q->lock);
+		}
+	}
+	close(wfd);
+	return NULL;
+}
+
+/**
+ * run_span_jobs - Run one phase of per-span jobs.
+ *
+ * Without -j the jobs are run in order on the main control device.
+ * Returns -1 if any of the jobs (or a worker) failed, 0 otherwise.
+ */
+static int run_span_jobs(struct span_job *jobs, int numjobs, span_job_func func)
+{
+	pthread_t threads[numjobs > 0 ? numjobs : 1];
+	struct job_queue q;
+	int numthreads;
+	int x;
+
+	if (workers <= 1 || numjobs <= 1) {
+		for (x = 0; x < numjobs; x++) {
+			if (run_job(fd, &jobs[x], func, stdout, stderr))
+				return -1;
+		}
+		return 0;
+	}
+
+	memset(&q, 0, sizeof(q));
+	pthread_mutex_init(&q.lock, NULL);
+	q.jobs = jobs;
+	q.numjobs = numjobs;
+	q.func = func;
+
+	numthreads = (workers < numjobs) ? workers : numjobs;
+	for (x = 0; x < numthreads; x++) {
+		if (pthread_create(&threads[x], NULL, job_worker, &q)) {
+			fprintf(stderr, "Failed to start worker thread\n");
+			q.failed = true;
+			break;
+		}
+	}
+	numthreads = x;
+	for (x = 0; x < numthreads; x++)
+		pthread_join(threads[x], NULL);
+	pthread_mutex_destroy(&q.lock);
+
+	for (x = 0; x < numjobs; x++) {
+		if (jobs[x].out) {
+			fwrite(jobs[x].out, 1, jobs[x].outlen, stdout);
+			free(jobs[x].out);
+		}
+		if (jobs[x].err) {
+			fwrite(jobs[x].err, 1, jobs[x].errlen, stderr);
+			free(jobs[x].err);
+		}
+	}
+	fflush(stdout);
+	return q.failed ? -1 : 0;
+}
+
+/**
+ * profile_jobs - Record the span jobs of a phase for --profile.
+ * @by_lc: job args are lc[] indexes rather than span numbers
+ */
+static void profile_jobs(enum profile_phase phase, struct span_job *jobs,
+			 int numjobs, bool by_lc)
+{
+	int x;
+
+	for (x = 0; x < numjobs; x++) {
+		if (!jobs[x].start_us)
+			continue;	/* Never ran */
+		profile_span(phase, by_lc ? lc[jobs[x].arg].span : jobs[x].arg,
+			     jobs[x].start_us, jobs[x].usec, jobs[x].ioctls);
+	}
+}
+
+static int job_spanconfig(int fd, struct span_job *job, FILE *out, FILE *err)
+{
+	int x = job->arg;
+
+	if (span_unchanged(x)) {
+		job->skipped++;
+		return 0;
+	}
+	if (ioctl(fd, DAHDI_SPANCONFIG, lc + x)) {
+		fprintf(err, "DAHDI_SPANCONFIG failed on span %d: %s (%d)\n", lc[x].span, strerror(errno), errno);
+		return -1;
+	}
+	snapshot_record_span(x);
+	return 0;
+}
+
+static int job_channels(int fd, struct span_job *job, FILE *out, FILE *err)
+{
+	int x;
+
+	for (x = job->basechan; x < job->basechan + job->numchans; x++) {
+		/* Left to the job of its span */
+		if (!job->arg && chan_in_span_job[x])
+			continue;
+		if (apply_channel(fd, x, out, err, &job->skipped))
+			return -1;
+	}
+	return 0;
+}
+
+static int job_startup(int fd, struct span_job *job, FILE *out, FILE *err)
+{
+	int x = job->arg;
+
+	/* Nothing on this span was touched */
+	if (snap_loaded && !span_dirty[lc[x].span])
+		return 0;
+	if (ioctl(fd, DAHDI_STARTUP, &lc[x].span)) {
+		fprintf(err, "DAHDI startup failed: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+/*
+ * Per-channel settings that need the channel itself rather than the
+ * control device: radio parameters and the HDLC rate. All of them are
+ * applied after the channels are configured, through a single open and
+ * DAHDI_SPECIFY of each channel.
+ */
+static unsigned long chan_opens;
+static unsigned long chan_ioctls;
+
+static int chan_ioctl(int chanfd, unsigned long request, void *arg)
+{
+	__atomic_add_fetch(&chan_ioctls, 1, __ATOMIC_RELAXED);
+	return ioctl(chanfd, request, arg);
+}
+
+/**
+ * chan_open - Get a handle for the per-channel ioctls of a channel.
+ * @x: channel number
+ * @err: where to report a failure to open the channel device
+ *
+ * Returns a file descriptor, -1 if the channel cannot be specified,
+ * or -2 if the channel device itself cannot be opened.
+ */
+static int chan_open(int x, FILE *err)
+{
+	int chanfd;
+
+	chanfd = open("/dev/dahdi/channel", O_RDWR);
+	if (chanfd == -1) {
+		fprintf(err, "Couldn't open /dev/dahdi/channel: %s\n",
+			strerror(errno));
+		return -2;
+	}
+	__atomic_add_fetch(&chan_opens, 1, __ATOMIC_RELAXED);
+	if (chan_ioctl(chanfd, DAHDI_SPECIFY, &x)) {
+		close(chanfd);
+		return -1;
+	}
+	return chanfd;
+}
+
+/* Returns the number of errors */
+static int apply_radio(int chanfd, int x, const struct rad_params *r, FILE *err)
+{
+	struct dahdi_radio_param p;
+	int errors = 0;
+	int i, n;
+
+	memset(&p, 0, sizeof(p));
+	p.radpar = DAHDI_RADPAR_NUMTONES;
+	if (chan_ioctl(chanfd, DAHDI_RADIO_GETPARAM, &p) == -1)
+		n = 0;
+	else
+		n = p.data;
+
+	if (n) {
+		p.radpar = DAHDI_RADPAR_INITTONE;
+		if (chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1) {
+			fprintf(err, "Cannot init tones for channel %d\n", x);
+			errors++;
+		}
+		if (!r->rxtones[0]) for (i = 1; i <= n && i <= NUM_TONES; i++) {
+			if (r->rxtones[i]) {
+				p.radpar = DAHDI_RADPAR_RXTONE;
+				p.index = i;
+				p.data = r->rxtones[i];
+				if (chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1) {
+					fprintf(err, "Cannot set rxtone on channel %d\n", x);
+					errors++;
+				}
+			}
+			if (r->rxtags[i]) {
+				p.radpar = DAHDI_RADPAR_RXTONECLASS;
+				p.index = i;
+				p.data = r->rxtags[i];
+				if (chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1) {
+					fprintf(err, "Cannot set rxtag on channel %d\n", x);
+					errors++;
+				}
+			}
+			if (r->txtones[i]) {
+				p.radpar = DAHDI_RADPAR_TXTONE;
+				p.index = i;
+				p.data = r->txtones[i];
+				if (chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1) {
+					fprintf(err, "Cannot set txtone on channel %d\n", x);
+					errors++;
+				}
+			}
+		} else { /* if we may have DCS receive */
+			if (r->rxtones[0]) {
+				p.radpar = DAHDI_RADPAR_RXTONE;
+				p.index = 0;
+				p.data = r->rxtones[0];
+				if (chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1) {
+					fprintf(err, "Cannot set DCS rxtone on channel %d\n", x);
+					errors++;
+				}
+			}
+		}
+		if (r->txtones[0]) {
+			p.radpar = DAHDI_RADPAR_TXTONE;
+			p.index = 0;
+			p.data = r->txtones[0];
+			if (chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1) {
+				fprintf(err, "Cannot set default txtone on channel %d\n", x);
+				errors++;
+			}
+		}
+	}
+	if (r->debouncetime) {
+		p.radpar = DAHDI_RADPAR_DEBOUNCETIME;
+		p.data = r->debouncetime;
+		if (chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1) {
+			fprintf(err, "Cannot set debouncetime on channel %d\n", x);
+			errors++;
+		}
+	}
+	if (r->bursttime) {
+		p.radpar = DAHDI_RADPAR_BURSTTIME;
+		p.data = r->bursttime;
+		if (chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1) {
+			fprintf(err, "Cannot set bursttime on channel %d\n", x);
+			errors++;
+		}
+	}
+	p.radpar = DAHDI_RADPAR_DEEMP;
+	p.data = r->deemp;
+	chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p);
+	p.radpar = DAHDI_RADPAR_PREEMP;
+	p.data = r->preemp;
+	chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p);
+	p.radpar = DAHDI_RADPAR_TXGAIN;
+	p.data = r->txgain;
+	chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p);
+	p.radpar = DAHDI_RADPAR_RXGAIN;
+	p.data = r->rxgain;
+	chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p);
+	p.radpar = DAHDI_RADPAR_INVERTCOR;
+	p.data = r->invertcor;
+	chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p);
+	p.radpar = DAHDI_RADPAR_EXTRXTONE;
+	p.data = r->exttone;
+	chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p);
+	if (r->corthresh) {
+		p.radpar = DAHDI_RADPAR_CORTHRESH;
+		p.data = r->corthresh - 1;
+		if (chan_ioctl(chanfd, DAHDI_RADIO_SETPARAM, &p) == -1) {
+			fprintf(err, "Cannot set corthresh on channel %d\n", x);
+			errors++;
+		}
+	}
+	return errors;
+}
+
+/* Radio parameters and HDLC rate of the channels of a job */
+static int job_chansetup(int fd, struct span_job *job, FILE *out, FILE *err)
+{
+	bool set_rate;
+	int errors = 0;
+	int chanfd;
+	int rate;
+	int x;
+
+	for (x = job->basechan; x < job->basechan + job->numchans; x++) {
+		/* Left to the job of its span */
+		if (!job->arg && chan_in_span_job[x])
+			continue;
+		if (skip_channel(x))
+			continue;
+		set_rate = cc[x].sigtype && !chan_unchanged[x];
+		if (!set_rate && !rad[x])
+			continue;
+
+		chanfd = chan_open(x, err);
+		if (chanfd == -2)
+			return -1;
+		if (chanfd == -1) {
+			if (rad[x]) {
+				fprintf(err, "Failed to open channel %d.\n", x);
+				errors++;
+			}
+			continue;
+		}
+
+		if (rad[x])
+			errors += apply_radio(chanfd, x, rad[x], err);
+
+		if (set_rate) {
+			if (chanset_has(&fiftysixkhdlc, x)) {
+				fprintf(out, "Setting channel %d to 56K mode (only valid on HDLC channels)\n", x);
+				rate = 56;
+			} else {
+				rate = 64;
+			}
+			if (chan_ioctl(chanfd, DAHDI_HDLC_RATE, &rate)) {
+				fprintf(err, "Error setting HDLC rate\n");
+				close(chanfd);
+				return -1;
+			}
+		}
+		close(chanfd);
+	}
+	return errors ? -1 : 0;
+}
+
+
+static int read_span_attr(int spanno, const char *attr, int *value)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int res;
+
+	snprintf(path, sizeof(path),
+		 "%s/sys/bus/dahdi_spans/devices/span-%d/%s",
+		 virt_top, spanno, attr);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	res = fscanf(fp, "%d", value);
+	fclose(fp);
+	return (res == 1) ? 0 : -1;
+}
+
+/**
+ * channel_jobs - Split the channels between per-span jobs.
+ *
+ * Spans are found in sysfs. Channels that do not belong to a known span
+ * are left to @rest, which is meant to be run after all the span jobs
+ * (and without -j, does all channels).
+ */
+static int channel_jobs(struct span_job *jobs, struct span_job *rest)
+{
+	int numjobs = 0;
+	int basechan;
+	int channels;
+	int x;
+
+	memset(rest, 0, sizeof(*rest));
+	rest->basechan = 1;
+	rest->numchans = DAHDI_MAX_CHANNELS - 1;
+	if (workers <= 1)
+		return 0;
+
+	for (x = 1; x < DAHDI_MAX_SPANS; x++) {
+		if (read_span_attr(x, "basechan", &basechan) ||
+		    read_span_attr(x, "channels", &channels))
+			continue;
+		if (basechan < 1 || channels < 1 ||
+		    basechan + channels > DAHDI_MAX_CHANNELS)
+			continue;
+		memset(&jobs[numjobs], 0, sizeof(jobs[numjobs]));
+		jobs[numjobs].arg = x;
+		jobs[numjobs].basechan = basechan;
+		jobs[numjobs].numchans = channels;
+		numjobs++;
+		memset(chan_in_span_job + basechan, 1, channels);
+	}
+	return numjobs;
+}
+
+/*
+ * Locking between concurrent runs.
+ *
+ * A run over all spans holds the global lock exclusively. A run restricted
+ * by -S holds it shared, plus an exclusive lock on each of its spans, so
+ * that runs for different spans (e.g. from hotplug) go on in parallel.
+ * Spans are always locked in ascending order. The state file and the
+ * tone zones belong to no span: restricted runs touch them only under
+ * the short lived state lock.
+ *
+ * These are flock()s on files in STATE_DIR, released even if a run dies.
+ * If STATE_DIR cannot be used, every run takes the old global semaphore
+ * instead.
+ */
+#define LOCK_FILENAME		STATE_DIR "/dahdi_cfg.lock"
+#define STATE_LOCK_FILENAME	STATE_DIR "/dahdi_cfg.state.lock"
+#define SPAN_LOCK_FORMAT	STATE_DIR "/span-%d.lock"
+
+static const char *SEM_NAME = "dahdi_cfg";
+static sem_t *lock = SEM_FAILED;
+static int global_lock_fd = -1;
+static int state_lock_fd = -1;
+static int span_lock_fds[DAHDI_MAX_SPANS];
+static int num_span_locks;
+
+static int lock_file(const char *name, int op)
+{
+	int fd;
+
+	fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	while (flock(fd, op)) {
+		if (errno != EINTR) {
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+static int lock_global(bool exclusive)
+{
+	if (SEM_FAILED == lock &&
+	    (!mkdir(STATE_DIR, 0755) || errno == EEXIST)) {
+		global_lock_fd = lock_file(LOCK_FILENAME,
+					   exclusive ? LOCK_EX : LOCK_SH);
+		if (global_lock_fd >= 0)
+			return 0;
+	}
+	if (SEM_FAILED == lock)
+		lock = sem_open(SEM_NAME, O_CREAT, O_RDWR, 1);
+	if (SEM_FAILED == lock) {
+		perror("Unable to create 'dahdi_cfg' mutex");
+		return -1;
+	}
+	if (-1 == sem_wait(lock)) {
+		perror("Failed to wait for 'dahdi_cfg' mutex");
+		return -1;
+	}
+	return 0;
+}
+
+static void unlock_global(void)
+{
+	if (global_lock_fd >= 0) {
+		close(global_lock_fd);
+		global_lock_fd = -1;
+	} else if (SEM_FAILED != lock) {
+		sem_post(lock);
+	}
+}
+
+/* Only needed when the global lock is shared */
+static bool shared_run(void)
+{
+	return restrict_spans && global_lock_fd >= 0;
+}
+
+static int lock_spans(void)
+{
+	char name[PATH_MAX];
+	int fd;
+	int x;
+
+	if (!shared_run())
+		return 0;
+	for (x = 1; x < DAHDI_MAX_SPANS; x++) {
+		if (!selected_spans[x])
+			continue;
+		snprintf(name, sizeof(name), SPAN_LOCK_FORMAT, x);
+		fd = lock_file(name, LOCK_EX);
+		if (fd < 0) {
+			fprintf(stderr, "Unable to lock span %d: %s\n",
+				x, strerror(errno));
+			return -1;
+		}
+		span_lock_fds[num_span_locks++] = fd;
+	}
+	return 0;
+}
+
+static void unlock_spans(void)
+{
+	while (num_span_locks > 0)
+		close(span_lock_fds[--num_span_locks]);
+}
+
+static int lock_state(void)
+{
+	if (!shared_run())
+		return 0;
+	state_lock_fd = lock_file(STATE_LOCK_FILENAME, LOCK_EX);
+	if (state_lock_fd < 0) {
+		fprintf(stderr, "Unable to lock %s: %s\n",
+			STATE_LOCK_FILENAME, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void unlock_state(void)
+{
+	if (state_lock_fd >= 0) {
+		close(state_lock_fd);
+		state_lock_fd = -1;
+	}
+}
+
+static void signal_handler(int signal)
+{
+	if (SEM_FAILED != lock) {
+		sem_unlink(SEM_NAME);
+	}
+	/* The default handler should have been restored before this handler was
+	 * called, so we can let the "normal" processing finish the cleanup. */
+	raise(signal);
+}
+
+/*
+ * Resident mode (--daemon).
+ *
+ * The configuration is loaded once and the control device kept open.
+ * Requests come one per connection on a UNIX socket, as a single line:
+ *
+ *   apply                                 - like a run without -S / -C
+ *   apply span <spans> [channel <chans>]  - like -S <spans> -C <chans>
+ *   reload                                - load the configuration again
+ *   state                                 - report, without any ioctl
+ *
+ * An apply is served by a forked child, which goes on through main()
+ * with the loaded configuration and the usual -S / -C restrictions, so
+ * it takes the same locks and saved state as any other run. Everything
+ * it prints goes to the client, followed by a last line "OK" or "FAILED".
+ *
+ * The configuration file is loaded again before an apply if it changed.
+ */
+#define SOCKET_FILENAME		STATE_DIR "/dahdi_cfg.sock"
+#define REQUEST_MAX		1024
+#define REQUEST_TIMEOUT_MSEC	1000
+
+static int daemon_mode = 0;
+static const char *socket_path = SOCKET_FILENAME;
+static struct stat config_st;		/* Of the file as loaded */
+static time_t config_loaded;
+static unsigned long requests_served;
+static int last_apply_status = -1;
+static volatile sig_atomic_t daemon_quit = 0;
+
+static void config_identity(struct stat *st)
+{
+	if (stat(filename, st))
+		memset(st, 0, sizeof(*st));
+	config_loaded = time(NULL);
+}
+
+static bool same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev &&
+		a->st_ino == b->st_ino &&
+		a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static bool config_changed(void)
+{
+	struct stat st;
+
+	if (stat(filename, &st))
+		return true;
+	return !same_file(&st, &config_st);
+}
+
+static void daemon_signal(int signal)
+{
+	daemon_quit = 1;
+}
+
+static int daemon_listen(void)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path '%s' is too long\n", socket_path);
+		return -1;
+	}
+	if (mkdir(STATE_DIR, 0755) && errno != EEXIST) {
+		fprintf(stderr, "Unable to create %s: %s\n",
+			STATE_DIR, strerror(errno));
+		return -1;
+	}
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	dahdi_copy_string(addr.sun_path, socket_path, sizeof(addr.sun_path));
+	unlink(socket_path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    chmod(socket_path, 0600) || listen(sock, 16)) {
+		fprintf(stderr, "Unable to listen on %s: %s\n",
+			socket_path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* Read the request line. A client gets a second to send it. */
+static int read_request(int cfd, char *buf, size_t size)
+{
+	struct pollfd pfd = { .fd = cfd, .events = POLLIN };
+	size_t len = 0;
+	ssize_t res;
+	char *nl;
+
+	while (len < size - 1) {
+		if (poll(&pfd, 1, REQUEST_TIMEOUT_MSEC) <= 0)
+			return -1;
+		res = read(cfd, buf + len, size - 1 - len);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			break;
+		len += res;
+		buf[len] = '\0';
+		if (strchr(buf, '\n'))
+			break;
+	}
+	buf[len] = '\0';
+	nl = strchr(buf, '\n');
+	if (nl)
+		*nl = '\0';
+	return len ? 0 : -1;
+}
+
+static void reply_status(int cfd, bool ok)
+{
+	dprintf(cfd, "%s\n", ok ? "OK" : "FAILED");
+}
+
+static int wait_child(pid_t pid)
+{
+	int status;
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	return -1;
+}
+
+/* Redirect the output of a child serving a request to the client */
+static void to_client(int cfd)
+{
+	dup2(cfd, STDOUT_FILENO);
+	dup2(cfd, STDERR_FILENO);
+	close(cfd);
+}
+
+/**
+ * reload_config - Load the configuration file again.
+ * @cfd: the client to report errors to
+ *
+ * The file is checked by a child first, so the configuration in use is
+ * only dropped for one that loads without errors. If it changed while
+ * being checked, the configuration in use is kept.
+ */
+static int reload_config(int cfd)
+{
+	struct stat checked, st;
+	pid_t pid;
+
+	if (stat(filename, &checked))
+		memset(&checked, 0, sizeof(checked));
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		dprintf(cfd, "fork: %s\n", strerror(errno));
+		return -1;
+	}
+	if (!pid) {
+		to_client(cfd);
+		reset_config();
+		load_config();
+		if (errcnt)
+			fprintf(stderr, "\n%d error(s) detected\n\n", errcnt);
+		fflush(NULL);
+		_exit(errcnt ? 1 : 0);
+	}
+	if (wait_child(pid))
+		return -1;
+	if (stat(filename, &st) || !same_file(&st, &checked)) {
+		dprintf(cfd, "%s changed while being checked\n", filename);
+		return -1;
+	}
+	reset_config();
+	config_identity(&config_st);
+	load_config();
+	if (errcnt) {
+		/*
+		 * Rewritten within the same mtime. What is left is not
+		 * applied: the next request loads the file again first.
+		 */
+		memset(&config_st, 0, sizeof(config_st));
+		dprintf(cfd, "%d error(s) in %s\n", errcnt, filename);
+		return -1;
+	}
+	return 0;
+}
+
+static void report_state(int cfd, int fd)
+{
+	char when[32];
+	int numchans = 0;
+	int nspans = 0, nchans = 0, nzones = 0;
+	int x;
+
+	for (x = 1; x < DAHDI_MAX_CHANNELS; x++) {
+		if (cc[x].sigtype)
+			numchans++;
+	}
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S",
+		 localtime(&config_loaded));
+	dprintf(cfd, "Configuration: %s, loaded %s%s\n", filename, when,
+		config_changed() ? " (changed since)" : "");
+	dprintf(cfd, "Configured: %d span(s), %d channel(s), "
+		"%d dynamic span(s), %d tone zone(s)\n",
+		spans, numchans, numdynamic, numzones);
+
+	/* Only the daemon's copy is used here: children load their own */
+	snapshot_load(fd);
+	if (snap_loaded) {
+		for (x = 1; x < DAHDI_MAX_SPANS; x++)
+			nspans += snap_spans[x].spanno ? 1 : 0;
+		for (x = 1; x < DAHDI_MAX_CHANNELS; x++)
+			nchans += snap_chans[x].spanno ? 1 : 0;
+		for (x = 0; x < DAHDI_TONE_ZONE_MAX; x++)
+			nzones += snap_zones[x].loaded;
+		dprintf(cfd, "Applied: %d span(s), %d channel(s), "
+			"%d tone zone(s)\n", nspans, nchans, nzones);
 	} else {
-		error("Unable to open configuration file '%s'\n", filename);
+		dprintf(cfd, "Applied: unknown (no valid %s)\n", STATE_FILENAME);
+	}
+	memset(snap_spans, 0, sizeof(snap_spans));
+	memset(snap_chans, 0, sizeof(snap_chans));
+	memset(snap_zones, 0, sizeof(snap_zones));
+	snap_loaded = false;
+
+	dprintf(cfd, "Requests: %lu, last apply %s\n", requests_served,
+		(last_apply_status < 0) ? "none" :
+		last_apply_status ? "failed" : "succeeded");
+}
+
+/* Restrict a child to the spans (and channels) of an apply request */
+static int restrict_request(char *spans_str, char *chans_str)
+{
+	int basechan, channels;
+	int x;
+
+	if (!span_restrict(spans_str))
+		return -1;
+	if (chans_str)
+		return chan_restrict(chans_str) ? 0 : -1;
+	for (x = 1; x < DAHDI_MAX_SPANS; x++) {
+		if (!selected_spans[x])
+			continue;
+		if (read_span_attr(x, "basechan", &basechan) ||
+		    read_span_attr(x, "channels", &channels) ||
+		    basechan < 1 || channels < 1 ||
+		    basechan + channels > DAHDI_MAX_CHANNELS) {
+			fprintf(stderr, "Channels of span %d unknown, "
+				"give them with 'channel'\n", x);
+			return -1;
+		}
+		chanset_add_range(&selected_channels, basechan,
+				  basechan + channels - 1);
+	}
+	restrict_channels = 1;
+	return 0;
+}
+
+/**
+ * serve_request - Handle one request.
+ * @lfd: the listening socket
+ * @cfd: the client
+ * @fd: the control device
+ * @req: the request line
+ *
+ * Returns 0 in a child that is to apply the configuration, -1 otherwise.
+ */
+static int serve_request(int lfd, int cfd, int fd, char *req)
+{
+	char *words[5];
+	char *save;
+	int n = 0;
+	pid_t pid;
+	int status;
+
+	while (n < 5 && (words[n] = strtok_r(n ? NULL : req, " \t", &save)))
+		n++;
+	if (n == 5 && strtok_r(NULL, " \t", &save))
+		n = 0;	/* Too long for anything */
+	if (n == 1 && !strcmp(words[0], "state")) {
+		report_state(cfd, fd);
+		reply_status(cfd, true);
+		return -1;
+	}
+	if (n == 1 && !strcmp(words[0], "reload")) {
+		reply_status(cfd, !reload_config(cfd));
+		return -1;
+	}
+	if (!n || strcmp(words[0], "apply") ||
+	    !(n == 1 || (n == 3 && !strcmp(words[1], "span")) ||
+	      (n == 5 && !strcmp(words[1], "span") &&
+	       !strcmp(words[3], "channel")))) {
+		dprintf(cfd, "Unknown request '%s'\n", n ? words[0] : "");
+		reply_status(cfd, false);
+		return -1;
+	}
+
+	requests_served++;
+	if ((errcnt || config_changed()) && reload_config(cfd)) {
+		reply_status(cfd, false);
+		last_apply_status = 1;
+		return -1;
+	}
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		dprintf(cfd, "fork: %s\n", strerror(errno));
+		reply_status(cfd, false);
+		return -1;
+	}
+	if (!pid) {
+		close(lfd);
+		to_client(cfd);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		if (n > 1 && restrict_request(words[2], (n == 5) ? words[4] : NULL))
+			exit(1);
+		if (n == 1 && !wait_for_all_spans_assigned(5))
+			fprintf(stderr,
+				"Timeout waiting for all spans to be assigned.\n");
+		return 0;
+	}
+	status = wait_child(pid);
+	last_apply_status = status ? 1 : 0;
+	reply_status(cfd, !status);
+	return -1;
+}
+
+/**
+ * run_daemon - Serve requests until terminated.
+ * @fd: the control device
+ *
+ * Only returns in a child that is to apply the configuration.
+ */
+static void run_daemon(int fd)
+{
+	struct sigaction act;
+	char req[REQUEST_MAX];
+	int lfd;
+	int cfd;
+
+	lfd = daemon_listen();
+	if (lfd < 0)
+		exit(1);
+	memset(&act, 0, sizeof(act));
+	sigemptyset(&act.sa_mask);
+	act.sa_handler = daemon_signal;	/* No SA_RESTART: stop accept() */
+	sigaction(SIGTERM, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+	/* A client that goes away must not kill an apply halfway */
+	signal(SIGPIPE, SIG_IGN);
+	if (verbose)
+		printf("Serving requests on %s\n", socket_path);
+	fflush(stdout);
+
+	while (!daemon_quit) {
+		cfd = accept(lfd, NULL, NULL);
+		if (cfd < 0) {
+			if (errno != EINTR)
+				perror("accept");
+			continue;
+		}
+		fcntl(cfd, F_SETFD, FD_CLOEXEC);
+		if (!read_request(cfd, req, sizeof(req)) &&
+		    !serve_request(lfd, cfd, fd, req))
+			return;
+		close(cfd);
+	}
+	close(lfd);
+	unlink(socket_path);
+	exit(0);
+}
+
+/**
+ * send_request - Pass a request to a resident dahdi_cfg (--request).
+ *
+ * Returns the exit code: 0 if it succeeded, 1 if it failed and 2 if
+ * there is no resident dahdi_cfg to ask.
+ */
+static int send_request(const char *request)
+{
+	struct sockaddr_un addr;
+	char *line = NULL, *prev = NULL;
+	size_t size = 0;
+	bool ok;
+	FILE *fp;
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 2;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	dahdi_copy_string(addr.sun_path, socket_path, sizeof(addr.sun_path));
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "Unable to connect to %s: %s\n",
+			socket_path, strerror(errno));
+		close(sock);
+		return 2;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	dprintf(sock, "%s\n", request);
+	shutdown(sock, SHUT_WR);
+	fp = fdopen(sock, "r");
+	if (!fp) {
+		close(sock);
+		return 1;
+	}
+	/* Print all but the status line */
+	while (getline(&line, &size, fp) >= 0) {
+		if (prev)
+			fputs(prev, stdout);
+		free(prev);
+		prev = strdup(line);
+	}
+	ok = prev && !strcmp(prev, "OK\n");
+	if (!prev)
+		fprintf(stderr, "No reply from %s\n", socket_path);
+	free(prev);
+	free(line);
+	fclose(fp);
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int x;
+	int res;
+	int exit_code = 0;
+	int skipped_spans = 0;
+	int skipped_chans = 0;
+	int skipped_zones = 0;
+	bool zone_skipped;
+	char *unbuilt[DAHDI_TONE_ZONE_MAX];
+	int results[DAHDI_TONE_ZONE_MAX];
+	int numunbuilt = 0;
+	static struct span_job jobs[DAHDI_MAX_SPANS];
+	struct span_job rest;
+	int numjobs;
+	struct sigaction act;
+	const char *request = NULL;
+	static struct option long_options[] = {
+		{"profile",	required_argument, 0, 'P'},
+		{"daemon",	no_argument,       0, 'D'},
+		{"socket",	required_argument, 0, 'K'},
+		{"request",	required_argument, 0, 'R'},
+		{0, 0, 0, 0}
+	};
+
+	clock_gettime(CLOCK_MONOTONIC, &profile_epoch);
+	while((c = getopt_long(argc, argv, "fthc:vsd::C:S:j:",
+			       long_options, NULL)) != -1) {
+		switch(c) {
+		case 'c':
+			filename=optarg;
+			break;
+		case 'h':
+			usage(argv[0], 0);
+			break;
+		case '?':
+			usage(argv[0], 1);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'f':
+			force++;
+			break;
+		case 't':
+			dry_run = 1;
+			break;
+		case 's':
+			stopmode = 1;
+			break;
+		case 'C':
+			if (!chan_restrict(optarg))
+				usage(argv[0], 1);
+			break;
+		case 'S':
+			if (!span_restrict(optarg))
+				usage(argv[0], 1);
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			if (workers < 1 || workers > DAHDI_MAX_SPANS) {
+				fprintf(stderr, "Invalid number of workers '%s'\n", optarg);
+				usage(argv[0], 1);
+			}
+			break;
+		case 'd':
+			if (optarg)
+				debug = atoi(optarg);
+			else
+				debug = 1;	
+			break;
+		case 'P':
+			profile_file = optarg;
+			break;
+		case 'D':
+			daemon_mode = 1;
+			break;
+		case 'K':
+			socket_path = optarg;
+			break;
+		case 'R':
+			request = optarg;
+			break;
+		}
+	}
+	if (request)
+		exit(send_request(request));
+	if (daemon_mode &&
+	    (dry_run || stopmode || restrict_spans || restrict_channels ||
+	     !strcmp(filename, "-"))) {
+		fprintf(stderr, "--daemon needs a configuration file, "
+			"and takes none of -t, -s, -S and -C\n");
+		usage(argv[0], 1);
+	}
+	if (profile_file)
+		atexit(profile_write);
+	
+	if (verbose) {
+		fprintf(stderr, "%s\n", dahdi_tools_version);
+	}
+
+	if (getenv("DAHDI_VIRT_TOP"))
+		virt_top = getenv("DAHDI_VIRT_TOP");
+
+	if (!restrict_channels && restrict_spans) {
+		error("-S requires -C\n");
+		goto finish;
+	}
+	if (!restrict_channels && !restrict_spans && !daemon_mode) {
+		bool all_assigned;
+
+		profile_begin(PROF_ASSIGN_WAIT);
+		all_assigned = wait_for_all_spans_assigned(5);
+		profile_end(PROF_ASSIGN_WAIT);
+		if (!all_assigned) {
+			fprintf(stderr,
+				"Timeout waiting for all spans to be assigned.\n");
+		}
+	}
+
+	if (fd == -1) fd = open(MASTER_DEVICE, O_RDWR);
+	if (fd < 0) {
+		error("Unable to open master device '%s'\n", MASTER_DEVICE);
+		goto finish;
 	}
+	profile_begin(PROF_PARSE);
+	if (daemon_mode)
+		config_identity(&config_st);
+	load_config();
+	profile_end(PROF_PARSE);
 
 finish:
 	if (errcnt) {
 		fprintf(stderr, "\n%d error(s) detected\n\n", errcnt);
 		exit(1);
 	}
+	if (daemon_mode)
+		run_daemon(fd);	/* Returns in a child, to apply */
 	if (verbose) {
 		printconfig(fd);
 	}
@@ -1676,29 +4571,40 @@ finish:
 		exit(1);
 	}
 
-	lock = sem_open(SEM_NAME, O_CREAT, O_RDWR, 1);
-	if (SEM_FAILED == lock) {
-		perror("Unable to create 'dahdi_cfg' mutex");
+	profile_begin(PROF_LOCK);
+	if (lock_global(!restrict_spans)) {
 		exit_code = 1;
-		goto release_sem;
+		goto unlink_sem;
 	}
-
-	if (-1 == sem_wait(lock)) {
-		perror("Failed to wait for 'dahdi_cfg' mutex");
+	if (lock_spans() || lock_state()) {
 		exit_code = 1;
-		goto unlink_sem;
+		goto release_sem;
 	}
+	profile_end(PROF_LOCK);
+
+	profile_begin(PROF_STATE);
+	if (!force && !stopmode)
+		snapshot_load(fd);
+	unlock_state();
+	profile_end(PROF_STATE);
 
-	if (!restrict_channels && !only_span) {
+	if (!restrict_channels && !restrict_spans) {
+		profile_begin(PROF_DYNAMIC);
 		for (x=0;x<numdynamic;x++) {
 			/* destroy them all */
 			ioctl(fd, DAHDI_DYNAMIC_DESTROY, &zds[x]);
 		}
+		profile_end(PROF_DYNAMIC);
 	}
 
+	profile_begin(PROF_STATE);
+	snapshot_validate(fd);
+	profile_end(PROF_STATE);
+
 	if (stopmode) {
+		profile_begin(PROF_SHUTDOWN);
 		for (x=0;x<spans;x++) {
-			if (only_span && lc[x].span != only_span)
+			if (!span_selected(lc[x].span))
 				continue;
 			if (ioctl(fd, DAHDI_SHUTDOWN, &lc[x].span)) {
 				fprintf(stderr, "DAHDI shutdown failed: %s\n", strerror(errno));
@@ -1707,24 +4613,34 @@ finish:
 				goto release_sem;
 			}
 		}
+		profile_end(PROF_SHUTDOWN);
 		exit_code = 1;
 		goto release_sem;
 	}
+	numjobs = 0;
 	for (x=0;x<spans;x++) {
-		if (only_span && lc[x].span != only_span)
+		if (!span_selected(lc[x].span))
 			continue;
-		if (ioctl(fd, DAHDI_SPANCONFIG, lc + x)) {
-			fprintf(stderr, "DAHDI_SPANCONFIG failed on span %d: %s (%d)\n", lc[x].span, strerror(errno), errno);
-			close(fd);
-			exit_code = 1;
-			goto release_sem;
-		}
+		memset(&jobs[numjobs], 0, sizeof(jobs[numjobs]));
+		jobs[numjobs++].arg = x;
+	}
+	profile_begin(PROF_SPANCONFIG);
+	res = run_span_jobs(jobs, numjobs, job_spanconfig);
+	profile_end(PROF_SPANCONFIG);
+	profile_jobs(PROF_SPANCONFIG, jobs, numjobs, true);
+	if (res) {
+		close(fd);
+		exit_code = 1;
+		goto release_sem;
 	}
+	for (x = 0; x < numjobs; x++)
+		skipped_spans += jobs[x].skipped;
 
-	if (!restrict_channels && !only_span) {
+	if (!restrict_channels && !restrict_spans) {
 
-		sem_post(lock);
+		unlock_global();
 
+		profile_begin(PROF_DYNAMIC);
 		for (x=0;x<numdynamic;x++) {
 			if (ioctl(fd, DAHDI_DYNAMIC_CREATE, &zds[x])) {
 				fprintf(stderr, "DAHDI dynamic span creation failed: %s\n", strerror(errno));
@@ -1732,170 +4648,78 @@ finish:
 				exit_code = 1;
 				goto release_sem;
 			}
-			wait_for_all_spans_assigned(1);
 		}
+		if (numdynamic) {
+			unsigned long timeout = DYNAMIC_WAIT_SEC +
+				numdynamic / DYNAMIC_SPANS_PER_SEC;
 
-		if (-1 == sem_wait(lock)) {
-			perror("Failed to wait for 'dahdi_cfg' mutex after creating dynamic spans");
-			exit_code = 1;
-			goto unlink_sem;
+			if (!wait_for_all_spans_assigned(timeout))
+				report_unassigned_dynamic(timeout);
 		}
-	}
+		profile_end(PROF_DYNAMIC);
 
-	for (x=1;x<DAHDI_MAX_CHANNELS;x++) {
-		struct dahdi_params current_state;
-		int master;
-		int needupdate = force;
-
-		if (skip_channel(x)) {
-			if (debug & DEBUG_APPLY) {
-				printf("Skip device %d\n", x);
-				fflush(stdout);
-			}
-			continue;
-		}
-		if (debug & DEBUG_APPLY) {
-			printf("Configuring device %d\n", x);
-			fflush(stdout);
-		}
-		if (!cc[x].sigtype)
-			continue;
-		
-		if (!needupdate) {
-			memset(&current_state, 0, sizeof(current_state));
-			current_state.channo = cc[x].chan | DAHDI_GET_PARAMS_RETURN_MASTER;
-			if (ioctl(fd, DAHDI_GET_PARAMS, &current_state))
-				needupdate = 1;
-		}
-		
-		if (!needupdate) {
-			master = current_state.channo >> 16;
-			
-			if (cc[x].sigtype != current_state.sigtype) {
-				needupdate++;
-				if (verbose > 1)
-					printf("Changing signalling on channel %d from %s to %s\n",
-					       cc[x].chan, sigtype_to_str(current_state.sigtype),
-					       sigtype_to_str(cc[x].sigtype));
-			}
-			
-			if ((cc[x].deflaw != DAHDI_LAW_DEFAULT) && (cc[x].deflaw != current_state.curlaw)) {
-				needupdate++;
-				if (verbose > 1)
-					printf("Changing law on channel %d from %s to %s\n",
-					       cc[x].chan, laws[current_state.curlaw],
-					       laws[cc[x].deflaw]);
-			}
-			
-			if (cc[x].master != master) {
-				needupdate++;
-				if (verbose > 1)
-					printf("Changing master of channel %d from %d to %d\n",
-					       cc[x].chan, master,
-					       cc[x].master);
-			}
-			
-			if (cc[x].idlebits != current_state.idlebits) {
-				needupdate++;
-				if (verbose > 1)
-					printf("Changing idle bits of channel %d from %d to %d\n",
-					       cc[x].chan, current_state.idlebits,
-					       cc[x].idlebits);
-			}
-		}
-		
-		if (needupdate && ioctl(fd, DAHDI_CHANCONFIG, &cc[x])) {
-			fprintf(stderr, "DAHDI_CHANCONFIG failed on channel %d: %s (%d)\n", x, strerror(errno), errno);
-			if (errno == EINVAL) {
-				/* give helpful suggestions on signaling errors */
-				fprintf(stderr, "Selected signaling not "
-						"supported\n");
-				fprintf(stderr, "Possible causes:\n");
-				switch(cc[x].sigtype) {
-				case DAHDI_SIG_FXOKS:
-				case DAHDI_SIG_FXOLS:
-				case DAHDI_SIG_FXOGS:
-					fprintf(stderr, "\tFXO signaling is "
-						"being used on a FXO interface"
-						" (use a FXS signaling variant"
-						")\n");
-					fprintf(stderr, "\tRBS signaling is "
-						"being used on a E1 CCS span"
-						"\n");
-					break;
-				case DAHDI_SIG_FXSKS:
-				case DAHDI_SIG_FXSLS:
-				case DAHDI_SIG_FXSGS:
-					fprintf(stderr, "\tFXS signaling is "
-						"being used on a FXS interface"
-						" (use a FXO signaling variant"
-						")\n");
-					fprintf(stderr, "\tRBS signaling is "
-						"being used on a E1 CCS span"
-						"\n");
-					break;
-				case DAHDI_SIG_EM:
-					fprintf(stderr, "\te&m signaling is "
-						"being used on a E1 line (use"
-						" e&me1)\n");
-					break;
-				case DAHDI_SIG_EM_E1:
-					fprintf(stderr, "\te&me1 signaling is "
-						"being used on a T1 line (use "
-						"e&m)\n");
-					fprintf(stderr, "\tRBS signaling is "
-						"being used on a E1 CCS span"
-						"\n");
-					break;
-				case DAHDI_SIG_HARDHDLC:
-					fprintf(stderr, "\thardhdlc is being "
-						"used on a TE12x (use dchan)\n"
-						);
-					break;
-				case DAHDI_SIG_HDLCFCS:
-					fprintf(stderr, "\tdchan is being used"
-						" on a BRI span (use hardhdlc)"
-						"\n");
-					break;
-				default:
-					break;
-				}
-				fprintf(stderr, "\tSignaling is being assigned"
-					" to channel 16 of an E1 CAS span\n");
-			}
-			close(fd);
+		profile_begin(PROF_LOCK);
+		if (lock_global(true)) {
+			fprintf(stderr, "Failed to lock again after creating dynamic spans\n");
 			exit_code = 1;
-			goto release_sem;
-		}
-
-		ae[x].chan = x;
-		if (verbose) {
-			printf("Setting echocan for channel %d to %s\n", ae[x].chan, ae[x].echocan[0] ? ae[x].echocan : "none");
+			goto unlink_sem;
 		}
+		profile_end(PROF_LOCK);
+	}
 
-		if (ioctl(fd, DAHDI_ATTACH_ECHOCAN, &ae[x])) {
-			fprintf(stderr, "DAHDI_ATTACH_ECHOCAN failed on channel %d: %s (%d)\n", x, strerror(errno), errno);
-			close(fd);
-			exit_code = 1;
-			goto release_sem;
-		}
+	profile_begin(PROF_CHANNELS);
+	numjobs = channel_jobs(jobs, &rest);
+	res = run_span_jobs(jobs, numjobs, job_channels);
+	if (!res)
+		res = run_job(fd, &rest, job_channels, stdout, stderr);
+	profile_end(PROF_CHANNELS);
+	profile_jobs(PROF_CHANNELS, jobs, numjobs, false);
+	profile_jobs(PROF_CHANNELS, &rest, 1, false);
+	if (res) {
+		close(fd);
+		exit_code = 1;
+		goto release_sem;
 	}
-	if (0 == numzones) {
-		/* Default to the us zone if one wasn't specified. */
-		dahdi_copy_string(zonestoload[numzones++], "us", sizeof(zonestoload[0]));
-		deftonezone = 0;
+	for (x = 0; x < numjobs; x++)
+		skipped_chans += jobs[x].skipped;
+	skipped_chans += rest.skipped;
+	profile_begin(PROF_ZONES);
+	if (lock_state()) {
+		close(fd);
+		exit_code = 1;
+		goto release_sem;
 	}
-
 	for (x=0;x<numzones;x++) {
 		if (debug & DEBUG_APPLY) {
 			printf("Loading tone zone for %s\n", zonestoload[x]);
 			fflush(stdout);
 		}
-		if (tone_zone_register(fd, zonestoload[x])) {
+		if (!zone_images[x].data) {
+			/* Registered below, which reports why it failed */
+			unbuilt[numunbuilt++] = zonestoload[x];
+			continue;
+		}
+		zone_skipped = false;
+		res = load_zone_image(fd, &zone_images[x], &zone_skipped);
+		if (zone_skipped) {
+			skipped_zones++;
+			if (verbose > 1)
+				printf("Tone zone '%s' is already loaded\n",
+				       zonestoload[x]);
+		}
+		if (res) {
 			if (errno != EBUSY)
 				error("Unable to register tone zone '%s'\n", zonestoload[x]);
 		}
 	}
+	if (numunbuilt) {
+		tone_zone_register_zones(fd, unbuilt, numunbuilt, results);
+		for (x = 0; x < numunbuilt; x++) {
+			if (results[x] && results[x] != EBUSY)
+				error("Unable to register tone zone '%s': %s\n",
+				      unbuilt[x], strerror(results[x]));
+		}
+	}
 	if (debug & DEBUG_APPLY) {
 		printf("Doing startup\n");
 		fflush(stdout);
@@ -1908,21 +4732,58 @@ finish:
 			goto release_sem;
 		}
 	}
+	unlock_state();
+	profile_end(PROF_ZONES);
+	numjobs = 0;
 	for (x=0;x<spans;x++) {
-		if (only_span && lc[x].span != only_span)
+		if (!span_selected(lc[x].span))
 			continue;
-		if (ioctl(fd, DAHDI_STARTUP, &lc[x].span)) {
-			fprintf(stderr, "DAHDI startup failed: %s\n", strerror(errno));
-			close(fd);
-			exit_code = 1;
-			goto release_sem;
-		}
+		memset(&jobs[numjobs], 0, sizeof(jobs[numjobs]));
+		jobs[numjobs++].arg = x;
+	}
+	profile_begin(PROF_STARTUP);
+	res = run_span_jobs(jobs, numjobs, job_startup);
+	profile_end(PROF_STARTUP);
+	profile_jobs(PROF_STARTUP, jobs, numjobs, true);
+	if (res) {
+		close(fd);
+		exit_code = 1;
+		goto release_sem;
 	}
-	exit_code = apply_fiftysix();
+	profile_begin(PROF_CHANSETUP);
+	numjobs = channel_jobs(jobs, &rest);
+	res = run_span_jobs(jobs, numjobs, job_chansetup);
+	if (!res)
+		res = run_job(fd, &rest, job_chansetup, stdout, stderr);
+	profile_end(PROF_CHANSETUP);
+	profile_jobs(PROF_CHANSETUP, jobs, numjobs, false);
+	profile_jobs(PROF_CHANSETUP, &rest, 1, false);
+	if (res)
+		exit_code = 1;
+	if (verbose)
+		printf("%lu channel(s) opened for %lu per-channel ioctl(s)\n",
+		       chan_opens, chan_ioctls);
+	if (verbose && snap_loaded)
+		printf("%d span(s) and %d channel(s) unchanged since last run\n",
+		       skipped_spans, skipped_chans);
+	if (verbose && (ec_skipped || skipped_zones))
+		printf("%lu echo canceller(s) and %d tone zone(s) left as loaded\n",
+		       ec_skipped, skipped_zones);
 
 release_sem:
-	if (SEM_FAILED != lock)
-		sem_post(lock);
+	profile_begin(PROF_STATE);
+	unlock_state();
+	if (!lock_state()) {
+		if (!exit_code && !stopmode)
+			snapshot_save(fd);
+		else
+			snapshot_discard();
+		unlock_state();
+	}
+	profile_end(PROF_STATE);
+
+	unlock_spans();
+	unlock_global();
 
 unlink_sem:
 	if (SEM_FAILED != lock)
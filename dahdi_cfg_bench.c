@@ -0,0 +1,138 @@
+/*
+ * dahdi_cfg_bench: measure the speed of the dahdi_cfg configuration
+ * parser on a synthetic system.conf.
+ *
+ * Nothing is applied: only the text is parsed into the dahdi_cfg
+ * data structures, over and over.
+ *
+ * Copyright (C) 2026, the DAHDI tools contributors
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+/* Pull in the parser itself, with its main() renamed out of the way */
+#define main dahdi_cfg_main
+#include "dahdi_cfg.c"
+#undef main
+
+static const char *bench_sigs[] = {
+	"fxoks", "FXSKS", "e&m", "fxsls", "unused", "fxogs",
+};
+
+/**
+ * make_config - Generate a synthetic configuration.
+ * @numchans: number of channels to configure. 24 to a span.
+ * @lines: set to the number of lines generated
+ *
+ * Every channel gets its own signalling, law and echo canceller
+ * line, the way generated configurations tend to look.
+ */
+static char *make_config(int numchans, int *lines)
+{
+	FILE *fp;
+	char *text = NULL;
+	size_t len = 0;
+	int chan;
+	int n = 0;
+
+	fp = open_memstream(&text, &len);
+	if (!fp) {
+		perror("open_memstream");
+		exit(1);
+	}
+	fprintf(fp, "# Synthetic configuration: %d channels\n", numchans);
+	n++;
+	for (chan = 1; chan <= numchans; chan++) {
+		if (chan % 24 == 1) {
+			fprintf(fp, "\n# Span %d\nspan=%d,%d,0,esf,b8zs\n",
+				chan / 24 + 1, chan / 24 + 1, chan / 24 + 1);
+			n += 3;
+		}
+		fprintf(fp, "%s=%d\t# channel %d\n",
+			bench_sigs[chan % (sizeof(bench_sigs) / sizeof(bench_sigs[0]))], chan, chan);
+		fprintf(fp, "%s = %d\n", (chan & 1) ? "alaw" : "mulaw", chan);
+		fprintf(fp, "echocanceller=mg2,%d\n", chan);
+		n += 3;
+	}
+	fprintf(fp, "bchan=%d-%d\n", numchans + 1, DAHDI_MAX_CHANNELS - 1);
+	n++;
+	fclose(fp);
+	*lines = n;
+	return text;
+}
+
+static void bench_usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-n <iterations>] [-c <channels>]\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec start, end;
+	char *text, *work;
+	size_t len;
+	int iterations = 1000;
+	int numchans = DAHDI_MAX_CHANNELS / 2;
+	int lines;
+	int c;
+	int i;
+	double secs;
+
+	while ((c = getopt(argc, argv, "n:c:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'c':
+			numchans = atoi(optarg);
+			break;
+		default:
+			bench_usage(argv[0]);
+		}
+	}
+	if (iterations < 1 || numchans < 1 || numchans >= DAHDI_MAX_CHANNELS - 1)
+		bench_usage(argv[0]);
+
+	text = make_config(numchans, &lines);
+	len = strlen(text);
+	work = malloc(len + 1);
+	if (!work) {
+		perror("malloc");
+		exit(1);
+	}
+
+	/* Warm up, and make sure the generated text is valid */
+	memcpy(work, text, len + 1);
+	reset_config();
+	parse_config(work);
+	if (errcnt) {
+		fprintf(stderr, "%d error(s) in the generated configuration\n", errcnt);
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		memcpy(work, text, len + 1);
+		reset_config();
+		parse_config(work);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d iterations of %d lines (%zu bytes): %.3f s\n",
+		iterations, lines, len, secs);
+	printf("%.1f us per parse, %.0f lines/s\n",
+		secs * 1e6 / iterations, (double)lines * iterations / secs);
+
+	free(work);
+	free(text);
+	return 0;
+}
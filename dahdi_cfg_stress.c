@@ -0,0 +1,584 @@
+/*
+ * dahdi_cfg_stress: run many dahdi_cfg -S / -C at once, on an emulated
+ * control device, and check what they leave behind.
+ *
+ * Every round the spans are replaced (and every few rounds the whole
+ * driver reloaded), then brought back by concurrent runs restricted to
+ * random, overlapping sets of spans, with now and then a full run among
+ * them. Afterwards each span must be configured and started, each
+ * channel configured, the tone zone loaded, and the state file saved
+ * by the runs must account for all of it: a full run that follows finds
+ * nothing to change. The emulated device (dahdi_cfg_stress_dev) also
+ * checks that each change was made under the locks dahdi_cfg should
+ * hold for it.
+ *
+ * Before the rounds, a full run is started while the span of a device
+ * in the sysfs tree is not assigned yet. It must go on as soon as the
+ * span appears, rather than when it would look again anyway.
+ *
+ * Copyright (C) 2026, the DAHDI tools contributors
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "dahdi_cfg_stress.h"
+
+#define MAX_RUNS	64
+#define RELOAD_EVERY	3
+/* An empty sysfs tree for DAHDI_VIRT_TOP: no span to wait for */
+#define STRESS_VIRT_TOP	"sys"
+/* A device of one span in it, for the assignment wait only */
+#define WAIT_BUS	STRESS_VIRT_TOP "/sys/bus"
+#define WAIT_DEVICE	WAIT_BUS "/dahdi_devices/devices/stress"
+#define WAIT_ASSIGN_MSEC	300	/* Until its span is assigned */
+/* dahdi_cfg looks again after 1000 ms without events */
+#define WAIT_WAKE_MSEC		400
+
+/* Leaves room for the names of the files in it */
+static char test_dir[PATH_MAX - 64];
+static struct stress_device *dev;
+static const char *dahdi_cfg = "./dahdi_cfg";
+static int failures;
+
+static void fail(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	failures++;
+}
+
+static void test_path(char *buf, size_t size, const char *name)
+{
+	snprintf(buf, size, "%s/%s", test_dir, name);
+}
+
+static void write_config(void)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int span;
+	int first;
+
+	test_path(path, sizeof(path), "system.conf");
+	fp = fopen(path, "w");
+	if (!fp) {
+		perror(path);
+		exit(1);
+	}
+	for (span = 1; span <= STRESS_SPANS; span++) {
+		first = (span - 1) * STRESS_SPAN_CHANS + 1;
+		fprintf(fp, "span=%d,0,0,esf,b8zs\n", span);
+		fprintf(fp, "bchan=%d-%d\n", first,
+			first + STRESS_SPAN_CHANS - 2);
+		fprintf(fp, "dchan=%d\n", first + STRESS_SPAN_CHANS - 1);
+	}
+	fprintf(fp, "echocanceller=mg2,1-%d\n", STRESS_CHANS);
+	fprintf(fp, "loadzone=us\n");
+	fprintf(fp, "defaultzone=us\n");
+	fclose(fp);
+}
+
+/*
+ * A new ctl node: to dahdi_cfg, the driver was loaded again. It is made
+ * before the old one goes, so that it cannot get the same inode.
+ */
+static void new_ctl(void)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	int fd;
+
+	test_path(path, sizeof(path), STRESS_CTL);
+	test_path(tmp, sizeof(tmp), STRESS_CTL ".new");
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || rename(tmp, path)) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+}
+
+static void setup(void)
+{
+	pthread_mutexattr_t attr;
+	char path[PATH_MAX];
+	const char *tmp = getenv("TMPDIR");
+	int fd;
+
+	snprintf(test_dir, sizeof(test_dir), "%s/dahdi_cfg_stress.XXXXXX",
+		 tmp ? tmp : "/tmp");
+	if (!mkdtemp(test_dir)) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	test_path(path, sizeof(path), STRESS_VIRT_TOP);
+	mkdir(path, 0755);
+	test_path(path, sizeof(path), STRESS_CHANNEL);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd >= 0)
+		close(fd);
+	new_ctl();
+	write_config();
+
+	test_path(path, sizeof(path), STRESS_DEVICE);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || ftruncate(fd, sizeof(*dev))) {
+		perror(path);
+		exit(1);
+	}
+	dev = mmap(NULL, sizeof(*dev), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	close(fd);
+	if (MAP_FAILED == dev) {
+		perror("mmap");
+		exit(1);
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&dev->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void cleanup(void)
+{
+	char cmd[PATH_MAX + 16];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", test_dir);
+	if (system(cmd))
+		fprintf(stderr, "Unable to remove %s\n", test_dir);
+}
+
+/* Take the spans and channels away, as if the hardware was replaced */
+static void replace_spans(int reload)
+{
+	pthread_mutex_lock(&dev->lock);
+	memset(dev->spans, 0, sizeof(dev->spans));
+	memset(dev->chans, 0, sizeof(dev->chans));
+	if (reload) {
+		memset(dev->zones, 0, sizeof(dev->zones));
+		dev->defaultzone = 0;
+	}
+	pthread_mutex_unlock(&dev->lock);
+	if (reload)
+		new_ctl();
+}
+
+/*
+ * Start dahdi_cfg. Spans in @spans are applied with -S / -C, or all of
+ * them if there are none. The output goes to @out, or to the test log.
+ * With @profile, the run writes its --profile there.
+ */
+static pid_t start_run(const int *spans, int numspans, int verbose,
+		       const char *out, const char *profile)
+{
+	char conf[PATH_MAX];
+	char log[PATH_MAX];
+	char spanlist[64] = "";
+	char chanlist[256] = "";
+	char *argv[12];
+	int argc = 0;
+	pid_t pid;
+	int fd;
+	int x;
+
+	for (x = 0; x < numspans; x++) {
+		int first = (spans[x] - 1) * STRESS_SPAN_CHANS + 1;
+
+		snprintf(spanlist + strlen(spanlist),
+			 sizeof(spanlist) - strlen(spanlist),
+			 "%s%d", x ? "," : "", spans[x]);
+		snprintf(chanlist + strlen(chanlist),
+			 sizeof(chanlist) - strlen(chanlist),
+			 "%s%d-%d", x ? "," : "", first,
+			 first + STRESS_SPAN_CHANS - 1);
+	}
+	test_path(conf, sizeof(conf), "system.conf");
+	argv[argc++] = (char *)dahdi_cfg;
+	argv[argc++] = "-c";
+	argv[argc++] = conf;
+	if (verbose)
+		argv[argc++] = "-v";
+	if (profile) {
+		argv[argc++] = "--profile";
+		argv[argc++] = (char *)profile;
+	}
+	if (numspans) {
+		argv[argc++] = "-S";
+		argv[argc++] = spanlist;
+		argv[argc++] = "-C";
+		argv[argc++] = chanlist;
+	}
+	argv[argc] = NULL;
+
+	if (out)
+		snprintf(log, sizeof(log), "%s", out);
+	else
+		test_path(log, sizeof(log), "log");
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid)
+		return pid;
+	fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd >= 0) {
+		dup2(fd, 1);
+		dup2(fd, 2);
+		close(fd);
+	}
+	execv(dahdi_cfg, argv);
+	perror(dahdi_cfg);
+	_exit(127);
+}
+
+static int wait_run(pid_t pid)
+{
+	int status;
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+	if (!WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+static void check_device(int round)
+{
+	struct stress_span *s;
+	struct stress_chan *c;
+	int span;
+	int chan;
+	int sigtype;
+
+	pthread_mutex_lock(&dev->lock);
+	for (span = 1; span <= STRESS_SPANS; span++) {
+		s = &dev->spans[span];
+		if (!s->configured || s->lc.span != span ||
+		    s->lc.lineconfig != (DAHDI_CONFIG_ESF | DAHDI_CONFIG_B8ZS))
+			fail("Round %d: span %d is not configured\n",
+			     round, span);
+		else if (!s->running)
+			fail("Round %d: span %d is not started\n",
+			     round, span);
+	}
+	for (chan = 1; chan <= STRESS_CHANS; chan++) {
+		c = &dev->chans[chan];
+		sigtype = chan % STRESS_SPAN_CHANS ?
+			DAHDI_SIG_CLEAR : DAHDI_SIG_HDLCFCS;
+		if (!c->configured || c->cc.chan != chan ||
+		    c->cc.sigtype != sigtype)
+			fail("Round %d: channel %d is not configured\n",
+			     round, chan);
+		else if (strcmp(c->echocan, "mg2"))
+			fail("Round %d: channel %d has echo canceller '%s'\n",
+			     round, chan, c->echocan);
+	}
+	if (!dev->zones[0] || dev->defaultzone != 0)
+		fail("Round %d: tone zone 'us' is not loaded as the default\n",
+		     round);
+	if (dev->violations)
+		fail("Round %d: %d change(s) without a lock. First: %s\n",
+		     round, dev->violations, dev->violation);
+	dev->violations = 0;
+	pthread_mutex_unlock(&dev->lock);
+}
+
+/* A full run now must find the state the restricted runs saved complete */
+static void check_state(int round)
+{
+	char out[PATH_MAX];
+	char line[256];
+	char expect[64];
+	FILE *fp;
+	int found = 0;
+	pid_t pid;
+
+	test_path(out, sizeof(out), "verify");
+	unlink(out);
+	pid = start_run(NULL, 0, 1, out, NULL);
+	if (wait_run(pid)) {
+		fail("Round %d: the full run failed, see %s\n", round, out);
+		return;
+	}
+	snprintf(expect, sizeof(expect),
+		 "%d span(s) and %d channel(s) unchanged since last run",
+		 STRESS_SPANS, STRESS_CHANS);
+	fp = fopen(out, "r");
+	while (fp && fgets(line, sizeof(line), fp)) {
+		if (strstr(line, expect))
+			found = 1;
+	}
+	if (fp)
+		fclose(fp);
+	if (!found)
+		fail("Round %d: the full run found changes, see %s\n",
+		     round, out);
+}
+
+/* The duration of @phase in a --profile, or -1 */
+static long profile_usec(const char *path, const char *phase)
+{
+	char buf[4096];
+	char name[64];
+	long usec = -1;
+	size_t len;
+	char *p;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	len = fread(buf, 1, sizeof(buf) - 1, fp);
+	fclose(fp);
+	buf[len] = '\0';
+	snprintf(name, sizeof(name), "\"name\": \"%s\"", phase);
+	p = strstr(buf, name);
+	if (p)
+		p = strstr(p, "\"duration_us\": ");
+	if (p)
+		sscanf(p + strlen("\"duration_us\": "), "%ld", &usec);
+	return usec;
+}
+
+static void make_dir(const char *name)
+{
+	char path[PATH_MAX];
+
+	test_path(path, sizeof(path), name);
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		perror(path);
+		exit(1);
+	}
+}
+
+/*
+ * Start a full run while the span of a device is unassigned, assign it
+ * a little later, and see from the profile of the run how long it
+ * waited.
+ */
+static void check_assign_wait(void)
+{
+	char path[PATH_MAX];
+	char profile[PATH_MAX];
+	char cmd[PATH_MAX + 16];
+	long usec;
+	FILE *fp;
+	pid_t pid;
+
+	make_dir(STRESS_VIRT_TOP "/sys");
+	make_dir(WAIT_BUS);
+	make_dir(WAIT_BUS "/dahdi_devices");
+	make_dir(WAIT_BUS "/dahdi_devices/devices");
+	make_dir(WAIT_DEVICE);
+	test_path(path, sizeof(path), WAIT_DEVICE "/span_count");
+	fp = fopen(path, "w");
+	if (!fp) {
+		perror(path);
+		exit(1);
+	}
+	fprintf(fp, "1\n");
+	fclose(fp);
+
+	test_path(profile, sizeof(profile), "profile");
+	pid = start_run(NULL, 0, 0, NULL, profile);
+	usleep(WAIT_ASSIGN_MSEC * 1000);
+	make_dir(WAIT_DEVICE "/span-1");
+	if (wait_run(pid))
+		fail("The run waiting for span assignment failed\n");
+	usec = profile_usec(profile, "assign_wait");
+	if (usec < 0)
+		fail("No assign_wait in %s\n", profile);
+	else if (usec < WAIT_ASSIGN_MSEC * 1000 / 2)
+		fail("dahdi_cfg did not wait for span assignment (%ld ms)\n",
+		     usec / 1000);
+	else if (usec > (WAIT_ASSIGN_MSEC + WAIT_WAKE_MSEC) * 1000)
+		fail("dahdi_cfg noticed span assignment after %ld ms, "
+		     "%d ms late\n", usec / 1000,
+		     (int)(usec / 1000) - WAIT_ASSIGN_MSEC);
+
+	/* The rounds run with no span to wait for */
+	test_path(path, sizeof(path), WAIT_BUS);
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", path);
+	if (system(cmd))
+		fail("Unable to remove %s\n", path);
+}
+
+/* Fill @spans with one to three different spans, starting with @first */
+static int pick_spans(int *spans, int first)
+{
+	int numspans = 1 + rand() % 3;
+	int n = 1;
+	int x, y;
+	int span;
+
+	spans[0] = first;
+	while (n < numspans) {
+		span = 1 + rand() % STRESS_SPANS;
+		for (x = 0; x < n && spans[x] != span; x++)
+			;
+		if (x == n)
+			spans[n++] = span;
+	}
+	/* -S and the span locks do not care, but keep it readable */
+	for (x = 1; x < n; x++) {
+		span = spans[x];
+		for (y = x; y > 0 && spans[y - 1] > span; y--)
+			spans[y] = spans[y - 1];
+		spans[y] = span;
+	}
+	return n;
+}
+
+static int run_round(int round, int numruns)
+{
+	int spans[MAX_RUNS][3];
+	int numspans[MAX_RUNS];
+	pid_t pids[MAX_RUNS];
+	int full = -1;
+	int before = failures;
+	int x;
+
+	replace_spans(!(round % RELOAD_EVERY));
+	if (round % 2)
+		full = rand() % numruns;
+	/* Every span is picked first by some run, so none is left out */
+	for (x = 0; x < numruns; x++)
+		numspans[x] = x == full ? 0 :
+			pick_spans(spans[x], 1 + x % STRESS_SPANS);
+	for (x = 0; x < numruns; x++)
+		pids[x] = start_run(spans[x], numspans[x], 0, NULL, NULL);
+	for (x = 0; x < numruns; x++) {
+		if (wait_run(pids[x]))
+			fail("Round %d: dahdi_cfg run %d failed\n", round, x);
+	}
+	check_device(round);
+	if (failures == before)
+		check_state(round);
+	return failures == before;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-n <runs>] [-r <rounds>] [-s <seed>] [-d <usec>]\n"
+		"          [-c <dahdi_cfg>] [-l <dahdi_cfg_stress_dev.so>]\n"
+		"   -n <runs>   concurrent dahdi_cfg runs a round (at least %d)\n"
+		"   -r <rounds> rounds to run\n"
+		"   -s <seed>   seed of the random span choices\n"
+		"   -d <usec>   time each emulated change takes\n"
+		"   -c <path>   dahdi_cfg to run (./dahdi_cfg)\n"
+		"   -l <path>   emulated device library to preload\n"
+		"               (./.libs/dahdi_cfg_stress_dev.so)\n"
+		"   -k          keep the test directory\n",
+		argv0, STRESS_SPANS);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	char lib[PATH_MAX];
+	char path[PATH_MAX];
+	const char *shim = "./.libs/dahdi_cfg_stress_dev.so";
+	const char *delay = "200";
+	unsigned int seed = time(NULL);
+	int numruns = 12;
+	int rounds = 10;
+	int keep = 0;
+	int passed = 0;
+	int round;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:r:s:d:c:l:kh")) != -1) {
+		switch (c) {
+		case 'n':
+			numruns = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			delay = optarg;
+			break;
+		case 'c':
+			dahdi_cfg = optarg;
+			break;
+		case 'l':
+			shim = optarg;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (numruns < STRESS_SPANS || numruns > MAX_RUNS || rounds < 1)
+		usage(argv[0]);
+	if (!realpath(shim, lib)) {
+		perror(shim);
+		return 1;
+	}
+	if (access(dahdi_cfg, X_OK)) {
+		perror(dahdi_cfg);
+		return 1;
+	}
+	srand(seed);
+
+	setup();
+	test_path(path, sizeof(path), STRESS_VIRT_TOP);
+	setenv("DAHDI_VIRT_TOP", path, 1);
+	setenv(STRESS_DIR_ENV, test_dir, 1);
+	setenv(STRESS_DELAY_ENV, delay, 1);
+	setenv("LD_PRELOAD", lib, 1);
+
+	printf("%d rounds of %d concurrent runs on %d spans, seed %u\n",
+	       rounds, numruns, STRESS_SPANS, seed);
+	if (wait_run(start_run(NULL, 0, 0, NULL, NULL))) {
+		test_path(path, sizeof(path), "log");
+		fprintf(stderr, "The first full run failed, see %s\n", path);
+		return 1;
+	}
+	check_assign_wait();
+	for (round = 1; round <= rounds; round++)
+		passed += run_round(round, numruns);
+	printf("%d of %d rounds passed, %lu ioctl(s)\n",
+	       passed, rounds, dev->ioctls);
+	if (failures) {
+		printf("Logs are in %s\n", test_dir);
+		return 1;
+	}
+	if (!keep)
+		cleanup();
+	return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * dahdi_cfg_stress.h: the control device emulated for dahdi_cfg_stress.
+ *
+ * The library dahdi_cfg_stress_dev is preloaded into every dahdi_cfg
+ * run. It sends the device nodes and the state directory of dahdi_cfg
+ * to a test directory, and answers the ioctls on the control device
+ * from a file there that the test and all runs map shared.
+ *
+ * Copyright (C) 2026, the DAHDI tools contributors
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef DAHDI_CFG_STRESS_H
+#define DAHDI_CFG_STRESS_H
+
+#include <pthread.h>
+#include <dahdi/user.h>
+
+#define STRESS_SPANS		8
+#define STRESS_SPAN_CHANS	24
+#define STRESS_CHANS		(STRESS_SPANS * STRESS_SPAN_CHANS)
+
+/* The test directory, in the environment of the runs */
+#define STRESS_DIR_ENV		"DAHDI_STRESS_DIR"
+/* Microseconds each configuration ioctl takes, to widen races */
+#define STRESS_DELAY_ENV	"DAHDI_STRESS_DELAY_US"
+/*
+ * In the test directory: the state of the device, the nodes standing
+ * for /dev/dahdi/ctl and /dev/dahdi/channel, and the directory standing
+ * for /run/dahdi. Only the identity of the ctl node matters: a new one
+ * is a reloaded driver, to dahdi_cfg.
+ */
+#define STRESS_DEVICE		"device"
+#define STRESS_CTL		"ctl"
+#define STRESS_CHANNEL		"channel"
+#define STRESS_RUN_DIR		"run"
+
+struct stress_span {
+	struct dahdi_lineconfig lc;
+	int configured;
+	int running;
+};
+
+struct stress_chan {
+	struct dahdi_chanconfig cc;
+	int configured;
+	char echocan[sizeof(((struct dahdi_attach_echocan *)0)->echocan)];
+};
+
+struct stress_device {
+	pthread_mutex_t lock;		/* Process shared and robust */
+	struct stress_span spans[STRESS_SPANS + 1];
+	struct stress_chan chans[STRESS_CHANS + 1];
+	int zones[DAHDI_TONE_ZONE_MAX];	/* Loaded */
+	int defaultzone;
+	unsigned long ioctls;
+	/* Changes made without the lock that dahdi_cfg should hold */
+	int violations;
+	char violation[200];		/* The first one */
+};
+
+#endif
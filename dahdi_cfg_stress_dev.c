@@ -0,0 +1,585 @@
+/*
+ * dahdi_cfg_stress_dev: an emulated DAHDI control device, preloaded
+ * into dahdi_cfg by dahdi_cfg_stress.
+ *
+ * Does nothing unless DAHDI_STRESS_DIR is set. Then /dev/dahdi/ctl,
+ * /dev/dahdi/channel and /run/dahdi are taken from that directory, and
+ * the ioctls dahdi_cfg uses are answered from the device state there.
+ *
+ * Every change to a span, one of its channels or a tone zone is checked
+ * against the locks of dahdi_cfg: the span (or zone) lock, or the global
+ * lock taken exclusively, must be held by the process making it. Changes
+ * made without are counted in the device state.
+ *
+ * Copyright (C) 2026, the DAHDI tools contributors
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include "dahdi_cfg_stress.h"
+
+#define DAHDI_DEV_DIR	"/dev/dahdi/"
+#define DAHDI_RUN_DIR	"/run/dahdi"
+#define MAX_FDS		4096
+#define LOCKS_BUF_SIZE	(1024 * 1024)
+
+enum fd_type {
+	FD_OTHER = 0,
+	FD_CTL,
+	FD_CHAN,
+};
+
+static const char *test_dir;
+static struct stress_device *dev;
+static useconds_t delay_us;
+static unsigned char fd_types[MAX_FDS];
+static int fd_chans[MAX_FDS];
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static FILE *(*real_fopen)(const char *, const char *);
+static int (*real_mkdir)(const char *, mode_t);
+static int (*real_unlink)(const char *);
+static int (*real_rename)(const char *, const char *);
+static int (*real_mkstemp)(char *);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+
+/*
+ * Looked up when first needed: constructors of other libraries, run
+ * before the one here, may already open files.
+ */
+static void resolve(void)
+{
+	if (real_ioctl)
+		return;
+	real_open = dlsym(RTLD_NEXT, "open");
+	real_openat = dlsym(RTLD_NEXT, "openat");
+	real_fopen = dlsym(RTLD_NEXT, "fopen");
+	real_mkdir = dlsym(RTLD_NEXT, "mkdir");
+	real_unlink = dlsym(RTLD_NEXT, "unlink");
+	real_rename = dlsym(RTLD_NEXT, "rename");
+	real_mkstemp = dlsym(RTLD_NEXT, "mkstemp");
+	real_close = dlsym(RTLD_NEXT, "close");
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+}
+
+static void __attribute__((constructor)) stress_init(void)
+{
+	char path[PATH_MAX];
+	const char *s;
+	int fd;
+
+	resolve();
+	test_dir = getenv(STRESS_DIR_ENV);
+	if (!test_dir)
+		return;
+	if ((s = getenv(STRESS_DELAY_ENV)))
+		delay_us = atoi(s);
+	snprintf(path, sizeof(path), "%s/%s", test_dir, STRESS_DEVICE);
+	fd = real_open(path, O_RDWR | O_CLOEXEC);
+	if (fd >= 0) {
+		dev = mmap(NULL, sizeof(*dev), PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+		real_close(fd);
+	}
+	if (fd < 0 || MAP_FAILED == dev) {
+		fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+}
+
+/* The path to use instead of @name, in @buf, or @name itself */
+static const char *redirect(const char *name, char *buf, size_t size,
+			    enum fd_type *type)
+{
+	size_t runlen = strlen(DAHDI_RUN_DIR);
+
+	if (type)
+		*type = FD_OTHER;
+	if (!test_dir || !name)
+		return name;
+	if (!strncmp(name, DAHDI_RUN_DIR, runlen) &&
+	    (!name[runlen] || '/' == name[runlen])) {
+		snprintf(buf, size, "%s/%s%s", test_dir, STRESS_RUN_DIR,
+			 name + runlen);
+		return buf;
+	}
+	if (!strcmp(name, DAHDI_DEV_DIR "ctl")) {
+		if (type)
+			*type = FD_CTL;
+		snprintf(buf, size, "%s/%s", test_dir, STRESS_CTL);
+		return buf;
+	}
+	if (!strcmp(name, DAHDI_DEV_DIR "channel")) {
+		if (type)
+			*type = FD_CHAN;
+		snprintf(buf, size, "%s/%s", test_dir, STRESS_CHANNEL);
+		return buf;
+	}
+	return name;
+}
+
+static int opened(int fd, enum fd_type type)
+{
+	if (fd >= 0 && fd < MAX_FDS) {
+		fd_types[fd] = type;
+		fd_chans[fd] = 0;
+	}
+	return fd;
+}
+
+static mode_t open_mode(int flags, va_list ap)
+{
+	if (flags & (O_CREAT | O_TMPFILE))
+		return va_arg(ap, mode_t);
+	return 0;
+}
+
+int open(const char *name, int flags, ...)
+{
+	char buf[PATH_MAX];
+	enum fd_type type;
+	va_list ap;
+	mode_t mode;
+
+	resolve();
+	va_start(ap, flags);
+	mode = open_mode(flags, ap);
+	va_end(ap);
+	name = redirect(name, buf, sizeof(buf), &type);
+	return opened(real_open(name, flags, mode), type);
+}
+
+int open64(const char *name, int flags, ...)
+	__attribute__((alias("open")));
+
+int __open_2(const char *name, int flags)
+{
+	return open(name, flags);
+}
+
+int __open64_2(const char *name, int flags)
+	__attribute__((alias("__open_2")));
+
+int openat(int dirfd, const char *name, int flags, ...)
+{
+	char buf[PATH_MAX];
+	enum fd_type type;
+	va_list ap;
+	mode_t mode;
+
+	resolve();
+	va_start(ap, flags);
+	mode = open_mode(flags, ap);
+	va_end(ap);
+	name = redirect(name, buf, sizeof(buf), &type);
+	return opened(real_openat(dirfd, name, flags, mode), type);
+}
+
+int openat64(int dirfd, const char *name, int flags, ...)
+	__attribute__((alias("openat")));
+
+FILE *fopen(const char *name, const char *mode)
+{
+	char buf[PATH_MAX];
+
+	resolve();
+	return real_fopen(redirect(name, buf, sizeof(buf), NULL), mode);
+}
+
+FILE *fopen64(const char *name, const char *mode)
+	__attribute__((alias("fopen")));
+
+int mkdir(const char *name, mode_t mode)
+{
+	char buf[PATH_MAX];
+
+	resolve();
+	return real_mkdir(redirect(name, buf, sizeof(buf), NULL), mode);
+}
+
+int unlink(const char *name)
+{
+	char buf[PATH_MAX];
+
+	resolve();
+	return real_unlink(redirect(name, buf, sizeof(buf), NULL));
+}
+
+int rename(const char *from, const char *to)
+{
+	char buf1[PATH_MAX];
+	char buf2[PATH_MAX];
+
+	resolve();
+	return real_rename(redirect(from, buf1, sizeof(buf1), NULL),
+			   redirect(to, buf2, sizeof(buf2), NULL));
+}
+
+/* The name made from the template is copied back to the caller */
+int mkstemp(char *template)
+{
+	char buf[PATH_MAX];
+	const char *name;
+	size_t len = strlen(template);
+	size_t buflen;
+	int fd;
+
+	resolve();
+	name = redirect(template, buf, sizeof(buf), NULL);
+	if (name == template)
+		return real_mkstemp(template);
+	fd = real_mkstemp(buf);
+	buflen = strlen(buf);
+	if (fd >= 0 && len >= 6 && buflen >= 6)
+		memcpy(template + len - 6, buf + buflen - 6, 6);
+	return fd;
+}
+
+int mkstemp64(char *template)
+	__attribute__((alias("mkstemp")));
+
+int close(int fd)
+{
+	resolve();
+	opened(fd, FD_OTHER);
+	return real_close(fd);
+}
+
+/*
+ * Does this process hold a flock() on @name, exclusive if @exclusive?
+ *
+ * /proc/locks is read in one go: read in pieces, it can skip entries
+ * when locks are released between them.
+ */
+static int holds_lock(const char *name, int exclusive)
+{
+	char path[PATH_MAX];
+	char kind[16];
+	char access[16];
+	unsigned int dev_major, dev_minor;
+	unsigned long ino;
+	struct stat st;
+	char *buf;
+	char *line;
+	char *next;
+	ssize_t len;
+	int pid;
+	int fd;
+	int held = 0;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", test_dir, STRESS_RUN_DIR, name);
+	if (stat(path, &st))
+		return 0;
+	buf = malloc(LOCKS_BUF_SIZE);
+	fd = real_open("/proc/locks", O_RDONLY | O_CLOEXEC);
+	if (!buf || fd < 0) {
+		free(buf);
+		if (fd >= 0)
+			real_close(fd);
+		return 0;
+	}
+	len = read(fd, buf, LOCKS_BUF_SIZE - 1);
+	real_close(fd);
+	buf[len > 0 ? len : 0] = '\0';
+	for (line = buf; !held && line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		/* "1: FLOCK  ADVISORY  WRITE 1234 fe:00:5678 0 EOF" */
+		if (sscanf(line, "%*s %15s %*s %15s %d %x:%x:%lu",
+			   kind, access, &pid, &dev_major, &dev_minor, &ino) != 6)
+			continue;
+		if (strcmp(kind, "FLOCK") || pid != getpid() ||
+		    ino != st.st_ino || dev_major != major(st.st_dev) ||
+		    dev_minor != minor(st.st_dev))
+			continue;
+		if (!exclusive || !strcmp(access, "WRITE"))
+			held = 1;
+	}
+	free(buf);
+	return held;
+}
+
+static void dev_lock(void)
+{
+	if (pthread_mutex_lock(&dev->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&dev->lock);
+}
+
+static void dev_unlock(void)
+{
+	pthread_mutex_unlock(&dev->lock);
+}
+
+static void violation(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+/* Count a change not covered by the locks dahdi_cfg should hold */
+static void violation(const char *fmt, ...)
+{
+	va_list ap;
+
+	dev_lock();
+	if (!dev->violations++) {
+		va_start(ap, fmt);
+		vsnprintf(dev->violation, sizeof(dev->violation), fmt, ap);
+		va_end(ap);
+	}
+	dev_unlock();
+}
+
+/* Before a change to span @span or one of its channels */
+static void check_span(int span, const char *what)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "span-%d.lock", span);
+	if (!holds_lock(name, 1) && !holds_lock("dahdi_cfg.lock", 1))
+		violation("%s on span %d without its lock (pid %d)",
+			  what, span, getpid());
+	if (delay_us)
+		usleep(delay_us);
+}
+
+/* Before a change to the tone zones */
+static void check_zones(const char *what)
+{
+	if (!holds_lock("dahdi_cfg.state.lock", 1) &&
+	    !holds_lock("dahdi_cfg.lock", 1))
+		violation("%s without the state lock (pid %d)", what, getpid());
+	if (delay_us)
+		usleep(delay_us);
+}
+
+static int chan_span(int chan)
+{
+	return (chan - 1) / STRESS_SPAN_CHANS + 1;
+}
+
+static int valid_span(int span)
+{
+	return span >= 1 && span <= STRESS_SPANS;
+}
+
+static int valid_chan(int chan)
+{
+	return chan >= 1 && chan <= STRESS_CHANS;
+}
+
+static int spanstat(struct dahdi_spaninfo *si)
+{
+	struct stress_span *s;
+	int span = si->spanno;
+
+	if (!valid_span(span))
+		return EINVAL;
+	memset(si, 0, sizeof(*si));
+	si->spanno = span;
+	snprintf(si->name, sizeof(si->name), "STRESS/%d", span);
+	snprintf(si->desc, sizeof(si->desc), "Stress test span %d", span);
+	snprintf(si->location, sizeof(si->location), "stress-%d", span);
+	si->numchans = STRESS_SPAN_CHANS;
+	si->totalchans = STRESS_SPAN_CHANS;
+	si->totalspans = STRESS_SPANS;
+	dev_lock();
+	s = &dev->spans[span];
+	if (s->configured) {
+		si->lineconfig = s->lc.lineconfig;
+		si->lbo = s->lc.lbo;
+	}
+	dev_unlock();
+	return 0;
+}
+
+static int get_params(struct dahdi_params *p)
+{
+	struct stress_chan *c;
+	int return_master = p->channo & DAHDI_GET_PARAMS_RETURN_MASTER;
+	int chan = p->channo & ~DAHDI_GET_PARAMS_RETURN_MASTER;
+	int master = chan;
+
+	if (!valid_chan(chan))
+		return EINVAL;
+	memset(p, 0, sizeof(*p));
+	p->spanno = chan_span(chan);
+	p->chanpos = (chan - 1) % STRESS_SPAN_CHANS + 1;
+	p->curlaw = DAHDI_LAW_MULAW;
+	dev_lock();
+	c = &dev->chans[chan];
+	if (c->configured) {
+		p->sigtype = c->cc.sigtype;
+		if (c->cc.deflaw != DAHDI_LAW_DEFAULT)
+			p->curlaw = c->cc.deflaw;
+		p->idlebits = c->cc.idlebits;
+		if (c->cc.master)
+			master = c->cc.master;
+	}
+	dev_unlock();
+	p->channo = chan;
+	if (return_master)
+		p->channo |= master << 16;
+	return 0;
+}
+
+static int ctl_ioctl(unsigned long request, void *arg)
+{
+	struct dahdi_lineconfig *lc = arg;
+	struct dahdi_chanconfig *cc = arg;
+	struct dahdi_attach_echocan *ae = arg;
+	struct dahdi_tone_def_header *h = arg;
+	struct dahdi_versioninfo *vi = arg;
+	int *x = arg;
+
+	dev_lock();
+	dev->ioctls++;
+	dev_unlock();
+	switch (request) {
+	case DAHDI_GETVERSION:
+		memset(vi, 0, sizeof(*vi));
+		strcpy(vi->version, "stress");
+		strcpy(vi->echo_canceller, "none");
+		return 0;
+	case DAHDI_SPANSTAT:
+		return spanstat(arg);
+	case DAHDI_GET_PARAMS:
+		return get_params(arg);
+	case DAHDI_SPANCONFIG:
+		if (!valid_span(lc->span))
+			return EINVAL;
+		check_span(lc->span, "DAHDI_SPANCONFIG");
+		dev_lock();
+		dev->spans[lc->span].lc = *lc;
+		dev->spans[lc->span].configured = 1;
+		dev_unlock();
+		return 0;
+	case DAHDI_STARTUP:
+	case DAHDI_SHUTDOWN:
+		if (!valid_span(*x))
+			return EINVAL;
+		check_span(*x, DAHDI_STARTUP == request ?
+			   "DAHDI_STARTUP" : "DAHDI_SHUTDOWN");
+		dev_lock();
+		dev->spans[*x].running = DAHDI_STARTUP == request;
+		dev_unlock();
+		return 0;
+	case DAHDI_CHANCONFIG:
+		if (!valid_chan(cc->chan))
+			return EINVAL;
+		check_span(chan_span(cc->chan), "DAHDI_CHANCONFIG");
+		dev_lock();
+		dev->chans[cc->chan].cc = *cc;
+		dev->chans[cc->chan].configured = 1;
+		/* As the kernel does, configuring drops the echo canceller */
+		dev->chans[cc->chan].echocan[0] = '\0';
+		dev_unlock();
+		return 0;
+	case DAHDI_ATTACH_ECHOCAN:
+		if (!valid_chan(ae->chan))
+			return EINVAL;
+		check_span(chan_span(ae->chan), "DAHDI_ATTACH_ECHOCAN");
+		dev_lock();
+		memcpy(dev->chans[ae->chan].echocan, ae->echocan,
+		       sizeof(ae->echocan));
+		dev_unlock();
+		return 0;
+	case DAHDI_FREEZONE:
+		if (*x < 0 || *x >= DAHDI_TONE_ZONE_MAX)
+			return EINVAL;
+		check_zones("DAHDI_FREEZONE");
+		dev_lock();
+		dev->zones[*x] = 0;
+		dev_unlock();
+		return 0;
+	case DAHDI_LOADZONE:
+		if (h->zone < 0 || h->zone >= DAHDI_TONE_ZONE_MAX)
+			return EINVAL;
+		check_zones("DAHDI_LOADZONE");
+		dev_lock();
+		dev->zones[h->zone] = 1;
+		dev_unlock();
+		return 0;
+	case DAHDI_DEFAULTZONE:
+		if (*x < 0 || *x >= DAHDI_TONE_ZONE_MAX)
+			return EINVAL;
+		check_zones("DAHDI_DEFAULTZONE");
+		dev_lock();
+		if (!dev->zones[*x]) {
+			dev_unlock();
+			return EINVAL;
+		}
+		dev->defaultzone = *x;
+		dev_unlock();
+		return 0;
+	case DAHDI_DYNAMIC_DESTROY:
+		return 0;
+	default:
+		return ENOTTY;
+	}
+}
+
+static int chan_ioctl(int fd, unsigned long request, void *arg)
+{
+	int *x = arg;
+
+	switch (request) {
+	case DAHDI_SPECIFY:
+		if (!valid_chan(*x))
+			return ENXIO;
+		if (fd < MAX_FDS)
+			fd_chans[fd] = *x;
+		return 0;
+	case DAHDI_HDLC_RATE:
+		if (fd >= MAX_FDS || !fd_chans[fd])
+			return EINVAL;
+		check_span(chan_span(fd_chans[fd]), "DAHDI_HDLC_RATE");
+		return 0;
+	default:
+		return ENOTTY;
+	}
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+	int res;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+	resolve();
+	if (!test_dir || fd < 0 || fd >= MAX_FDS || FD_OTHER == fd_types[fd])
+		return real_ioctl(fd, request, arg);
+	if (FD_CTL == fd_types[fd])
+		res = ctl_ioctl(request, arg);
+	else
+		res = chan_ioctl(fd, request, arg);
+	if (res) {
+		errno = res;
+		return -1;
+	}
+	return 0;
+}
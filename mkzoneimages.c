@@ -0,0 +1,59 @@
+/*
+ * mkzoneimages: precompile the DAHDI_LOADZONE images of builtin_zones[].
+ *
+ * Writes C source for libtonezone to stdout: the image of every builtin
+ * zone, as tone_zone_build_image() computes it at runtime, so that the
+ * library only needs to copy it. Run at build time, on the build host.
+ *
+ * Copyright (C) 2026, the DAHDI tools contributors
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1 as published
+ * by the Free Software Foundation. See the LICENSE.LGPL file
+ * included with this program for more details.
+ */
+
+/* The runtime builder itself, without the images it is to produce */
+#define TONEZONE_NO_IMAGES
+#include "tonezone.c"
+
+#define WORDS_PER_LINE	6
+
+int main(int argc, char *argv[])
+{
+	static unsigned int buf[TONE_ZONE_IMAGE_MAX / sizeof(unsigned int)];
+	struct tone_zone *z;
+	int num = 0;
+	int len;
+	int x;
+
+	printf("/*\n"
+	       " * Generated by mkzoneimages from zonedata.c. Do not edit.\n"
+	       " */\n\n"
+	       "#include \"tonezone.h\"\n");
+	for (z = builtin_zones; z->zone > -1; z++, num++) {
+		len = build_image(z, buf, sizeof(buf));
+		if (len < 0 || len % sizeof(buf[0])) {
+			fprintf(stderr, "Unable to build zone '%s'\n", z->country);
+			return 1;
+		}
+		printf("\n/* %s: %s */\n", z->country, z->description);
+		printf("static const unsigned int image_%d[] = {", num);
+		for (x = 0; x < len / sizeof(buf[0]); x++) {
+			printf("%s0x%08x,", (x % WORDS_PER_LINE) ? " " : "\n\t",
+			       buf[x]);
+		}
+		printf("\n};\n");
+	}
+
+	printf("\nconst struct tone_zone_image builtin_zone_images[] = {\n");
+	for (x = 0; x < num; x++) {
+		z = &builtin_zones[x];
+		printf("\t{ 0x%016llxULL, sizeof(image_%d), image_%d },\n",
+		       tone_zone_hash(z), x, x);
+	}
+	printf("};\n\nconst int num_builtin_zone_images = %d;\n", num);
+	return 0;
+}
@@ -0,0 +1,915 @@
+/*
+ * libtonezone: detect the tones of a zone in audio.
+ *
+ * Runs Goertzel filters on the frequencies of the tones a zone image
+ * defines, the DTMF and MF tones included, and follows the cadence of
+ * the call progress tones.  Channels are filtered in groups of
+ * DETECT_LANES, one vector lane per channel.
+ *
+ * Copyright (C) 2026, the DAHDI tools contributors
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1 as published
+ * by the Free Software Foundation. See the LICENSE.LGPL file
+ * included with this program for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "dahdi/user.h"
+#include "tonezone.h"
+
+/* Channels filtered together. Uses the GCC vector extensions, which
+   the compiler maps to whatever SIMD the target has */
+#define DETECT_LANES	8
+
+/* Samples per block of the DTMF and MF filters.  Wide enough for their
+   frequency tolerance, short enough for two blocks in a 40 ms digit */
+#define DETECT_BLOCK	102
+
+/* Blocks per block of the call progress filters.  They need the finer
+   resolution: 440 Hz and 480 Hz are both in the US ring tone */
+#define PROGRESS_BLOCKS	2
+
+#define DETECT_HITS	2	/* Blocks a pair must be heard to start */
+#define DETECT_MISSES	2	/* Blocks a pair must be missed to stop */
+#define DETECT_RATIO	0.65f	/* Least share of the energy in a pair */
+#define DETECT_TWIST	6.3f	/* Most power between its frequencies, 8 dB */
+#define DETECT_MIN_LEVEL	-40	/* dBm0 of each frequency */
+
+/* Shortest silence the call progress filters hear */
+#define AUDIBLE_SILENCE	(DETECT_MISSES * PROGRESS_BLOCKS * DETECT_BLOCK)
+
+typedef float vfloat_t __attribute__ ((vector_size (DETECT_LANES * sizeof(float))));
+
+struct detect_freq {
+	int fac;		/* As in dahdi_tone_def */
+	float coeff;
+	int blocks;		/* 1 or PROGRESS_BLOCKS */
+};
+
+/* Frequencies heard together: one or two */
+struct detect_pair {
+	int f1;
+	int f2;			/* -1 for a single frequency */
+	int blocks;		/* Of its filters */
+	int progress;		/* Of a call progress tone */
+	int toneid;		/* DTMF or MF tone of the pair, -1 for progress */
+};
+
+/* A sound or silence in the cadence of a call progress tone */
+struct detect_segment {
+	int pair;		/* -1 for silence */
+	int samples;		/* 0 if it plays on */
+	int next;		/* Index in the tone, -1 if the tone ends */
+};
+
+struct detect_tone {
+	int toneid;
+	int firstseg;		/* In segs[] */
+	int numsegs;
+	int startseg;		/* First sound, index in the tone */
+	int max_off;		/* Longest silence within the cadence */
+};
+
+/* Call progress tones of a zone, at most */
+#define DETECT_MAX_TONES	32
+
+/* The pairs heard on a channel, one kind of filter */
+struct detect_track {
+	int cur;		/* Pair heard, -1 for none */
+	int cand;		/* Pair heard instead of cur lately */
+	int hits;
+	int misses;
+	unsigned long long cand_start;
+	unsigned long long start;	/* Of cur */
+	unsigned long long stop;	/* Of the pair that stopped */
+};
+
+struct detect_chan {
+	struct detect_track sig;	/* DTMF and MF */
+	struct detect_track prog;	/* Call progress */
+	int tone;		/* Call progress tone reported, -1 for none */
+	int off;		/* Silent within its cadence */
+	unsigned long long last_off;
+	/* While telling apart tones that start the same */
+	unsigned int cands;	/* Bit of each tone still matching */
+	short pos[DETECT_MAX_TONES];	/* Their segment to match next */
+	int steps;		/* Sounds and silences matched */
+	int heard;		/* Pair heard since, -1 for silence */
+	unsigned long long start;
+	unsigned long long since;
+};
+
+struct tone_zone_detector {
+	int nchans;
+	int numgroups;
+	int numfreqs;
+	int numpairs;
+	int numtones;
+	struct detect_freq *freqs;
+	struct detect_pair *pairs;
+	struct detect_tone *tones;
+	struct detect_segment *segs;
+	float min_level;
+	int pos;			/* Samples of the current block */
+	int block;			/* Blocks since the start */
+	unsigned long long now;		/* Samples since the start */
+	vfloat_t *state;		/* Of every group: s1, s2 of each freq,
+					   then the energy of each kind */
+	vfloat_t *levels;		/* Scratch, one per freq */
+	struct detect_chan *chans;
+	struct tone_zone_detect_event *events;
+	int numevents;
+	int maxevents;
+};
+
+/* Vectors of state per group */
+#define GROUP_STATE(d)	((d)->numfreqs * 2 + 2)
+
+static float ulaw_table[256];
+static float alaw_table[256];
+static pthread_once_t g711_once = PTHREAD_ONCE_INIT;
+
+static int decode_ulaw(unsigned char c)
+{
+	int val;
+
+	c = ~c;
+	val = (((c & 0x0f) << 3) + 0x84) << ((c & 0x70) >> 4);
+	return (c & 0x80) ? 0x84 - val : val - 0x84;
+}
+
+static int decode_alaw(unsigned char c)
+{
+	int seg, val;
+
+	c ^= 0x55;
+	val = (c & 0x0f) << 4;
+	seg = (c & 0x70) >> 4;
+	if (seg)
+		val = (val + 0x108) << (seg - 1);
+	else
+		val += 8;
+	return (c & 0x80) ? val : -val;
+}
+
+static void build_g711_tables(void)
+{
+	int x;
+
+	for (x = 0; x < 256; x++) {
+		ulaw_table[x] = decode_ulaw(x);
+		alaw_table[x] = decode_alaw(x);
+	}
+}
+
+static int add_freq(struct tone_zone_detector *d, int fac, int blocks)
+{
+	int x;
+
+	for (x = 0; x < d->numfreqs; x++) {
+		if (d->freqs[x].fac == fac && d->freqs[x].blocks == blocks)
+			return x;
+	}
+	d->freqs[x].fac = fac;
+	d->freqs[x].coeff = fac / 32768.0f;
+	d->freqs[x].blocks = blocks;
+	d->numfreqs++;
+	return x;
+}
+
+static double freq_hz(int fac)
+{
+	return acos(fac / 65536.0) * 8000 / (2 * M_PI);
+}
+
+/* Frequencies closer than this are heard as one by filters of blocks */
+static double close_hz(int blocks)
+{
+	return 0.75 * 8000 / (blocks * DETECT_BLOCK);
+}
+
+/* If filter f hears hz as its own frequency */
+static int hears(const struct tone_zone_detector *d, int f, double hz)
+{
+	return fabs(freq_hz(d->freqs[f].fac) - hz) < close_hz(d->freqs[f].blocks);
+}
+
+/**
+ * add_pair - The pair of what a definition plays, -1 for silence.
+ * @progress: if of a call progress tone
+ *
+ * Two frequencies of a call progress tone that are closer than its
+ * filters tell apart beat: they are heard at their centre, over blocks
+ * short enough to follow the beat.  Call progress sounds the filters
+ * cannot tell apart are the same pair; their cadence tells the tones
+ * apart.
+ */
+static int add_pair(struct tone_zone_detector *d,
+		    const struct dahdi_tone_def *td, int progress)
+{
+	int blocks = progress ? PROGRESS_BLOCKS : 1;
+	/* A modulated tone is heard at its carrier */
+	int has2 = !td->modulate && (td->init_v2_2 || td->init_v3_2);
+	int fac[2] = { td->fac1, td->fac2 };
+	double hz[2];
+	struct detect_pair *p;
+	int n = 0;
+	int x;
+
+	if (!td->init_v2_1 && !td->init_v3_1) {
+		if (!has2)
+			return -1;
+		fac[0] = td->fac2;
+	} else if (has2) {
+		n = 1;
+	}
+	/* Sorted by frequency, highest coefficient first */
+	if (n && fac[1] > fac[0]) {
+		x = fac[0];
+		fac[0] = fac[1];
+		fac[1] = x;
+	}
+	hz[0] = freq_hz(fac[0]);
+	hz[1] = freq_hz(fac[1]);
+	if (n && progress && hz[1] - hz[0] < close_hz(blocks)) {
+		fac[0] = 2.0 * cos(M_PI * (hz[0] + hz[1]) / 8000.0) * 32768.0;
+		hz[0] = freq_hz(fac[0]);
+		blocks = 1;
+		n = 0;
+	}
+
+	for (x = 0; x < d->numpairs; x++) {
+		p = &d->pairs[x];
+		if (p->progress != progress || (p->f2 >= 0) != n)
+			continue;
+		if (!progress) {
+			if (d->freqs[p->f1].fac == fac[0] &&
+			    (!n || d->freqs[p->f2].fac == fac[1]))
+				return x;
+			continue;
+		}
+		if (!hears(d, p->f1, hz[0]) || (n && !hears(d, p->f2, hz[1])))
+			continue;
+		/* A beat, or two frequencies, need the short filter */
+		if (!n && (blocks < p->blocks || d->freqs[p->f1].fac != fac[0])) {
+			hz[0] = (hz[0] + freq_hz(d->freqs[p->f1].fac)) / 2;
+			p->f1 = add_freq(d, 2.0 * cos(2.0 * M_PI * hz[0] / 8000.0) *
+					 32768.0, 1);
+			p->blocks = 1;
+		}
+		return x;
+	}
+	p = &d->pairs[x];
+	p->f1 = add_freq(d, fac[0], blocks);
+	p->f2 = n ? add_freq(d, fac[1], blocks) : -1;
+	p->blocks = blocks;
+	p->progress = progress;
+	p->toneid = -1;
+	d->numpairs++;
+	return x;
+}
+
+static int detect_kind(int toneid)
+{
+	if (toneid >= DAHDI_TONE_DTMF_BASE && toneid <= DAHDI_TONE_DTMF_MAX)
+		return TONE_ZONE_DETECT_DTMF;
+	if (toneid >= DAHDI_TONE_MFR1_BASE && toneid <= DAHDI_TONE_MFR1_MAX)
+		return TONE_ZONE_DETECT_MFR1;
+	if (toneid >= DAHDI_TONE_MFR2_FWD_BASE && toneid <= DAHDI_TONE_MFR2_FWD_MAX)
+		return TONE_ZONE_DETECT_MFR2_FWD;
+	if (toneid >= DAHDI_TONE_MFR2_REV_BASE && toneid <= DAHDI_TONE_MFR2_REV_MAX)
+		return TONE_ZONE_DETECT_MFR2_REV;
+	return TONE_ZONE_DETECT_PROGRESS;
+}
+
+/* If two tones have the same cadence of the same pairs */
+static int same_tone(const struct tone_zone_detector *d,
+		     const struct detect_tone *a, const struct detect_tone *b)
+{
+	const struct detect_segment *sa = &d->segs[a->firstseg];
+	const struct detect_segment *sb = &d->segs[b->firstseg];
+	int x;
+
+	if (a->numsegs != b->numsegs || a->startseg != b->startseg)
+		return 0;
+	for (x = 0; x < a->numsegs; x++) {
+		if (sa[x].pair != sb[x].pair || sa[x].samples != sb[x].samples ||
+		    sa[x].next != sb[x].next)
+			return 0;
+	}
+	return 1;
+}
+
+/* Add the call progress tone starting at definition first */
+static void add_tone(struct tone_zone_detector *d,
+		     const struct dahdi_tone_def *td, int count, int first,
+		     int *map)
+{
+	struct detect_tone *t = &d->tones[d->numtones];
+	struct detect_segment *s;
+	int x;
+
+	if (d->numtones == DETECT_MAX_TONES)
+		return;
+	t->toneid = td[first].tone;
+	t->firstseg = d->numtones ? d->tones[d->numtones - 1].firstseg +
+				    d->tones[d->numtones - 1].numsegs : 0;
+	t->numsegs = 0;
+	t->startseg = -1;
+	t->max_off = 0;
+	for (x = 0; x < count; x++)
+		map[x] = -1;
+	for (x = first; x >= 0 && x < count && map[x] < 0; x = td[x].next)
+		map[x] = t->numsegs++;
+	for (x = 0; x < count; x++) {
+		if (map[x] < 0)
+			continue;
+		s = &d->segs[t->firstseg + map[x]];
+		s->pair = add_pair(d, &td[x], 1);
+		s->samples = (td[x].next == x) ? 0 : td[x].samples;
+		s->next = (td[x].next >= 0 && td[x].next < count) ?
+			  map[td[x].next] : -1;
+		if (s->pair >= 0 && (t->startseg < 0 || map[x] < t->startseg))
+			t->startseg = map[x];
+		if (s->pair < 0 && s->samples > t->max_off)
+			t->max_off = s->samples;
+	}
+	if (t->startseg < 0)
+		return;
+	/* A tone that sounds like an earlier one all along is heard as it
+	   at once, rather than after going through its cadence twice */
+	for (x = 0; x < d->numtones; x++) {
+		if (same_tone(d, &d->tones[x], t))
+			return;
+	}
+	d->numtones++;
+}
+
+/**
+ * tone_zone_detector_new - Set up detection of the tones of a zone.
+ * @z: the zone
+ * @nchans: number of channels fed to each tone_zone_detect()
+ * @flags: TONE_ZONE_DETECT_* kinds of tones to detect
+ *
+ * Takes the frequencies and cadences from the zone image, so what is
+ * detected is what DAHDI plays for the zone.
+ */
+struct tone_zone_detector *tone_zone_detector_new(struct tone_zone *z,
+						  int nchans, int flags)
+{
+	struct tone_zone_detector *d;
+	struct dahdi_tone_def_header *h;
+	struct dahdi_tone_def *td;
+	char *buf;
+	int *map = NULL;
+	int len, count;
+	int x, y, pair;
+
+	if (nchans < 1 || !(flags & TONE_ZONE_DETECT_ALL)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!(buf = malloc(TONE_ZONE_IMAGE_MAX)))
+		return NULL;
+	len = tone_zone_build_image(z, buf, TONE_ZONE_IMAGE_MAX);
+	h = (struct dahdi_tone_def_header *)buf;
+	td = (struct dahdi_tone_def *)(buf + sizeof(*h));
+	if (len < 0 || h->count > (len - sizeof(*h)) / sizeof(*td)) {
+		free(buf);
+		errno = EINVAL;
+		return NULL;
+	}
+	count = h->count;
+	if (!(d = calloc(1, sizeof(*d))))
+		goto fail;
+	d->nchans = nchans;
+	d->numgroups = (nchans + DETECT_LANES - 1) / DETECT_LANES;
+	d->freqs = calloc(count * 2, sizeof(*d->freqs));
+	d->pairs = calloc(count, sizeof(*d->pairs));
+	d->tones = calloc(count, sizeof(*d->tones));
+	d->segs = calloc(count, sizeof(*d->segs));
+	d->chans = calloc(nchans, sizeof(*d->chans));
+	map = malloc(count * sizeof(*map));
+	if (!d->freqs || !d->pairs || !d->tones || !d->segs || !d->chans || !map)
+		goto fail;
+
+	for (x = 0; x < count; x++) {
+		/* The kernel starts a tone at its first definition */
+		for (y = 0; y < x && td[y].tone != td[x].tone; y++)
+			;
+		if (y < x || !(flags & detect_kind(td[x].tone)))
+			continue;
+		if (detect_kind(td[x].tone) == TONE_ZONE_DETECT_PROGRESS) {
+			add_tone(d, td, count, x, map);
+			continue;
+		}
+		pair = add_pair(d, &td[x], 0);
+		if (pair >= 0 && d->pairs[pair].toneid < 0)
+			d->pairs[pair].toneid = td[x].tone;
+	}
+	if (!d->numpairs) {
+		errno = ENOENT;
+		goto fail;
+	}
+
+	d->min_level = pow(10.0, (DETECT_MIN_LEVEL - 3.14) / 20.0) * 32768.0;
+	d->min_level = d->min_level * d->min_level / 2;
+	if (posix_memalign((void **)&d->state, sizeof(vfloat_t),
+			   (size_t)d->numgroups * GROUP_STATE(d) * sizeof(vfloat_t)) ||
+	    posix_memalign((void **)&d->levels, sizeof(vfloat_t),
+			   d->numfreqs * sizeof(vfloat_t))) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	memset(d->state, 0, (size_t)d->numgroups * GROUP_STATE(d) * sizeof(vfloat_t));
+	for (x = 0; x < nchans; x++)
+		tone_zone_detector_reset(d, x);
+	free(map);
+	free(buf);
+	return d;
+
+fail:
+	free(map);
+	free(buf);
+	tone_zone_detector_free(d);
+	return NULL;
+}
+
+void tone_zone_detector_free(struct tone_zone_detector *d)
+{
+	if (!d)
+		return;
+	free(d->freqs);
+	free(d->pairs);
+	free(d->tones);
+	free(d->segs);
+	free(d->chans);
+	free(d->state);
+	free(d->levels);
+	free(d->events);
+	free(d);
+}
+
+void tone_zone_detector_reset(struct tone_zone_detector *d, int chan)
+{
+	struct detect_chan *c;
+
+	if (chan < 0 || chan >= d->nchans)
+		return;
+	c = &d->chans[chan];
+	memset(c, 0, sizeof(*c));
+	c->sig.cur = c->sig.cand = -1;
+	c->prog.cur = c->prog.cand = -1;
+	c->tone = -1;
+}
+
+static void add_event(struct tone_zone_detector *d, int chan, int toneid,
+		      int on, unsigned long long sample)
+{
+	struct tone_zone_detect_event *ev;
+	int max;
+
+	if (d->numevents == d->maxevents) {
+		max = d->maxevents ? d->maxevents * 2 : 64;
+		if (!(ev = realloc(d->events, max * sizeof(*ev))))
+			return;
+		d->events = ev;
+		d->maxevents = max;
+	}
+	ev = &d->events[d->numevents++];
+	ev->chan = chan;
+	ev->toneid = toneid;
+	ev->on = on;
+	ev->sample = sample;
+}
+
+/* The pair with most of the power, -1 for none.  Pairs of both filter
+   lengths are weighed by their share of the power over their length */
+static int heard_pair(const struct tone_zone_detector *d, int progress,
+		      int lane, float block_energy, float progress_energy)
+{
+	const struct detect_pair *p;
+	float block_mean = block_energy / DETECT_BLOCK;
+	float progress_mean = progress_energy / (PROGRESS_BLOCKS * DETECT_BLOCK);
+	float l1, l2, mean, sum, best = 0;
+	int res = -1;
+	int x;
+
+	for (x = 0; x < d->numpairs; x++) {
+		p = &d->pairs[x];
+		if (p->progress != progress)
+			continue;
+		mean = (p->blocks == 1) ? block_mean : progress_mean;
+		if (mean < d->min_level)
+			continue;
+		l1 = d->levels[p->f1][lane];
+		if (l1 < d->min_level)
+			continue;
+		sum = l1;
+		if (p->f2 >= 0) {
+			l2 = d->levels[p->f2][lane];
+			if (l2 < d->min_level || l1 > l2 * DETECT_TWIST ||
+			    l2 > l1 * DETECT_TWIST)
+				continue;
+			sum += l2;
+		}
+		sum /= mean;
+		if (sum < DETECT_RATIO || sum <= best)
+			continue;
+		best = sum;
+		res = x;
+	}
+	return res;
+}
+
+/* Follow the pair heard in the block starting at when.  Reports the
+   pair that stopped at t->stop in *stopped and the one that started at
+   t->start in *started, -1 for none */
+static void track_pair(struct detect_track *t, int pair,
+		       unsigned long long when, int *stopped, int *started)
+{
+	*stopped = *started = -1;
+	if (pair == t->cur) {
+		t->misses = 0;
+		t->cand = -1;
+		t->hits = 0;
+		return;
+	}
+	if (pair != t->cand || !t->hits) {
+		t->cand = pair;
+		t->cand_start = when;
+		t->hits = 0;
+	}
+	t->hits++;
+	if (t->cur >= 0) {
+		if (!t->misses++)
+			t->stop = when;
+		if (t->misses < DETECT_MISSES)
+			return;
+		*stopped = t->cur;
+		t->cur = -1;
+		t->misses = 0;
+	}
+	if (t->cand >= 0 && t->hits >= DETECT_HITS) {
+		*started = t->cur = t->cand;
+		t->start = t->cand_start;
+		t->cand = -1;
+		t->hits = 0;
+	}
+}
+
+/* Slack on a duration of the cadence, for the block granularity */
+static int cadence_slack(int samples)
+{
+	return samples / 8 + 2 * PROGRESS_BLOCKS * DETECT_BLOCK;
+}
+
+static int tone_uses(const struct tone_zone_detector *d,
+		     const struct detect_tone *t, int pair)
+{
+	int x;
+
+	for (x = 0; x < t->numsegs; x++) {
+		if (d->segs[t->firstseg + x].pair == pair)
+			return 1;
+	}
+	return 0;
+}
+
+static int first_cand(unsigned int cands)
+{
+	return __builtin_ctz(cands);
+}
+
+/**
+ * match_segs - Match a sound (pair) or silence (-1) heard for len samples
+ * against a tone, from its segment pos.
+ * @ended: if it is no longer heard
+ * @next: set to the segment to match next, if ended
+ *
+ * Silences too short to be heard are skipped, so one sound may span
+ * several segments.  Returns 2 if the tone plays on with it, 1 if it
+ * matches (or still may, if not ended) and -1 if it does not.
+ */
+static int match_segs(const struct tone_zone_detector *d,
+		      const struct detect_tone *t, int pos, int pair,
+		      int len, int ended, int *next)
+{
+	const struct detect_segment *s = &d->segs[t->firstseg];
+	int total = 0;
+	int n, x;
+
+	if (pos >= 0 && pair >= 0 && s[pos].pair < 0 && s[pos].samples &&
+	    s[pos].samples < AUDIBLE_SILENCE)
+		pos = s[pos].next;
+	for (n = 0; pos >= 0 && n < t->numsegs; n++) {
+		if (s[pos].pair != pair)
+			return -1;
+		if (!s[pos].samples) {
+			*next = pos;
+			return 2;
+		}
+		total += s[pos].samples;
+		if (len <= total + cadence_slack(total)) {
+			if (!ended)
+				return 1;
+			if (len < total - cadence_slack(total))
+				return -1;
+			*next = s[pos].next;
+			return 1;
+		}
+		/* Heard for longer: on into the next segment, over a silence
+		   too short to hear if need be? */
+		x = s[pos].next;
+		if (x >= 0 && pair >= 0 && s[x].pair < 0 && s[x].samples &&
+		    s[x].samples < AUDIBLE_SILENCE) {
+			total += s[x].samples;
+			x = s[x].next;
+		}
+		if (x < 0 || s[x].pair != pair)
+			return -1;
+		pos = x;
+	}
+	if (pos < 0)
+		return -1;
+	/* Came round to where it started: the sound plays on */
+	*next = pos;
+	return 2;
+}
+
+static void progress_start(struct tone_zone_detector *d, int chan, int tone)
+{
+	struct detect_chan *c = &d->chans[chan];
+
+	c->tone = tone;
+	c->cands = 0;
+	c->off = (c->heard < 0);
+	c->last_off = c->since;
+	add_event(d, chan, d->tones[tone].toneid, 1, c->start);
+}
+
+static void progress_stop(struct tone_zone_detector *d, int chan,
+			  unsigned long long when)
+{
+	struct detect_chan *c = &d->chans[chan];
+
+	add_event(d, chan, d->tones[c->tone].toneid, 0, when);
+	c->tone = -1;
+}
+
+/**
+ * progress_match - Match what was heard against the candidates.
+ * @pair: the pair heard, -1 for silence
+ * @len: for how many samples
+ * @ended: if it is no longer heard
+ *
+ * Reports a tone when one candidate is left, when all of them play on
+ * with what is heard, or when every candidate went through its cadence
+ * twice and they still sound the same.  Then the first of them is
+ * reported.  With no candidate left, what was heard up to this decides.
+ */
+static void progress_match(struct tone_zone_detector *d, int chan, int pair,
+			   int len, int ended)
+{
+	struct detect_chan *c = &d->chans[chan];
+	unsigned int x, cands = 0;
+	int plays_on = !ended, maxsegs = 0;
+	int res, next;
+
+	for (x = 0; x < d->numtones; x++) {
+		if (!(c->cands & (1U << x)))
+			continue;
+		res = match_segs(d, &d->tones[x], c->pos[x], pair, len, ended,
+				 &next);
+		if (res < 0)
+			continue;
+		if (res < 2)
+			plays_on = 0;
+		if (ended)
+			c->pos[x] = next;
+		if (d->tones[x].numsegs > maxsegs)
+			maxsegs = d->tones[x].numsegs;
+		cands |= 1U << x;
+	}
+	if (ended)
+		c->steps++;
+	if (!cands) {
+		if (c->steps > 1)
+			progress_start(d, chan, first_cand(c->cands));
+		c->cands = 0;
+		return;
+	}
+	c->cands = cands;
+	if (!(cands & (cands - 1)) || plays_on || c->steps >= 2 * maxsegs)
+		progress_start(d, chan, first_cand(cands));
+}
+
+/* A sound of the pair starts */
+static void progress_on(struct tone_zone_detector *d, int chan, int pair,
+			unsigned long long when)
+{
+	struct detect_chan *c = &d->chans[chan];
+	int x;
+
+	if (c->cands && when > c->since)
+		progress_match(d, chan, -1, when - c->since, 1);
+	if (c->tone >= 0) {
+		if (c->off && tone_uses(d, &d->tones[c->tone], pair)) {
+			c->off = 0;
+			return;
+		}
+		progress_stop(d, chan, c->off ? c->last_off : when);
+	}
+	c->heard = pair;
+	c->since = when;
+	if (c->cands)
+		return;
+	for (x = 0; x < d->numtones; x++)
+		c->pos[x] = d->tones[x].startseg;
+	c->cands = (d->numtones < 32) ? (1U << d->numtones) - 1 : ~0U;
+	c->steps = 0;
+	c->start = when;
+	progress_match(d, chan, pair, 0, 0);
+}
+
+/* The sound of the pair stops */
+static void progress_off(struct tone_zone_detector *d, int chan, int pair,
+			 unsigned long long when)
+{
+	struct detect_chan *c = &d->chans[chan];
+
+	if (c->cands)
+		progress_match(d, chan, pair, when - c->since, 1);
+	c->heard = -1;
+	c->since = when;
+	if (c->tone >= 0 && !c->off) {
+		c->off = 1;
+		c->last_off = when;
+	}
+}
+
+/* After each progress block, up to when */
+static void progress_idle(struct tone_zone_detector *d, int chan,
+			  unsigned long long when)
+{
+	struct detect_chan *c = &d->chans[chan];
+	int max_off;
+
+	if (c->cands)
+		progress_match(d, chan, c->heard, when - c->since, 0);
+	if (c->tone >= 0 && c->off) {
+		max_off = d->tones[c->tone].max_off;
+		if (when - c->last_off > max_off + cadence_slack(max_off))
+			progress_stop(d, chan, c->last_off);
+	}
+}
+
+/* Run the filters of a group over n samples at offset in bufs */
+static void filter_group(struct tone_zone_detector *d, int group,
+			 void *bufs[], int offset, int n, int format)
+{
+	vfloat_t x[DETECT_BLOCK];
+	vfloat_t *st = d->state + (size_t)group * GROUP_STATE(d);
+	vfloat_t s0, s1, s2, e;
+	const short *lin;
+	const unsigned char *law;
+	const float *table;
+	float coeff;
+	int chan, l, f, i;
+
+	memset(x, 0, n * sizeof(x[0]));
+	table = (format == TONE_ZONE_ALAW) ? alaw_table : ulaw_table;
+	for (l = 0; l < DETECT_LANES; l++) {
+		chan = group * DETECT_LANES + l;
+		if (chan >= d->nchans || !bufs[chan])
+			continue;
+		if (format == TONE_ZONE_LINEAR) {
+			lin = (const short *)bufs[chan] + offset;
+			for (i = 0; i < n; i++)
+				x[i][l] = lin[i];
+		} else {
+			law = (const unsigned char *)bufs[chan] + offset;
+			for (i = 0; i < n; i++)
+				x[i][l] = table[law[i]];
+		}
+	}
+
+	e = st[d->numfreqs * 2];
+	for (i = 0; i < n; i++)
+		e += x[i] * x[i];
+	st[d->numfreqs * 2] = e;
+
+	for (f = 0; f < d->numfreqs; f++) {
+		coeff = d->freqs[f].coeff;
+		s1 = st[f * 2];
+		s2 = st[f * 2 + 1];
+		for (i = 0; i < n; i++) {
+			s0 = x[i] + coeff * s1 - s2;
+			s2 = s1;
+			s1 = s0;
+		}
+		st[f * 2] = s1;
+		st[f * 2 + 1] = s2;
+	}
+}
+
+/* At the end of a block: levels of the filters that ended, then what
+   each channel of the group heard */
+static void end_block(struct tone_zone_detector *d, int group)
+{
+	vfloat_t *st = d->state + (size_t)group * GROUP_STATE(d);
+	vfloat_t *energy = &st[d->numfreqs * 2];
+	vfloat_t s1, s2;
+	int progress = (d->block % PROGRESS_BLOCKS) == PROGRESS_BLOCKS - 1;
+	unsigned long long when;
+	struct detect_chan *c;
+	float coeff, scale;
+	int chan, l, f, pair;
+	int stopped, started;
+
+	for (f = 0; f < d->numfreqs; f++) {
+		if (d->freqs[f].blocks != 1 && !progress)
+			continue;
+		/* Power of the frequency, as the mean power of a sine */
+		scale = 2.0f / (d->freqs[f].blocks * DETECT_BLOCK) /
+			(d->freqs[f].blocks * DETECT_BLOCK);
+		coeff = d->freqs[f].coeff;
+		s1 = st[f * 2];
+		s2 = st[f * 2 + 1];
+		d->levels[f] = (s1 * s1 + s2 * s2 - coeff * s1 * s2) * scale;
+		st[f * 2] = st[f * 2 + 1] = (vfloat_t) {};
+	}
+	/* The block energy also goes to the progress block energy */
+	energy[1] += energy[0];
+
+	for (l = 0; l < DETECT_LANES; l++) {
+		chan = group * DETECT_LANES + l;
+		if (chan >= d->nchans)
+			break;
+		c = &d->chans[chan];
+
+		when = d->now - DETECT_BLOCK;
+		pair = heard_pair(d, 0, l, energy[0][l], 0);
+		track_pair(&c->sig, pair, when, &stopped, &started);
+		if (stopped >= 0)
+			add_event(d, chan, d->pairs[stopped].toneid, 0, c->sig.stop);
+		if (started >= 0)
+			add_event(d, chan, d->pairs[started].toneid, 1, c->sig.start);
+
+		if (!progress || !d->numtones)
+			continue;
+		when = d->now - PROGRESS_BLOCKS * DETECT_BLOCK;
+		pair = heard_pair(d, 1, l, energy[0][l], energy[1][l]);
+		track_pair(&c->prog, pair, when, &stopped, &started);
+		if (stopped >= 0)
+			progress_off(d, chan, stopped, c->prog.stop);
+		if (started >= 0)
+			progress_on(d, chan, started, c->prog.start);
+		progress_idle(d, chan, when);
+	}
+	energy[0] = (vfloat_t) {};
+	if (progress)
+		energy[1] = (vfloat_t) {};
+}
+
+int tone_zone_detect(struct tone_zone_detector *d, void *bufs[], int samples,
+		     int format, const struct tone_zone_detect_event **events)
+{
+	int done, n, g;
+
+	if (format != TONE_ZONE_LINEAR && format != TONE_ZONE_ULAW &&
+	    format != TONE_ZONE_ALAW) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_once(&g711_once, build_g711_tables);
+
+	d->numevents = 0;
+	for (done = 0; done < samples; done += n) {
+		/* Up to the end of the block */
+		n = samples - done;
+		if (n > DETECT_BLOCK - d->pos)
+			n = DETECT_BLOCK - d->pos;
+		for (g = 0; g < d->numgroups; g++)
+			filter_group(d, g, bufs, done, n, format);
+		d->pos += n;
+		d->now += n;
+		if (d->pos < DETECT_BLOCK)
+			continue;
+		for (g = 0; g < d->numgroups; g++)
+			end_block(d, g);
+		d->pos = 0;
+		d->block++;
+	}
+	*events = d->events;
+	return d->numevents;
+}
@@ -0,0 +1,392 @@
+/*
+ * libtonezone: render the tones of a zone into audio.
+ *
+ * Generates the samples the DAHDI kernel plays for a loaded zone: the
+ * same oscillators, run from the same coefficients, through the same
+ * cadence. Channels are rendered in groups of RENDER_LANES, one vector
+ * lane per channel.
+ *
+ * Copyright (C) 2026, the DAHDI tools contributors
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1 as published
+ * by the Free Software Foundation. See the LICENSE.LGPL file
+ * included with this program for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "dahdi/user.h"
+#include "tonezone.h"
+
+/* Channels rendered together. Uses the GCC vector extensions, which
+   the compiler maps to whatever SIMD the target has */
+#define RENDER_LANES	8
+#define RENDER_BLOCK	160	/* Samples per pass over a group */
+
+typedef int lanes_t __attribute__ ((vector_size (RENDER_LANES * sizeof(int))));
+
+/* One dahdi_tone_def of the tone, with next as an index into segs[] */
+struct tone_segment {
+	int fac1;
+	int init_v2_1;
+	int init_v3_1;
+	int fac2;
+	int init_v2_2;
+	int init_v3_2;
+	int modulate;
+	int samples;
+	int next;		/* -1 when the tone ends after this segment */
+};
+
+struct tone_zone_tone {
+	int toneid;
+	int numsegs;
+	struct tone_segment segs[];
+};
+
+/**
+ * tone_zone_tone_new - Compile a tone of a zone for rendering.
+ * @z: the zone
+ * @toneid: a DAHDI_TONE_* id, including the DTMF and MF ones
+ *
+ * Takes the segments of the tone from the zone image, in the order the
+ * kernel plays them. DTMF and MF tones have no cadence of their own in
+ * the image; they are rendered as a continuous tone.
+ */
+struct tone_zone_tone *tone_zone_tone_new(struct tone_zone *z, int toneid)
+{
+	struct dahdi_tone_def_header *h;
+	struct dahdi_tone_def *td;
+	struct tone_zone_tone *t = NULL;
+	short map[TONE_ZONE_IMAGE_MAX / sizeof(*td)];
+	char *buf;
+	int len;
+	int first = -1;
+	int x, n;
+
+	if (!(buf = malloc(TONE_ZONE_IMAGE_MAX)))
+		return NULL;
+	len = tone_zone_build_image(z, buf, TONE_ZONE_IMAGE_MAX);
+	if (len < 0) {
+		errno = EINVAL;
+		goto out;
+	}
+	h = (struct dahdi_tone_def_header *)buf;
+	td = (struct dahdi_tone_def *)(buf + sizeof(*h));
+	if (h->count > (len - sizeof(*h)) / sizeof(*td)) {
+		errno = EINVAL;
+		goto out;
+	}
+	/* The kernel starts a tone at its first definition */
+	for (x = 0; x < h->count; x++) {
+		if (td[x].tone == toneid) {
+			first = x;
+			break;
+		}
+	}
+	if (first < 0) {
+		errno = ENOENT;
+		goto out;
+	}
+
+	/* Number the segments reachable from the first one */
+	for (x = 0; x < h->count; x++)
+		map[x] = -1;
+	n = 0;
+	for (x = first; x >= 0 && x < h->count && map[x] < 0; x = td[x].next) {
+		map[x] = n++;
+		if (td[x].samples <= 0)
+			break;	/* DTMF/MF: no cadence */
+	}
+	if (!(t = malloc(sizeof(*t) + n * sizeof(t->segs[0]))))
+		goto out;
+	t->toneid = toneid;
+	t->numsegs = n;
+	for (x = 0; x < h->count; x++) {
+		struct tone_segment *s;
+
+		if (map[x] < 0)
+			continue;
+		s = &t->segs[map[x]];
+		s->fac1 = td[x].fac1;
+		s->init_v2_1 = td[x].init_v2_1;
+		s->init_v3_1 = td[x].init_v3_1;
+		s->fac2 = td[x].fac2;
+		s->init_v2_2 = td[x].init_v2_2;
+		s->init_v3_2 = td[x].init_v3_2;
+		s->modulate = td[x].modulate;
+		if (td[x].samples <= 0) {
+			s->samples = 8000;
+			s->next = map[x];
+		} else {
+			s->samples = td[x].samples;
+			if (td[x].next >= 0 && td[x].next < h->count)
+				s->next = map[td[x].next];
+			else
+				s->next = -1;
+		}
+	}
+out:
+	free(buf);
+	return t;
+}
+
+void tone_zone_tone_free(struct tone_zone_tone *t)
+{
+	free(t);
+}
+
+static void start_segment(struct tone_zone_render_state *st, int seg)
+{
+	const struct tone_segment *s = &st->tone->segs[seg];
+
+	st->seg = seg;
+	st->pos = 0;
+	st->v1_1 = 0;
+	st->v2_1 = s->init_v2_1;
+	st->v3_1 = s->init_v3_1;
+	st->v1_2 = 0;
+	st->v2_2 = s->init_v2_2;
+	st->v3_2 = s->init_v3_2;
+}
+
+void tone_zone_render_start(struct tone_zone_render_state *st,
+			    const struct tone_zone_tone *t)
+{
+	memset(st, 0, sizeof(*st));
+	st->tone = t;
+	st->seg = -1;
+	if (t && t->numsegs)
+		start_segment(st, 0);
+}
+
+/* Move on at the end of a segment, the way the kernel does: a segment
+   that loops on itself keeps its oscillators running */
+static void next_segment(struct tone_zone_render_state *st)
+{
+	const struct tone_segment *s = &st->tone->segs[st->seg];
+
+	if (s->next == st->seg)
+		st->pos = 0;
+	else if (s->next < 0)
+		st->seg = -1;
+	else
+		start_segment(st, s->next);
+}
+
+/* G.711 encoding, by table on the bits the encoders look at */
+#define ULAW_BIAS	0x21
+#define ULAW_CLIP	8159
+
+static unsigned char ulaw_table[1 << 14];
+static unsigned char alaw_table[1 << 13];
+static pthread_once_t g711_once = PTHREAD_ONCE_INIT;
+
+static int segment_of(int val, int first_end)
+{
+	int seg;
+
+	for (seg = 0; seg < 8; seg++) {
+		if (val <= (first_end << seg) + ((1 << seg) - 1))
+			return seg;
+	}
+	return 8;
+}
+
+/* From the 14 most significant bits of a linear sample */
+static unsigned char encode_ulaw(int val)
+{
+	int mask = 0xff;
+	int seg;
+
+	if (val < 0) {
+		val = -val;
+		mask = 0x7f;
+	}
+	if (val > ULAW_CLIP)
+		val = ULAW_CLIP;
+	val += ULAW_BIAS;
+	seg = segment_of(val, 0x3f);
+	if (seg >= 8)
+		return 0x7f ^ mask;
+	return ((seg << 4) | ((val >> (seg + 1)) & 0xf)) ^ mask;
+}
+
+/* From the 13 most significant bits of a linear sample */
+static unsigned char encode_alaw(int val)
+{
+	int mask = 0xd5;
+	int seg;
+
+	if (val < 0) {
+		mask = 0x55;
+		val = -val - 1;
+	}
+	seg = segment_of(val, 0x1f);
+	if (seg >= 8)
+		return 0x7f ^ mask;
+	if (seg < 2)
+		return ((seg << 4) | ((val >> 1) & 0xf)) ^ mask;
+	return ((seg << 4) | ((val >> seg) & 0xf)) ^ mask;
+}
+
+static void build_g711_tables(void)
+{
+	int x;
+
+	for (x = 0; x < (1 << 14); x++)
+		ulaw_table[x] = encode_ulaw((short)(x << 2) >> 2);
+	for (x = 0; x < (1 << 13); x++)
+		alaw_table[x] = encode_alaw((short)(x << 3) >> 3);
+}
+
+static void store(void *buf, int format, const lanes_t *out, int lane, int n)
+{
+	short *lin = buf;
+	unsigned char *law = buf;
+	short s;
+	int x;
+
+	switch (format) {
+	case TONE_ZONE_ULAW:
+		for (x = 0; x < n; x++) {
+			s = out[x][lane];
+			law[x] = ulaw_table[(unsigned short)s >> 2];
+		}
+		break;
+	case TONE_ZONE_ALAW:
+		for (x = 0; x < n; x++) {
+			s = out[x][lane];
+			law[x] = alaw_table[(unsigned short)s >> 3];
+		}
+		break;
+	default:
+		for (x = 0; x < n; x++)
+			lin[x] = out[x][lane];
+		break;
+	}
+}
+
+/* Render n samples of up to RENDER_LANES channels that all stay within
+   their current segment */
+static void render_lanes(struct tone_zone_render_state *st[], int lanes,
+			 lanes_t *out, int n)
+{
+	lanes_t fac1, fac2, mod;
+	lanes_t v1_1, v2_1, v3_1;
+	lanes_t v1_2, v2_2, v3_2;
+	lanes_t p, sign;
+	const struct tone_segment *s;
+	int anymod = 0;
+	int l, x;
+
+	for (l = 0; l < RENDER_LANES; l++) {
+		/* Unused lanes and ended tones are silence */
+		if (l >= lanes || st[l]->seg < 0) {
+			fac1[l] = fac2[l] = mod[l] = 0;
+			v1_1[l] = v2_1[l] = v3_1[l] = 0;
+			v1_2[l] = v2_2[l] = v3_2[l] = 0;
+			continue;
+		}
+		s = &st[l]->tone->segs[st[l]->seg];
+		fac1[l] = s->fac1;
+		fac2[l] = s->fac2;
+		mod[l] = s->modulate ? -1 : 0;
+		anymod |= s->modulate;
+		v1_1[l] = st[l]->v1_1;
+		v2_1[l] = st[l]->v2_1;
+		v3_1[l] = st[l]->v3_1;
+		v1_2[l] = st[l]->v1_2;
+		v2_2[l] = st[l]->v2_2;
+		v3_2[l] = st[l]->v3_2;
+	}
+
+	for (x = 0; x < n; x++) {
+		v1_1 = v2_1;
+		v2_1 = v3_1;
+		v3_1 = ((fac1 * v2_1) >> 15) - v1_1;
+
+		v1_2 = v2_2;
+		v2_2 = v3_2;
+		v3_2 = ((fac2 * v2_2) >> 15) - v1_2;
+
+		if (!anymod) {
+			out[x] = v3_1 + v3_2;
+			continue;
+		}
+		/* Amplitude modulation: v3_1 scaled by |v3_2 - 32768| */
+		p = v3_2 - 32768;
+		sign = p >> 31;
+		p = (p ^ sign) - sign;
+		p = ((p * 9) / 10) + 1;
+		out[x] = (mod & ((v3_1 * p) >> 15)) | (~mod & (v3_1 + v3_2));
+	}
+
+	for (l = 0; l < lanes; l++) {
+		if (st[l]->seg < 0)
+			continue;
+		st[l]->v1_1 = v1_1[l];
+		st[l]->v2_1 = v2_1[l];
+		st[l]->v3_1 = v3_1[l];
+		st[l]->v1_2 = v1_2[l];
+		st[l]->v2_2 = v2_2[l];
+		st[l]->v3_2 = v3_2[l];
+		st[l]->pos += n;
+	}
+}
+
+int tone_zone_render(struct tone_zone_render_state *st, int nchans,
+		     void *bufs[], int samples, int format)
+{
+	lanes_t out[RENDER_BLOCK];
+	struct tone_zone_render_state *group[RENDER_LANES];
+	const struct tone_segment *s;
+	int size = (format == TONE_ZONE_LINEAR) ? 2 : 1;
+	int base, lanes, done, n, l;
+
+	if (format != TONE_ZONE_LINEAR && format != TONE_ZONE_ULAW &&
+	    format != TONE_ZONE_ALAW) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_once(&g711_once, build_g711_tables);
+
+	for (base = 0; base < nchans; base += RENDER_LANES) {
+		lanes = nchans - base;
+		if (lanes > RENDER_LANES)
+			lanes = RENDER_LANES;
+		for (l = 0; l < lanes; l++)
+			group[l] = &st[base + l];
+		for (done = 0; done < samples; done += n) {
+			/* Up to the first end of a segment in the group */
+			n = samples - done;
+			if (n > RENDER_BLOCK)
+				n = RENDER_BLOCK;
+			for (l = 0; l < lanes; l++) {
+				if (group[l]->seg < 0)
+					continue;
+				s = &group[l]->tone->segs[group[l]->seg];
+				if (s->samples - group[l]->pos < n)
+					n = s->samples - group[l]->pos;
+			}
+			render_lanes(group, lanes, out, n);
+			for (l = 0; l < lanes; l++) {
+				store((char *)bufs[base + l] + done * size,
+				      format, out, l, n);
+				if (group[l]->seg < 0)
+					continue;
+				s = &group[l]->tone->segs[group[l]->seg];
+				if (group[l]->pos >= s->samples)
+					next_segment(group[l]);
+			}
+		}
+	}
+	return 0;
+}
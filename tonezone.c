@@ -35,6 +35,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <pthread.h>
 
 #include "dahdi/user.h"
 #include "tonezone.h"
@@ -42,7 +45,6 @@
 
 #define DEFAULT_DAHDI_DEV "/dev/dahdi/ctl"
 
-#define MAX_SIZE 16384
 #define CLIP 32635
 #define BIAS 0x84
 
@@ -56,14 +58,64 @@
 #define ENODATA EINVAL
 #endif
 
+/* builtin_zones[] is indexed on the first lookup. A slot holds the
+   position of its zone in builtin_zones[] plus one, 0 is an empty slot */
+#define ZONE_INDEX_SIZE	256	/* Power of 2, at least twice the zones indexed */
+
+static unsigned short zone_by_country[ZONE_INDEX_SIZE];
+static unsigned short zone_by_num[DAHDI_TONE_ZONE_MAX];
+static int zones_indexed;
+static pthread_once_t zone_index_once = PTHREAD_ONCE_INIT;
+
+static unsigned int country_hash(const char *country)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *country; country++) {
+		hash ^= tolower((unsigned char)*country);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void build_zone_index(void)
+{
+	struct tone_zone *z;
+	unsigned int slot;
+	int x;
+
+	/* Zones past half the table are left to a linear scan */
+	for (x = 0; builtin_zones[x].zone > -1 && x < ZONE_INDEX_SIZE / 2; x++) {
+		z = &builtin_zones[x];
+		/* The first of duplicate entries wins, as with a scan */
+		if (z->zone >= 0 && z->zone < DAHDI_TONE_ZONE_MAX && !zone_by_num[z->zone])
+			zone_by_num[z->zone] = x + 1;
+		slot = country_hash(z->country) & (ZONE_INDEX_SIZE - 1);
+		while (zone_by_country[slot] &&
+		       strcasecmp(builtin_zones[zone_by_country[slot] - 1].country, z->country))
+			slot = (slot + 1) & (ZONE_INDEX_SIZE - 1);
+		if (!zone_by_country[slot])
+			zone_by_country[slot] = x + 1;
+	}
+	zones_indexed = x;
+}
+
 struct tone_zone *tone_zone_find(char *country)
 {
 	struct tone_zone *z;
-	z = builtin_zones;
-	while(z->zone > -1) {
+	unsigned int slot;
+
+	pthread_once(&zone_index_once, build_zone_index);
+	slot = country_hash(country) & (ZONE_INDEX_SIZE - 1);
+	while (zone_by_country[slot]) {
+		z = &builtin_zones[zone_by_country[slot] - 1];
+		if (!strcasecmp(country, z->country))
+			return z;
+		slot = (slot + 1) & (ZONE_INDEX_SIZE - 1);
+	}
+	for (z = &builtin_zones[zones_indexed]; z->zone > -1; z++) {
 		if (!strcasecmp(country, z->country))
 			return z;
-		z++;
 	}
 	return NULL;
 }
@@ -71,11 +123,18 @@ struct tone_zone *tone_zone_find(char *country)
 struct tone_zone *tone_zone_find_by_num(int id)
 {
 	struct tone_zone *z;
-	z = builtin_zones;
-	while(z->zone > -1) {
+
+	pthread_once(&zone_index_once, build_zone_index);
+	if (id >= 0 && id < DAHDI_TONE_ZONE_MAX) {
+		if (zone_by_num[id])
+			return &builtin_zones[zone_by_num[id] - 1];
+		z = &builtin_zones[zones_indexed];
+	} else {
+		z = builtin_zones;
+	}
+	for (; z->zone > -1; z++) {
 		if (z->zone == id)
 			return z;
-		z++;
 	}
 	return NULL;
 }
@@ -84,17 +143,20 @@ struct tone_zone *tone_zone_find_by_num(int id)
 
 static int build_tone(void *data, size_t size, struct tone_zone_sound *t, int *count)
 {
-	char *dup, *s;
+	char *dup, *s, *save;
 	struct dahdi_tone_def *td=NULL;
 	int firstnobang = -1;
 	int freq1, freq2, time;
-	int modulate = 0;
-	float db = 1.0;
+	int modulate;
+	float db;
 	float gain;
 	int used = 0;
 	dup = strdup(t->data);
-	s = strtok(dup, ",");
+	s = strtok_r(dup, ",", &save);
 	while(s && strlen(s)) {
+		modulate = 0;
+		db = 1.0;
+
 		/* Handle optional ! which signifies don't start here*/
 		if (s[0] == '!') {
 			s++;
@@ -136,6 +198,7 @@ static int build_tone(void *data, size_t size, struct tone_zone_sound *t, int *c
 			time = 0;
 		} else {
 			fprintf(stderr, "tone component '%s' of '%s' is a syntax error\n", s,t->data);
+			free(dup);
 			return -1;
 		}
 
@@ -143,6 +206,7 @@ static int build_tone(void *data, size_t size, struct tone_zone_sound *t, int *c
 
 		if (size < sizeof(*td)) {
 			fprintf(stderr, "Not enough space for tones\n");
+			free(dup);
 			return -1;
 		}
 		td = data;
@@ -174,7 +238,7 @@ static int build_tone(void *data, size_t size, struct tone_zone_sound *t, int *c
 			td->samples = 8000;
 		}
 		*count += 1;
-		s = strtok(NULL, ",");
+		s = strtok_r(NULL, ",", &save);
 	}
 	if (td && time) {
 		/* If we don't end on a solid tone, return */
@@ -183,12 +247,12 @@ static int build_tone(void *data, size_t size, struct tone_zone_sound *t, int *c
 	if (firstnobang < 0)
 		fprintf(stderr, "tone '%s' does not end with a solid tone or silence (all tone components have an exclamation mark)\n", t->data);
 
+	free(dup);
 	return used;
 }
 
-char *tone_zone_tone_name(int id)
+static const char *known_tone_name(int id)
 {
-	static char tmp[80];
 	switch(id) {
 	case DAHDI_TONE_DIALTONE:
 		return "Dialtone";
@@ -213,11 +277,32 @@ char *tone_zone_tone_name(int id)
 	case DAHDI_TONE_STUTTER:
 		return "Stutter Dialtone";
 	default:
-		snprintf(tmp, sizeof(tmp), "Unknown tone %d", id);
-		return tmp;
+		return NULL;
 	}
 }
 
+char *tone_zone_tone_name_r(int id, char *buf, size_t len)
+{
+	const char *name = known_tone_name(id);
+
+	if (name)
+		dahdi_copy_string(buf, name, len);
+	else
+		snprintf(buf, len, "Unknown tone %d", id);
+	return buf;
+}
+
+char *tone_zone_tone_name(int id)
+{
+	/* Per thread, for the names of unknown tones */
+	static __thread char tmp[80];
+	const char *name = known_tone_name(id);
+
+	if (name)
+		return (char *)name;
+	return tone_zone_tone_name_r(id, tmp, sizeof(tmp));
+}
+
 #ifdef TONEZONE_DRIVER
 static void dump_tone_zone(void *data, int size)
 {
@@ -360,18 +445,72 @@ static int build_mf_tones(void *data, size_t size, int *count, struct mf_tone *t
 	return used;
 }
 
-int tone_zone_register_zone(int fd, struct tone_zone *z)
+static unsigned long long hash_bytes(unsigned long long hash,
+				     const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static unsigned long long hash_int(unsigned long long hash, int val)
+{
+	return hash_bytes(hash, &val, sizeof(val));
+}
+
+/* Up to and with its NUL, whatever follows it in the field */
+static unsigned long long hash_string(unsigned long long hash,
+				      const char *s, size_t size)
+{
+	size_t len = strnlen(s, size);
+
+	return hash_bytes(hash_bytes(hash, s, len), "", 1);
+}
+
+/*
+ * fnv1a64 of a zone definition, to tell if its precompiled image is
+ * current. It is taken field by field, as the padding of the structure
+ * is not part of the definition.
+ */
+static unsigned long long tone_zone_hash(const struct tone_zone *z)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	int x;
+
+	hash = hash_int(hash, z->zone);
+	hash = hash_string(hash, z->country, sizeof(z->country));
+	hash = hash_string(hash, z->description, sizeof(z->description));
+	for (x = 0; x < DAHDI_MAX_CADENCE; x++)
+		hash = hash_int(hash, z->ringcadence[x]);
+	for (x = 0; x < DAHDI_TONE_MAX; x++) {
+		hash = hash_int(hash, z->tones[x].toneid);
+		hash = hash_string(hash, z->tones[x].data,
+				   sizeof(z->tones[x].data));
+	}
+	hash = hash_int(hash, z->dtmf_high_level);
+	hash = hash_int(hash, z->dtmf_low_level);
+	hash = hash_int(hash, z->mfr1_level);
+	hash = hash_int(hash, z->mfr2_level);
+	return hash;
+}
+
+/* Compute the image of a zone, with all the parsing and floating point */
+static int build_image(struct tone_zone *z, void *buf, size_t size)
 {
-	char buf[MAX_SIZE];
 	int res;
 	int count = 0;
 	int x;
-	size_t space = MAX_SIZE;
+	size_t space = size;
 	void *ptr = buf;
-	int iopenedit = 1;
 	struct dahdi_tone_def_header *h;
 
-	memset(buf, 0, sizeof(buf));
+	if (size < sizeof(*h))
+		return -1;
+	memset(buf, 0, size);
 
 	h = ptr;
 	ptr += sizeof(*h);
@@ -427,15 +566,141 @@ int tone_zone_register_zone(int fd, struct tone_zone *z)
 
 	h->count = count;
 
-	if (fd < 0) {
-		if ((fd = open(DEFAULT_DAHDI_DEV, O_RDWR)) < 0) {
-			fprintf(stderr, "Unable to open %s and fd not provided\n", DEFAULT_DAHDI_DEV);
-			return -1;
-		}
-		iopenedit = 1;
+	return size - space;
+}
+
+#ifndef TONEZONE_NO_IMAGES
+static const struct tone_zone_image *builtin_image(const struct tone_zone *z,
+						   unsigned long long hash)
+{
+	const struct tone_zone_image *img;
+	uintptr_t first = (uintptr_t)builtin_zones;
+	uintptr_t x;
+
+	if ((uintptr_t)z < first)
+		return NULL;
+	x = ((uintptr_t)z - first) / sizeof(*z);
+	if (x >= num_builtin_zone_images || &builtin_zones[x] != z)
+		return NULL;
+	img = &builtin_zone_images[x];
+	if (img->zone_hash != hash)
+		return NULL;	/* builtin_zones[] was changed at runtime */
+	return img;
+}
+#endif
+
+/* Images built at runtime are kept for the life of the process, keyed
+   by the hash of the zone definition they were built from */
+#define ZONE_CACHE_BUCKETS	64
+#define ZONE_CACHE_MAX		128
+
+struct zone_cache_entry {
+	struct zone_cache_entry *next;
+	unsigned long long zone_hash;
+	size_t len;
+	char data[];
+};
+
+static struct zone_cache_entry *zone_cache[ZONE_CACHE_BUCKETS];
+static int zone_cache_count;
+static pthread_mutex_t zone_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct zone_cache_entry *zone_cache_find(unsigned long long hash)
+{
+	struct zone_cache_entry *e;
+
+	for (e = zone_cache[hash % ZONE_CACHE_BUCKETS]; e; e = e->next) {
+		if (e->zone_hash == hash)
+			return e;
 	}
+	return NULL;
+}
 
-	x = z->zone;
+/**
+ * zone_image - Find the image of a zone, building it at most once.
+ * @z: the zone
+ * @image: set to the image, which stays valid for the life of the process
+ *
+ * Returns the length of the image, -1 if it fails to build, or 0 if it
+ * is neither precompiled nor cached and the cache is full.
+ */
+static int zone_image(struct tone_zone *z, const void **image)
+{
+	unsigned long long hash = tone_zone_hash(z);
+	struct zone_cache_entry *e, *old;
+	int len;
+#ifndef TONEZONE_NO_IMAGES
+	const struct tone_zone_image *img = builtin_image(z, hash);
+
+	if (img) {
+		*image = img->data;
+		return img->len;
+	}
+#endif
+
+	pthread_mutex_lock(&zone_cache_lock);
+	e = zone_cache_find(hash);
+	len = e ? e->len : 0;
+	if (!e && zone_cache_count >= ZONE_CACHE_MAX) {
+		pthread_mutex_unlock(&zone_cache_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&zone_cache_lock);
+	if (e) {
+		*image = e->data;
+		return len;
+	}
+
+	/* Built outside of the lock: this is the slow part */
+	if (!(e = malloc(sizeof(*e) + TONE_ZONE_IMAGE_MAX)))
+		return 0;
+	if ((len = build_image(z, e->data, TONE_ZONE_IMAGE_MAX)) < 0) {
+		free(e);
+		return -1;
+	}
+	if ((old = realloc(e, sizeof(*e) + len)))
+		e = old;
+	e->zone_hash = hash;
+	e->len = len;
+
+	pthread_mutex_lock(&zone_cache_lock);
+	if ((old = zone_cache_find(hash))) {
+		/* Another thread got there first */
+		free(e);
+		e = old;
+	} else {
+		e->next = zone_cache[hash % ZONE_CACHE_BUCKETS];
+		zone_cache[hash % ZONE_CACHE_BUCKETS] = e;
+		zone_cache_count++;
+	}
+	pthread_mutex_unlock(&zone_cache_lock);
+	*image = e->data;
+	return e->len;
+}
+
+int tone_zone_build_image(struct tone_zone *z, void *buf, size_t size)
+{
+	const void *image;
+	int len;
+
+	len = zone_image(z, &image);
+	if (!len)
+		return build_image(z, buf, size);
+	if (len < 0 || size < len)
+		return -1;
+	memcpy(buf, image, len);
+	memset((char *)buf + len, 0, size - len);
+	return len;
+}
+
+/* Load an image on an open control device */
+static int load_image(int fd, void *image, size_t len)
+{
+	struct dahdi_tone_def_header *h = image;
+	int res;
+	int x;
+
+	x = h->zone;
 	if ((res = ioctl(fd, DAHDI_FREEZONE, &x))) {
 		if (errno != EBUSY)
 			fprintf(stderr, "ioctl(DAHDI_FREEZONE) failed: %s\n", strerror(errno));
@@ -443,7 +708,7 @@ int tone_zone_register_zone(int fd, struct tone_zone *z)
 	}
 
 #if defined(TONEZONE_DRIVER)
-	dump_tone_zone(h, MAX_SIZE - space);
+	dump_tone_zone(h, len);
 #endif
 
 #if defined(__FreeBSD__)
@@ -452,12 +717,76 @@ int tone_zone_register_zone(int fd, struct tone_zone *z)
 	if ((res = ioctl(fd, DAHDI_LOADZONE, h))) {
 #endif
 		fprintf(stderr, "ioctl(DAHDI_LOADZONE) failed: %s\n", strerror(errno));
-		return res;
 	}
+	return res;
+}
+
+static int open_ctl(void)
+{
+	int fd;
+
+	if ((fd = open(DEFAULT_DAHDI_DEV, O_RDWR)) < 0)
+		fprintf(stderr, "Unable to open %s and fd not provided\n", DEFAULT_DAHDI_DEV);
+	return fd;
+}
+
+static void close_ctl(int fd)
+{
+	int x = errno;
+
+	close(fd);
+	errno = x;
+}
+
+int tone_zone_load_image(int fd, void *image, size_t len)
+{
+	int iopenedit = 0;
+	int res;
 
+	if (fd < 0) {
+		if ((fd = open_ctl()) < 0)
+			return -1;
+		iopenedit = 1;
+	}
+	res = load_image(fd, image, len);
 	if (iopenedit)
-		close(fd);
+		close_ctl(fd);
+	return res;
+}
+
+/* Register a zone on an open control device */
+static int register_zone(int fd, struct tone_zone *z)
+{
+	char buf[TONE_ZONE_IMAGE_MAX];
+	const void *image;
+	int len;
+
+	len = zone_image(z, &image);
+	if (!len) {
+		len = build_image(z, buf, sizeof(buf));
+		image = buf;
+	}
+	if (len < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return load_image(fd, (void *)image, len);
+}
+
+int tone_zone_register_zone(int fd, struct tone_zone *z)
+{
+	int iopenedit = 0;
+	int res;
 
+	if (fd < 0) {
+		if ((fd = open_ctl()) < 0)
+			return -1;
+		iopenedit = 1;
+	}
+	res = register_zone(fd, z);
+	if (iopenedit)
+		close_ctl(fd);
 	return res;
 }
 
@@ -466,12 +795,42 @@ int tone_zone_register(int fd, char *country)
 	struct tone_zone *z;
 	z = tone_zone_find(country);
 	if (z) {
-		return tone_zone_register_zone(-1, z);
+		return tone_zone_register_zone(fd, z);
 	} else {
+		errno = ENOENT;
 		return -1;
 	}
 }
 
+int tone_zone_register_zones(int fd, char *countries[], int count, int results[])
+{
+	struct tone_zone *z;
+	int iopenedit = 0;
+	int failed = 0;
+	int x;
+
+	if (fd < 0) {
+		if ((fd = open_ctl()) < 0) {
+			for (x = 0; x < count; x++)
+				results[x] = errno;
+			return count;
+		}
+		iopenedit = 1;
+	}
+	for (x = 0; x < count; x++) {
+		results[x] = 0;
+		if (!(z = tone_zone_find(countries[x])))
+			results[x] = ENOENT;
+		else if (register_zone(fd, z))
+			results[x] = errno ? errno : EINVAL;
+		if (results[x])
+			failed++;
+	}
+	if (iopenedit)
+		close_ctl(fd);
+	return failed;
+}
+
 int tone_zone_set_zone(int fd, char *country)
 {
 	int res=-1;
@@ -32,6 +32,7 @@
 #ifndef _TONEZONE_H
 #define _TONEZONE_H
 
+#include <stddef.h>
 #include <dahdi/user.h>
 
 struct tone_zone_sound {
@@ -60,21 +61,137 @@ struct tone_zone {
 
 extern struct tone_zone builtin_zones[];
 
+/* Largest image tone_zone_build_image() may produce */
+#define TONE_ZONE_IMAGE_MAX	16384
+
+#ifdef BUILDING_TONEZONE
+/* Image of a builtin_zones[] entry, precompiled at build time by
+   mkzoneimages.  Only used while the entry still hashes to zone_hash */
+struct tone_zone_image {
+	unsigned long long zone_hash;
+	size_t len;
+	const unsigned int *data;
+};
+
+extern const struct tone_zone_image builtin_zone_images[];
+extern const int num_builtin_zone_images;
+#endif
+
+/*
+ * Thread safety: every function below may be called from any number of
+ * threads at once.  Lookups index builtin_zones[] once per process and
+ * only read it afterwards.  Images built at runtime are shared through
+ * a locked cache.  Registration keeps no state of its own besides that
+ * cache, so concurrent calls on different fds do not wait for each
+ * other.  A compiled tone is read only and may be rendered by several
+ * threads, but each tone_zone_render_state belongs to one thread at a
+ * time.  So does a tone_zone_detector.  Changing builtin_zones[] or a
+ * zone passed in while another thread uses it is not safe.
+ */
+
 /* Register a given two-letter tone zone if we can */
 int tone_zone_register(int fd, char *country);
 
 /* Register a given two-letter tone zone if we can */
 int tone_zone_register_zone(int fd, struct tone_zone *z);
 
+/* Register count zones by country code, on fd or, if fd is -1, on the
+   DAHDI control device opened once for all of them.  results[i] is set
+   to 0 or the errno of countries[i] (ENOENT if the zone is unknown,
+   EBUSY if it is in use).  Returns the number of zones that failed */
+int tone_zone_register_zones(int fd, char *countries[], int count, int results[]);
+
+/* Build the DAHDI_LOADZONE image of a tone zone into buf.  Returns
+   the length of the image, or -1 if it does not fit or fails to build */
+int tone_zone_build_image(struct tone_zone *z, void *buf, size_t size);
+
+/* Load an image built by tone_zone_build_image().  If fd is -1, the
+   DAHDI control device is opened for the duration of the call */
+int tone_zone_load_image(int fd, void *image, size_t len);
+
 /* Retrieve a raw tone zone structure */
 struct tone_zone *tone_zone_find(char *country);
 
 /* Retrieve a raw tone zone structure by id instead of country*/
 struct tone_zone *tone_zone_find_by_num(int id);
 
-/* Retrieve a string name for a given tone id */
+/* Retrieve a string name for a given tone id.  The name of an unknown
+   tone is in a buffer of the calling thread, valid until its next call */
 char *tone_zone_tone_name(int id);
 
+/* Write the name of a given tone id into buf, returns buf */
+char *tone_zone_tone_name_r(int id, char *buf, size_t len);
+
+/* A tone of a zone, compiled for rendering */
+struct tone_zone_tone;
+
+/* Where a channel is in the playback of a tone */
+struct tone_zone_render_state {
+	const struct tone_zone_tone *tone;
+	int seg;				/* Current segment, -1 once the tone ended */
+	int pos;				/* Samples played of the segment */
+	int v1_1, v2_1, v3_1;			/* Oscillator of the first frequency */
+	int v1_2, v2_2, v3_2;			/* Oscillator of the second frequency */
+};
+
+/* Sample formats of tone_zone_render() */
+#define TONE_ZONE_LINEAR	0		/* 16 bit signed linear */
+#define TONE_ZONE_ULAW		1
+#define TONE_ZONE_ALAW		2
+
+/* Compile a tone of a zone (a DAHDI_TONE_* id, DTMF and MF included) for
+   rendering.  Returns NULL with errno ENOENT if the zone has no such tone */
+struct tone_zone_tone *tone_zone_tone_new(struct tone_zone *z, int toneid);
+
+void tone_zone_tone_free(struct tone_zone_tone *t);
+
+/* Start a channel at the beginning of a tone */
+void tone_zone_render_start(struct tone_zone_render_state *st,
+			    const struct tone_zone_tone *t);
+
+/* Render the next samples of nchans channels at 8 kHz, as the kernel
+   plays them, into bufs[i] for st[i].  A tone that ends is followed by
+   silence.  Returns -1 if the format is unknown */
+int tone_zone_render(struct tone_zone_render_state *st, int nchans,
+		     void *bufs[], int samples, int format);
+
+/* Detection of the tones of a zone on a number of channels */
+struct tone_zone_detector;
+
+/* Kinds of tones to detect */
+#define TONE_ZONE_DETECT_PROGRESS	(1 << 0)	/* DAHDI_TONE_DIALTONE etc. */
+#define TONE_ZONE_DETECT_DTMF		(1 << 1)
+#define TONE_ZONE_DETECT_MFR1		(1 << 2)
+#define TONE_ZONE_DETECT_MFR2_FWD	(1 << 3)
+#define TONE_ZONE_DETECT_MFR2_REV	(1 << 4)
+#define TONE_ZONE_DETECT_ALL		0x1f
+
+struct tone_zone_detect_event {
+	int chan;
+	int toneid;				/* DAHDI_TONE_* id */
+	int on;					/* 1 when it started, 0 when it stopped */
+	unsigned long long sample;		/* When, in samples fed to the detector */
+};
+
+/* Detect the tones of a zone of the given kinds in nchans channels */
+struct tone_zone_detector *tone_zone_detector_new(struct tone_zone *z,
+						  int nchans, int flags);
+
+void tone_zone_detector_free(struct tone_zone_detector *d);
+
+/* Forget what was heard on a channel, as on a new call */
+void tone_zone_detector_reset(struct tone_zone_detector *d, int chan);
+
+/* Feed the next samples of every channel at 8 kHz, bufs[i] for channel
+   i (NULL for silence).  Returns the number of events found, stored in
+   *events until the next call, or -1 if the format is unknown.  Events
+   are timed to within about 50 ms.  A call progress tone that starts
+   like several tones of the zone is reported once its cadence tells
+   them apart; tones that sound the same are reported as the first of
+   them.  Sounds shorter than about 50 ms may go unheard */
+int tone_zone_detect(struct tone_zone_detector *d, void *bufs[], int samples,
+		     int format, const struct tone_zone_detect_event **events);
+
 /* Set a given file descriptor into a given country -- USE THIS
    INTERFACE INSTEAD OF THE IOCTL ITSELF.  Auto-loads tone
    zone if necessary */
@@ -0,0 +1,447 @@
+/*
+ * tonezone_bench: measure the speed of the libtonezone tone renderer
+ * and tone detector.
+ *
+ * Renders the call progress tones of a zone on many channels at once,
+ * checks the result against a plain one channel at a time model of the
+ * kernel tone generator, and reports samples per second.  With -d,
+ * checks that the detector hears every tone of every builtin zone as
+ * rendered, then reports how many channels it follows in real time.
+ *
+ * Copyright (C) 2026, the DAHDI tools contributors
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "dahdi/user.h"
+#include "tonezone.h"
+
+#define CHUNK	160	/* Samples per call, 20 ms */
+
+static const int bench_tones[] = {
+	DAHDI_TONE_DIALTONE, DAHDI_TONE_BUSY, DAHDI_TONE_RINGTONE,
+	DAHDI_TONE_CONGESTION, DAHDI_TONE_DIALRECALL, DAHDI_TONE_DTMF_5,
+};
+
+#define NUM_TONES	(sizeof(bench_tones) / sizeof(bench_tones[0]))
+
+#define DETECT_START	4000	/* Sample at which the checked tones start */
+#define DETECT_SECONDS	8
+#define DIGIT_SAMPLES	800	/* Of DTMF and MF tones, 100 ms */
+#define SHORTEST_SOUND	480	/* 60 ms, shorter sounds may go unheard */
+#define DETECT_SLACK	400	/* 50 ms on when a tone started or stopped */
+
+/**
+ * reference_sample - The kernel tone generator, one sample at a time.
+ * @td: the definitions of the zone image
+ * @cur: index of the current definition, -1 when the tone has ended
+ * @pos: samples played of the current definition
+ * @v: the oscillators: v1_1, v2_1, v3_1, v1_2, v2_2, v3_2
+ */
+static short reference_sample(const struct dahdi_tone_def *td, int *cur,
+			      int *pos, int v[6])
+{
+	const struct dahdi_tone_def *t;
+	int samples, next;
+	int p, res;
+
+	if (*cur < 0)
+		return 0;
+	t = &td[*cur];
+	v[0] = v[1];
+	v[1] = v[2];
+	v[2] = (t->fac1 * v[1] >> 15) - v[0];
+	v[3] = v[4];
+	v[4] = v[5];
+	v[5] = (t->fac2 * v[4] >> 15) - v[3];
+	if (!t->modulate) {
+		res = v[2] + v[5];
+	} else {
+		p = v[5] - 32768;
+		if (p < 0)
+			p = -p;
+		p = ((p * 9) / 10) + 1;
+		res = (v[2] * p) >> 15;
+	}
+
+	/* DTMF and MF definitions carry no cadence: play them on */
+	samples = t->samples > 0 ? t->samples : 8000;
+	next = t->samples > 0 ? t->next : *cur;
+	if (++*pos >= samples) {
+		*pos = 0;
+		if (next != *cur) {
+			*cur = next;
+			if (next >= 0) {
+				v[0] = 0;
+				v[1] = td[next].init_v2_1;
+				v[2] = td[next].init_v3_1;
+				v[3] = 0;
+				v[4] = td[next].init_v2_2;
+				v[5] = td[next].init_v3_2;
+			}
+		}
+	}
+	return res;
+}
+
+/* Compare seconds of every bench tone with the reference */
+static int check_zone(struct tone_zone *z, int seconds)
+{
+	static char image[TONE_ZONE_IMAGE_MAX];
+	struct dahdi_tone_def_header *h = (struct dahdi_tone_def_header *)image;
+	struct dahdi_tone_def *td = (struct dahdi_tone_def *)(image + sizeof(*h));
+	struct tone_zone_render_state st;
+	struct tone_zone_tone *t;
+	short buf[CHUNK];
+	void *bufs[1] = { buf };
+	int cur, pos, v[6];
+	int failed = 0;
+	int i, x, n;
+
+	if (tone_zone_build_image(z, image, sizeof(image)) < 0)
+		return 1;
+	for (i = 0; i < NUM_TONES; i++) {
+		if (!(t = tone_zone_tone_new(z, bench_tones[i])))
+			continue;
+		for (cur = 0; cur < h->count && td[cur].tone != bench_tones[i]; cur++)
+			;
+		pos = 0;
+		v[0] = 0;
+		v[1] = td[cur].init_v2_1;
+		v[2] = td[cur].init_v3_1;
+		v[3] = 0;
+		v[4] = td[cur].init_v2_2;
+		v[5] = td[cur].init_v3_2;
+		tone_zone_render_start(&st, t);
+		for (n = 0; n < seconds * 8000; n += CHUNK) {
+			tone_zone_render(&st, 1, bufs, CHUNK, TONE_ZONE_LINEAR);
+			for (x = 0; x < CHUNK; x++) {
+				if (buf[x] != reference_sample(td, &cur, &pos, v))
+					break;
+			}
+			if (x < CHUNK) {
+				fprintf(stderr, "%s: %s differs at sample %d\n",
+					z->country,
+					tone_zone_tone_name(bench_tones[i]),
+					n + x);
+				failed++;
+				break;
+			}
+		}
+		tone_zone_tone_free(t);
+	}
+	return failed;
+}
+
+/* If a tone of the image starts with a sound long enough to be heard */
+static int audible(const struct dahdi_tone_def *td, int count, int toneid)
+{
+	int x, n;
+
+	for (x = 0; x < count && td[x].tone != toneid; x++)
+		;
+	for (n = 0; x >= 0 && x < count && n < count; x = td[x].next, n++) {
+		if (!td[x].init_v2_1 && !td[x].init_v3_1 &&
+		    !td[x].init_v2_2 && !td[x].init_v3_2)
+			continue;
+		return td[x].samples <= 0 || td[x].next == x ||
+		       td[x].samples >= SHORTEST_SOUND;
+	}
+	return 0;
+}
+
+/**
+ * check_detect - Detect every tone of a zone, each on its own channel.
+ * @heard_as: incremented for each call progress tone reported as another
+ * tone of the zone that sounds the same to the detector
+ *
+ * DTMF and MF tones must be reported as themselves, call progress tones
+ * must be reported, and all of them when they started.
+ */
+static int check_detect(struct tone_zone *z, int *checked, int *heard_as,
+			int verbose)
+{
+	static char image[TONE_ZONE_IMAGE_MAX];
+	struct dahdi_tone_def_header *h = (struct dahdi_tone_def_header *)image;
+	struct dahdi_tone_def *td = (struct dahdi_tone_def *)(image + sizeof(*h));
+	struct tone_zone_render_state st[DAHDI_TONE_MAX + 64];
+	struct tone_zone_tone *tones[DAHDI_TONE_MAX + 64];
+	short audio[DAHDI_TONE_MAX + 64][CHUNK];
+	void *bufs[DAHDI_TONE_MAX + 64];
+	int ids[DAHDI_TONE_MAX + 64];
+	long long on[DAHDI_TONE_MAX + 64], off[DAHDI_TONE_MAX + 64];
+	int heard[DAHDI_TONE_MAX + 64];
+	const struct tone_zone_detect_event *ev;
+	struct tone_zone_detector *d;
+	int numchans = 0, failed = 0;
+	int i, x, n, res;
+
+	if (tone_zone_build_image(z, image, sizeof(image)) < 0)
+		return 1;
+	for (x = 0; x < DAHDI_TONE_MAX; x++) {
+		if (z->tones[x].data[0] &&
+		    audible(td, h->count, z->tones[x].toneid))
+			ids[numchans++] = z->tones[x].toneid;
+	}
+	for (x = DAHDI_TONE_DTMF_BASE; x <= DAHDI_TONE_DTMF_MAX; x++)
+		ids[numchans++] = x;
+	for (x = DAHDI_TONE_MFR1_BASE; x <= DAHDI_TONE_MFR1_MAX; x++)
+		ids[numchans++] = x;
+	for (x = DAHDI_TONE_MFR2_FWD_BASE; x <= DAHDI_TONE_MFR2_FWD_MAX; x++)
+		ids[numchans++] = x;
+	for (x = DAHDI_TONE_MFR2_REV_BASE; x <= DAHDI_TONE_MFR2_REV_MAX; x++)
+		ids[numchans++] = x;
+
+	if (!(d = tone_zone_detector_new(z, numchans, TONE_ZONE_DETECT_ALL)))
+		return 1;
+	for (i = 0; i < numchans; i++) {
+		if (!(tones[i] = tone_zone_tone_new(z, ids[i]))) {
+			fprintf(stderr, "%s: no %s\n", z->country,
+				tone_zone_tone_name(ids[i]));
+			return 1;
+		}
+		tone_zone_render_start(&st[i], tones[i]);
+		bufs[i] = audio[i];
+		heard[i] = -1;
+		on[i] = off[i] = -1;
+	}
+
+	for (n = 0; n < DETECT_SECONDS * 8000; n += CHUNK) {
+		for (i = 0; i < numchans; i++) {
+			memset(audio[i], 0, sizeof(audio[i]));
+			if (n < DETECT_START)
+				continue;
+			if (ids[i] >= DAHDI_TONE_DTMF_BASE &&
+			    n >= DETECT_START + DIGIT_SAMPLES)
+				continue;
+			tone_zone_render(&st[i], 1, &bufs[i], CHUNK,
+					 TONE_ZONE_LINEAR);
+		}
+		res = tone_zone_detect(d, bufs, CHUNK, TONE_ZONE_LINEAR, &ev);
+		for (x = 0; x < res; x++) {
+			i = ev[x].chan;
+			if (ev[x].on && heard[i] < 0) {
+				heard[i] = ev[x].toneid;
+				on[i] = ev[x].sample;
+			} else if (!ev[x].on && off[i] < 0) {
+				off[i] = ev[x].sample;
+			}
+		}
+	}
+
+	for (i = 0; i < numchans; i++) {
+		(*checked)++;
+		if (heard[i] < 0 || llabs(on[i] - DETECT_START) > DETECT_SLACK) {
+			fprintf(stderr, "%s: %s not heard when it started\n",
+				z->country, tone_zone_tone_name(ids[i]));
+			failed++;
+		} else if (ids[i] >= DAHDI_TONE_DTMF_BASE &&
+			   (heard[i] != ids[i] ||
+			    llabs(off[i] - DETECT_START - DIGIT_SAMPLES) > DETECT_SLACK)) {
+			fprintf(stderr, "%s: %s heard as %s until %lld\n",
+				z->country, tone_zone_tone_name(ids[i]),
+				tone_zone_tone_name(heard[i]), off[i]);
+			failed++;
+		} else if (heard[i] != ids[i]) {
+			(*heard_as)++;
+			if (verbose) {
+				printf("%s: %s heard as %s\n", z->country,
+				       tone_zone_tone_name(ids[i]),
+				       tone_zone_tone_name(heard[i]));
+			}
+		}
+		tone_zone_tone_free(tones[i]);
+	}
+	tone_zone_detector_free(d);
+	return failed;
+}
+
+/* Channels the detector follows, each hearing one of the bench tones */
+static void bench_detect(struct tone_zone *z, int numchans, int seconds,
+			 int format, const char *fmtname)
+{
+	struct tone_zone_render_state st;
+	struct tone_zone_detector *d;
+	const struct tone_zone_detect_event *ev;
+	struct timespec start, end;
+	struct tone_zone_tone *t;
+	char *audio[NUM_TONES];
+	void **bufs;
+	int size = (format == TONE_ZONE_LINEAR) ? 2 : 1;
+	int numtones = 0, events = 0;
+	double secs;
+	int i, n;
+
+	/* Render the tones ahead, so only detection is timed */
+	for (i = 0; i < NUM_TONES; i++) {
+		if (!(t = tone_zone_tone_new(z, bench_tones[i])))
+			continue;
+		if (!(audio[numtones] = malloc((size_t)seconds * 8000 * size)))
+			break;
+		tone_zone_render_start(&st, t);
+		tone_zone_render(&st, 1, (void **)&audio[numtones],
+				 seconds * 8000, format);
+		tone_zone_tone_free(t);
+		numtones++;
+	}
+	bufs = calloc(numchans, sizeof(*bufs));
+	d = tone_zone_detector_new(z, numchans, TONE_ZONE_DETECT_ALL);
+	if (!numtones || !bufs || !d) {
+		fprintf(stderr, "Unable to set up %d channels\n", numchans);
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < seconds * 8000; n += CHUNK) {
+		for (i = 0; i < numchans; i++)
+			bufs[i] = audio[i % numtones] + (size_t)n * size;
+		events += tone_zone_detect(d, bufs, CHUNK, format, &ev);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Detected %d events on %d channels of %d tones of zone '%s', %d s of %s: %.3f s\n",
+	       events, numchans, numtones, z->country, seconds, fmtname, secs);
+	printf("%.0f samples/s, %.0f channels in real time\n",
+	       (double)numchans * seconds * 8000 / secs,
+	       (double)numchans * seconds / secs);
+
+	tone_zone_detector_free(d);
+	for (i = 0; i < numtones; i++)
+		free(audio[i]);
+	free(bufs);
+}
+
+static void bench_usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-d [-v]] [-z <zone>] [-c <channels>] [-s <seconds>] [-f linear|ulaw|alaw]\n",
+		argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct tone_zone_tone *tones[NUM_TONES];
+	struct tone_zone_render_state *st;
+	struct timespec start, end;
+	struct tone_zone *z;
+	const char *zone = "us";
+	const char *fmtname = "linear";
+	int format = TONE_ZONE_LINEAR;
+	int numchans = 1000;
+	int seconds = 10;
+	int numtones = 0;
+	int detect = 0, verbose = 0;
+	int checked = 0, heard_as = 0;
+	void **bufs;
+	char *audio;
+	double secs;
+	int c, i, n;
+
+	while ((c = getopt(argc, argv, "dvz:c:s:f:")) != -1) {
+		switch (c) {
+		case 'd':
+			detect = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'z':
+			zone = optarg;
+			break;
+		case 'c':
+			numchans = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'f':
+			fmtname = optarg;
+			if (!strcmp(optarg, "linear"))
+				format = TONE_ZONE_LINEAR;
+			else if (!strcmp(optarg, "ulaw"))
+				format = TONE_ZONE_ULAW;
+			else if (!strcmp(optarg, "alaw"))
+				format = TONE_ZONE_ALAW;
+			else
+				bench_usage(argv[0]);
+			break;
+		default:
+			bench_usage(argv[0]);
+		}
+	}
+	if (numchans < 1 || seconds < 1)
+		bench_usage(argv[0]);
+	if (!(z = tone_zone_find((char *)zone))) {
+		fprintf(stderr, "Unknown zone '%s'\n", zone);
+		exit(1);
+	}
+
+	/* Every builtin zone must render what the kernel would play */
+	for (z = builtin_zones; z->zone > -1; z++) {
+		if (check_zone(z, 2))
+			exit(1);
+	}
+	z = tone_zone_find((char *)zone);
+
+	if (detect) {
+		/* Every tone of every builtin zone must be heard as played */
+		for (z = builtin_zones; z->zone > -1; z++) {
+			if (check_detect(z, &checked, &heard_as, verbose))
+				exit(1);
+		}
+		printf("%d tones heard, %d of them as another tone that sounds the same\n",
+		       checked, heard_as);
+		bench_detect(tone_zone_find((char *)zone), numchans, seconds,
+			     format, fmtname);
+		return 0;
+	}
+
+	for (i = 0; i < NUM_TONES; i++) {
+		if ((tones[numtones] = tone_zone_tone_new(z, bench_tones[i])))
+			numtones++;
+	}
+	st = calloc(numchans, sizeof(*st));
+	bufs = calloc(numchans, sizeof(*bufs));
+	audio = malloc((size_t)numchans * CHUNK * sizeof(short));
+	if (!numtones || !st || !bufs || !audio) {
+		fprintf(stderr, "Unable to set up %d channels\n", numchans);
+		exit(1);
+	}
+	for (i = 0; i < numchans; i++) {
+		tone_zone_render_start(&st[i], tones[i % numtones]);
+		bufs[i] = audio + (size_t)i * CHUNK * sizeof(short);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < seconds * 8000; n += CHUNK)
+		tone_zone_render(st, numchans, bufs, CHUNK, format);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d channels of %d tones of zone '%s', %d s of %s: %.3f s\n",
+	       numchans, numtones, z->country, seconds, fmtname, secs);
+	printf("%.0f samples/s, %.1f times real time\n",
+	       (double)numchans * seconds * 8000 / secs, seconds / secs);
+
+	for (i = 0; i < numtones; i++)
+		tone_zone_tone_free(tones[i]);
+	free(audio);
+	free(bufs);
+	free(st);
+	return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * tonezone_check: check the precompiled builtin zone images.
+ *
+ * Every image made by mkzoneimages must be byte for byte what the
+ * runtime builder produces with the compiler flags of the library.
+ * Also checks the zone index, the cache of images built at runtime and
+ * their use from several threads at once. How long each way of getting
+ * an image takes is reported by tonezone_selftest.
+ *
+ * Copyright (C) 2026, the DAHDI tools contributors
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1 as published
+ * by the Free Software Foundation. See the LICENSE.LGPL file
+ * included with this program for more details.
+ */
+
+/* Pull in the library itself, for its runtime builder */
+#include "tonezone.c"
+
+#define THREADS		8
+
+/* What the lookups did before the index */
+static struct tone_zone *scan_country(const char *country)
+{
+	struct tone_zone *z;
+
+	for (z = builtin_zones; z->zone > -1; z++) {
+		if (!strcasecmp(country, z->country))
+			return z;
+	}
+	return NULL;
+}
+
+static struct tone_zone *scan_num(int id)
+{
+	struct tone_zone *z;
+
+	for (z = builtin_zones; z->zone > -1; z++) {
+		if (z->zone == id)
+			return z;
+	}
+	return NULL;
+}
+
+static int check_index(void)
+{
+	char upper[sizeof(builtin_zones[0].country)];
+	struct tone_zone *z;
+	int failed = 0;
+	int x;
+
+	for (z = builtin_zones; z->zone > -1; z++) {
+		for (x = 0; x < sizeof(upper) - 1 && z->country[x]; x++)
+			upper[x] = toupper((unsigned char)z->country[x]);
+		upper[x] = '\0';
+		if (tone_zone_find(upper) != scan_country(upper)) {
+			fprintf(stderr, "%s: found the wrong zone\n", upper);
+			failed++;
+		}
+		if (tone_zone_find_by_num(z->zone) != scan_num(z->zone)) {
+			fprintf(stderr, "%d: found the wrong zone\n", z->zone);
+			failed++;
+		}
+	}
+	if (tone_zone_find("xx-none") || tone_zone_find_by_num(-5) ||
+	    tone_zone_find_by_num(DAHDI_TONE_ZONE_MAX - 1) != scan_num(DAHDI_TONE_ZONE_MAX - 1)) {
+		fprintf(stderr, "Found a zone that does not exist\n");
+		failed++;
+	}
+	return failed;
+}
+
+/* A zone that is not in builtin_zones[] is built once, then cached */
+static int check_cache(void)
+{
+	static char built[TONE_ZONE_IMAGE_MAX];
+	static char cached[TONE_ZONE_IMAGE_MAX];
+	static struct tone_zone custom;
+	int blen, clen;
+	int failed = 0;
+
+	custom = builtin_zones[0];
+	custom.ringcadence[0] += 100;
+	blen = build_image(&custom, built, sizeof(built));
+	tone_zone_build_image(&custom, cached, sizeof(cached));
+	clen = tone_zone_build_image(&custom, cached, sizeof(cached));
+	if (zone_cache_count != 1 || blen != clen || memcmp(built, cached, sizeof(built))) {
+		fprintf(stderr, "Cached image of a custom zone differs\n");
+		failed++;
+	}
+	/* A change to the zone is a different image */
+	custom.ringcadence[0] += 100;
+	tone_zone_build_image(&custom, cached, sizeof(cached));
+	if (zone_cache_count != 2 || !memcmp(built, cached, sizeof(built))) {
+		fprintf(stderr, "Changed zone got a stale image\n");
+		failed++;
+	}
+	return failed;
+}
+
+/* Custom zones, the same for every thread, so that they race to build
+   and cache the same images */
+static struct tone_zone thread_zones[DAHDI_TONE_ZONE_MAX];
+static int num_thread_zones;
+
+static void *thread_check(void *data)
+{
+	static __thread char built[TONE_ZONE_IMAGE_MAX];
+	static __thread char cached[TONE_ZONE_IMAGE_MAX];
+	char name[80], want[80];
+	struct tone_zone *z;
+	long failed = 0;
+	int x;
+
+	for (x = 0; x < num_thread_zones; x++) {
+		z = &thread_zones[x];
+		if (tone_zone_find(z->country) != scan_country(z->country))
+			failed++;
+		if (tone_zone_build_image(z, cached, sizeof(cached)) !=
+		    build_image(z, built, sizeof(built)) ||
+		    memcmp(built, cached, sizeof(built)))
+			failed++;
+		snprintf(want, sizeof(want), "Unknown tone %d", 1000 + x);
+		if (strcmp(tone_zone_tone_name_r(1000 + x, name, sizeof(name)), want) ||
+		    strcmp(tone_zone_tone_name(1000 + x), want))
+			failed++;
+	}
+	return (void *)failed;
+}
+
+static int check_threads(void)
+{
+	pthread_t threads[THREADS];
+	void *res;
+	int failed = 0;
+	int x;
+
+	for (x = 0; builtin_zones[x].zone > -1 && x < DAHDI_TONE_ZONE_MAX; x++) {
+		thread_zones[x] = builtin_zones[x];
+		thread_zones[x].ringcadence[0] += 1000;
+	}
+	num_thread_zones = x;
+	for (x = 0; x < THREADS; x++) {
+		if (pthread_create(&threads[x], NULL, thread_check, NULL)) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (x = 0; x < THREADS; x++) {
+		pthread_join(threads[x], &res);
+		if (res) {
+			fprintf(stderr, "Thread %d: %ld failures\n", x, (long)res);
+			failed++;
+		}
+	}
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	static char built[TONE_ZONE_IMAGE_MAX];
+	static char copied[TONE_ZONE_IMAGE_MAX];
+	struct tone_zone *z;
+	int num = 0;
+	int failed = 0;
+	int blen, clen;
+
+	failed += check_index();
+	failed += check_cache();
+	failed += check_threads();
+	for (z = builtin_zones; z->zone > -1; z++, num++) {
+		if (!builtin_image(z, tone_zone_hash(z))) {
+			fprintf(stderr, "%s: no precompiled image\n", z->country);
+			failed++;
+			continue;
+		}
+		blen = build_image(z, built, sizeof(built));
+		clen = tone_zone_build_image(z, copied, sizeof(copied));
+		if (blen != clen || memcmp(built, copied, sizeof(built))) {
+			fprintf(stderr, "%s: precompiled image differs "
+				"(%d bytes, built %d bytes)\n",
+				z->country, clen, blen);
+			failed++;
+		}
+	}
+	if (num != num_builtin_zone_images) {
+		fprintf(stderr, "%d precompiled images for %d zones\n",
+			num_builtin_zone_images, num);
+		failed++;
+	}
+	printf("%d zones checked, %d failure(s)\n", num, failed);
+	return failed ? 1 : 0;
+}
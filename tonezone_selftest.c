@@ -0,0 +1,793 @@
+/*
+ * tonezone_selftest: check the builtin zones against their definitions.
+ *
+ * Builds every builtin zone, plays each definition of the image through
+ * a model of the kernel tone generator, and checks the frequencies,
+ * levels and cadence heard against the tone strings of zonedata.c.  The
+ * DTMF and MF tones are checked against the frequency pairs of their
+ * standards at the levels of the zone.  Reports for each zone how long
+ * it takes to build and to render.  Needs no DAHDI device.
+ *
+ * Copyright (C) 2026, the DAHDI tools contributors
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU Lesser General Public License Version 2.1 as published
+ * by the Free Software Foundation. See the LICENSE.LGPL file
+ * included with this program for more details.
+ */
+
+#include <time.h>
+
+/* Pull in the library itself: build_image() is what is checked and timed */
+#include "tonezone.c"
+
+#define ITERATIONS	20
+#define RATE		8000
+#define SPECTRUM_SAMPLES RATE	/* Most played of a definition to check it, 1 s */
+#define OSC_SAMPLES	(2 * RATE)	/* Played to measure the frequency of an oscillator */
+#define CYCLES		2	/* Of a cadence, played through */
+#define MAX_SEGS	64
+
+#define TONE_DBM0	-10	/* Of each frequency of a call progress tone */
+#define REDUCED_DBM0	-20	/* Of a frequency marked with @ */
+#define LEVEL_SLACK	1.0	/* dB */
+#define FREQ_SLACK	0.5	/* Hz */
+#define PURITY		0.99	/* Least share of the energy at the right frequencies */
+
+/* A tone component as written in zonedata.c */
+struct seg {
+	int f1, f2;
+	int modulate;
+	int reduced;
+	int ms;				/* 0 if it plays on */
+};
+
+struct expect {
+	struct seg segs[MAX_SEGS];
+	int num;
+	int loop;			/* First component without !, or -1 */
+};
+
+/* What a definition should sound like */
+struct spectrum {
+	int f1, f2;
+	double amp1, amp2;		/* Peak amplitudes, 0 if silent */
+	int modulate;
+};
+
+/*
+ * Tones known not to play as their strings say. What is wrong with them
+ * is still reported, but does not fail the test.
+ */
+static const struct known_issue {
+	const char *country;
+	int toneid;
+	const char *why;
+} known_issues[] = {
+	{ NULL },
+};
+
+static const struct known_issue *known_issue(const struct tone_zone *z,
+					     int toneid)
+{
+	const struct known_issue *k;
+
+	for (k = known_issues; k->country; k++) {
+		if (!strcmp(k->country, z->country) && k->toneid == toneid)
+			return k;
+	}
+	return NULL;
+}
+
+/* Where the throughput of the kernel generator is measured to */
+static volatile short rendered;
+
+static double now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* DAHDI puts 0 dBm0 at 3.14 dB below the largest sample */
+static double dbm0_peak(double dbm0)
+{
+	return pow(10.0, (dbm0 - 3.14) / 20.0) * 32768.0;
+}
+
+/* The frequency an oscillator factor makes */
+static double fac_freq(int fac)
+{
+	double c = fac / 65536.0;
+
+	if (c > 1.0)
+		c = 1.0;
+	if (c < -1.0)
+		c = -1.0;
+	return acos(c) * RATE / (2.0 * M_PI);
+}
+
+/* Strictly parse a tone string: [!]freq1[+freq2|*freq2][@][/time]
+   separated by commas, as in tonezone.h, with modulation and reduced
+   level.  Returns -1 on anything else */
+static int parse_tone(const char *data, struct expect *e)
+{
+	const char *s = data;
+	char *end;
+	struct seg *g;
+
+	e->num = 0;
+	e->loop = -1;
+	while (*s) {
+		if (e->num >= MAX_SEGS)
+			return -1;
+		g = &e->segs[e->num];
+		memset(g, 0, sizeof(*g));
+		if (*s == '!')
+			s++;
+		else if (e->loop < 0)
+			e->loop = e->num;
+		g->f1 = strtol(s, &end, 10);
+		if (end == s || g->f1 < 0)
+			return -1;
+		s = end;
+		if (*s == '+' || *s == '*') {
+			g->modulate = *s == '*';
+			g->f2 = strtol(++s, &end, 10);
+			if (end == s || g->f2 < 0)
+				return -1;
+			s = end;
+		}
+		if (*s == '@') {
+			g->reduced = 1;
+			s++;
+		}
+		if (*s == '/') {
+			g->ms = strtol(++s, &end, 10);
+			if (end == s || g->ms <= 0)
+				return -1;
+			s = end;
+		}
+		e->num++;
+		if (*s == ',')
+			s++;
+		else if (*s)
+			return -1;
+	}
+	return e->num ? 0 : -1;
+}
+
+/**
+ * osc_freq - The frequency an oscillator of the kernel really plays.
+ * @fac: its factor
+ * @init_v2: its starting value before last
+ * @init_v3: its last starting value
+ *
+ * The oscillator rounds down at every sample, which moves it from the
+ * frequency of its factor, by most at the lowest frequencies: a factor
+ * for 25 Hz plays 25.4 Hz but the oscillator 25.8 Hz.  Measured from
+ * the crossings of its mean.
+ */
+static double osc_freq(int fac, int init_v2, int init_v3)
+{
+	static int buf[OSC_SAMPLES];
+	double mean = 0, first = -1, last = -1;
+	int v1 = 0, v2 = init_v2, v3 = init_v3;
+	int cycles = 0;
+	int x;
+
+	if (!init_v2 && !init_v3)
+		return fac_freq(fac);
+	for (x = 0; x < OSC_SAMPLES; x++) {
+		v1 = v2;
+		v2 = v3;
+		v3 = (fac * v2 >> 15) - v1;
+		buf[x] = v3;
+		mean += v3;
+	}
+	mean /= OSC_SAMPLES;
+	for (x = 1; x < OSC_SAMPLES; x++) {
+		if (buf[x - 1] >= mean || buf[x] < mean)
+			continue;
+		last = x - (buf[x] - mean) / (buf[x] - buf[x - 1]);
+		if (first < 0)
+			first = last;
+		else
+			cycles++;
+	}
+	if (!cycles)
+		return fac_freq(fac);
+	return cycles * RATE / (last - first);
+}
+
+/* The frequency heard when the kernel is asked for freq: above half the
+   sample rate, an oscillator plays its alias */
+static int alias_freq(int freq)
+{
+	freq %= RATE;
+	return freq > RATE / 2 ? RATE - freq : freq;
+}
+
+/* If an oscillator plays freq, as closely as its factor can, give or
+   take as much again for its rounding */
+static int freq_close(int fac, double played, int freq)
+{
+	double slack = FREQ_SLACK;
+	double step;
+
+	step = 2.0 * fabs(fac_freq(fac - 1) - fac_freq(fac));
+	if (step > slack)
+		slack = step;
+	step = 2.0 * fabs(fac_freq(fac + 1) - fac_freq(fac));
+	if (step > slack)
+		slack = step;
+	return fabs(played - freq) <= slack;
+}
+
+static void seg_spectrum(const struct seg *g, struct spectrum *sp)
+{
+	double a = dbm0_peak(g->reduced ? REDUCED_DBM0 : TONE_DBM0);
+
+	sp->f1 = g->f1;
+	sp->f2 = g->f2;
+	sp->amp1 = g->f1 ? a : 0;
+	sp->amp2 = g->f2 ? a : 0;
+	sp->modulate = g->modulate;
+}
+
+/* The frequencies heard, and their amplitudes, when the oscillators of
+   a definition play at freq1 and freq2.  Returns how many */
+static int components(const struct spectrum *sp, double freq1, double freq2,
+		      double freq[3], double amp[3])
+{
+	int num = 0;
+
+	if (sp->modulate) {
+		/* The kernel plays 0.9 * v1 * (1 - v2 / 32768): the carrier
+		   and two sidebands */
+		if (!sp->amp1)
+			return 0;
+		freq[num] = freq1;
+		amp[num++] = 0.9 * sp->amp1;
+		if (sp->amp2) {
+			freq[num] = freq1 - freq2;
+			amp[num++] = 0.9 * sp->amp1 * sp->amp2 / 65536.0;
+			freq[num] = freq1 + freq2;
+			amp[num++] = 0.9 * sp->amp1 * sp->amp2 / 65536.0;
+		}
+		return num;
+	}
+	if (sp->amp1) {
+		freq[num] = freq1;
+		amp[num++] = sp->amp1;
+	}
+	if (sp->amp2) {
+		freq[num] = freq2;
+		amp[num++] = sp->amp2;
+	}
+	return num;
+}
+
+/**
+ * kernel_sample - The kernel tone generator, one sample at a time.
+ * @td: the definitions of the zone image
+ * @cur: index of the current definition, -1 when the tone has ended
+ * @pos: samples played of the current definition
+ * @v: the oscillators: v1_1, v2_1, v3_1, v1_2, v2_2, v3_2
+ */
+static short kernel_sample(const struct dahdi_tone_def *td, int *cur,
+			   int *pos, int v[6])
+{
+	const struct dahdi_tone_def *t;
+	int samples, next;
+	int p, res;
+
+	if (*cur < 0)
+		return 0;
+	t = &td[*cur];
+	v[0] = v[1];
+	v[1] = v[2];
+	v[2] = (t->fac1 * v[1] >> 15) - v[0];
+	v[3] = v[4];
+	v[4] = v[5];
+	v[5] = (t->fac2 * v[4] >> 15) - v[3];
+	if (!t->modulate) {
+		res = v[2] + v[5];
+	} else {
+		p = v[5] - 32768;
+		if (p < 0)
+			p = -p;
+		p = ((p * 9) / 10) + 1;
+		res = (v[2] * p) >> 15;
+	}
+
+	/* DTMF and MF definitions carry no cadence: play them on */
+	samples = t->samples > 0 ? t->samples : RATE;
+	next = t->samples > 0 ? t->next : *cur;
+	if (++*pos >= samples) {
+		*pos = 0;
+		if (next != *cur) {
+			*cur = next;
+			if (next >= 0) {
+				v[0] = 0;
+				v[1] = td[next].init_v2_1;
+				v[2] = td[next].init_v3_1;
+				v[3] = 0;
+				v[4] = td[next].init_v2_2;
+				v[5] = td[next].init_v3_2;
+			}
+		}
+	}
+	return res;
+}
+
+/* Start playing td[cur] */
+static void kernel_start(const struct dahdi_tone_def *td, int cur, int *pos,
+			 int v[6])
+{
+	*pos = 0;
+	v[0] = 0;
+	v[1] = td[cur].init_v2_1;
+	v[2] = td[cur].init_v3_1;
+	v[3] = 0;
+	v[4] = td[cur].init_v2_2;
+	v[5] = td[cur].init_v3_2;
+}
+
+/**
+ * fit - Least squares fit of sinusoids of known frequencies.
+ * @buf: the samples
+ * @n: how many
+ * @freq: the frequencies
+ * @num: how many, up to 3
+ * @amp: their peak amplitudes, found
+ *
+ * Works on any length of samples, where a DFT would smear frequencies
+ * that do not fall on its bins.  The oscillators of the kernel round
+ * down, which offsets them by about -0.5 / (2 - 2 cos w): thousands at
+ * the lowest frequencies.  That offset cannot be heard, so it is fitted
+ * too and counts as held.  Returns the share of the energy of the
+ * samples the sinusoids and the offset hold.
+ */
+static double fit(const short *buf, int n, const double *freq, int num,
+		  double *amp)
+{
+	double m[7][8], rhs[7], sol[7];
+	double c[3], s[3], cw[3], sw[3], phi[7];
+	double energy = 0, held = 0, r, t;
+	int k = num * 2 + 1;
+	int i, j, x, p;
+
+	memset(m, 0, sizeof(m));
+	for (i = 0; i < num; i++) {
+		c[i] = 1.0;
+		s[i] = 0.0;
+		cw[i] = cos(2.0 * M_PI * freq[i] / RATE);
+		sw[i] = sin(2.0 * M_PI * freq[i] / RATE);
+	}
+	for (x = 0; x < n; x++) {
+		for (i = 0; i < num; i++) {
+			phi[2 * i] = c[i];
+			phi[2 * i + 1] = s[i];
+			t = c[i] * cw[i] - s[i] * sw[i];
+			s[i] = s[i] * cw[i] + c[i] * sw[i];
+			c[i] = t;
+		}
+		phi[k - 1] = 1.0;
+		for (i = 0; i < k; i++) {
+			for (j = 0; j < k; j++)
+				m[i][j] += phi[i] * phi[j];
+			m[i][k] += phi[i] * buf[x];
+		}
+		energy += (double)buf[x] * buf[x];
+	}
+	for (i = 0; i < k; i++)
+		rhs[i] = m[i][k];
+
+	/* Gauss-Jordan, with partial pivoting */
+	for (i = 0; i < k; i++) {
+		for (p = i, j = i + 1; j < k; j++) {
+			if (fabs(m[j][i]) > fabs(m[p][i]))
+				p = j;
+		}
+		for (j = 0; j <= k; j++) {
+			t = m[i][j];
+			m[i][j] = m[p][j];
+			m[p][j] = t;
+		}
+		if (!m[i][i])
+			return 0;
+		for (j = 0; j < k; j++) {
+			if (j == i)
+				continue;
+			r = m[j][i] / m[i][i];
+			for (p = i; p <= k; p++)
+				m[j][p] -= r * m[i][p];
+		}
+	}
+	for (i = 0; i < k; i++) {
+		sol[i] = m[i][k] / m[i][i];
+		held += sol[i] * rhs[i];
+	}
+	for (i = 0; i < num; i++)
+		amp[i] = hypot(sol[2 * i], sol[2 * i + 1]);
+	return energy ? held / energy : 0;
+}
+
+static double peak_dbm0(double amp)
+{
+	return 20.0 * log10(amp / 32768.0) + 3.14;
+}
+
+/* Check the factors of a definition, then play it for as long as the
+   kernel would, up to a second, and check what is heard */
+static int check_def(const char *what, const struct dahdi_tone_def *td,
+		     const struct spectrum *sp)
+{
+	static short buf[SPECTRUM_SAMPLES];
+	struct dahdi_tone_def one = *td;
+	double freq[3], amp[3], heard[3];
+	double share, freq1, freq2;
+	int cur = 0, pos, v[6];
+	int failed = 0;
+	int num, n, x;
+	int f1 = alias_freq(sp->f1), f2 = alias_freq(sp->f2);
+
+	/* Noted, as it is what the zone asks for */
+	if (f1 != sp->f1 || f2 != sp->f2)
+		printf("%s: %d+%d Hz is above %d Hz, played as %d+%d Hz\n",
+		       what, sp->f1, sp->f2, RATE / 2, f1, f2);
+	freq1 = osc_freq(td->fac1, td->init_v2_1, td->init_v3_1);
+	freq2 = osc_freq(td->fac2, td->init_v2_2, td->init_v3_2);
+	if (!freq_close(td->fac1, freq1, f1) ||
+	    !freq_close(td->fac2, freq2, f2)) {
+		fprintf(stderr, "%s: plays %.1f+%.1f Hz instead of %d+%d Hz\n",
+			what, freq1, freq2, f1, f2);
+		failed++;
+	}
+
+	n = td->samples > 0 && td->samples < SPECTRUM_SAMPLES ?
+		td->samples : SPECTRUM_SAMPLES;
+	one.samples = 0;
+	kernel_start(&one, 0, &pos, v);
+	for (x = 0; x < n; x++)
+		buf[x] = kernel_sample(&one, &cur, &pos, v);
+
+	num = components(sp, freq1, freq2, freq, amp);
+	if (!num) {
+		for (x = 0; x < n && !buf[x]; x++)
+			;
+		if (x < n) {
+			fprintf(stderr, "%s: is not silent\n", what);
+			failed++;
+		}
+		return failed;
+	}
+	share = fit(buf, n, freq, num, heard);
+	for (x = 0; x < num; x++) {
+		if (fabs(peak_dbm0(heard[x]) - peak_dbm0(amp[x])) > LEVEL_SLACK) {
+			fprintf(stderr, "%s: %.0f Hz at %.1f dBm0 instead of %.1f dBm0\n",
+				what, freq[x], peak_dbm0(heard[x]),
+				peak_dbm0(amp[x]));
+			failed++;
+		}
+	}
+	if (share < PURITY) {
+		fprintf(stderr, "%s: only %.1f%% of the energy at the right frequencies\n",
+			what, 100.0 * share);
+		failed++;
+	}
+	return failed;
+}
+
+/* Play a tone from its first definition and check that every component
+   sounds, or is silent, for as long as its string says, then repeats */
+static int check_cadence(const char *what, const struct dahdi_tone_def *td,
+			 int first, const struct expect *e)
+{
+	struct spectrum sp;
+	double freq[3], amp[3];
+	double most;
+	int cur = first, pos, v[6];
+	int k = 0, cycle = 0;
+	int num, n, x, s, peak;
+
+	kernel_start(td, cur, &pos, v);
+	for (;;) {
+		seg_spectrum(&e->segs[k], &sp);
+		num = components(&sp, sp.f1, sp.f2, freq, amp);
+		most = 0;
+		for (x = 0; x < num; x++) {
+			if (amp[x] > most)
+				most = amp[x];
+		}
+		n = e->segs[k].ms ? e->segs[k].ms * 8 : RATE;
+		peak = 0;
+		for (x = 0; x < n; x++) {
+			s = abs(kernel_sample(td, &cur, &pos, v));
+			if (s > peak)
+				peak = s;
+		}
+		if ((!num && peak) || (num && peak < most / 2)) {
+			fprintf(stderr, "%s: component %d of cycle %d peaks at %d, "
+				"expected %s\n", what, k + 1, cycle + 1, peak,
+				num ? "sound" : "silence");
+			return 1;
+		}
+		/* A component without a time plays on */
+		if (!e->segs[k].ms)
+			return 0;
+		if (++k < e->num)
+			continue;
+		if (e->loop < 0 || ++cycle >= CYCLES)
+			break;
+		k = e->loop;
+	}
+	if (e->loop >= 0)
+		return 0;
+	/* A tone that does not repeat ends in silence */
+	for (x = 0; x < RATE; x++) {
+		if (kernel_sample(td, &cur, &pos, v)) {
+			fprintf(stderr, "%s: sounds after its end\n", what);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Check the definitions of a call progress tone, from td[first] */
+static int check_tone(struct tone_zone *z, struct tone_zone_sound *t,
+		      const struct dahdi_tone_def *td, int first, int count,
+		      int *num)
+{
+	struct expect e;
+	struct spectrum sp;
+	const struct dahdi_tone_def *d;
+	const struct seg *g;
+	char what[80];
+	int failed = 0;
+	int k, next;
+
+	snprintf(what, sizeof(what), "%s: %s", z->country,
+		 tone_zone_tone_name(t->toneid));
+	*num = 0;
+	if (parse_tone(t->data, &e)) {
+		fprintf(stderr, "%s: cannot parse \"%s\"\n", what, t->data);
+		return 1;
+	}
+	*num = e.num;
+	if (first + e.num > count) {
+		fprintf(stderr, "%s: %d definitions for %d components\n",
+			what, count - first, e.num);
+		return 1;
+	}
+	for (k = 0; k < e.num; k++) {
+		d = &td[first + k];
+		g = &e.segs[k];
+		snprintf(what, sizeof(what), "%s: %s component %d", z->country,
+			 tone_zone_tone_name(t->toneid), k + 1);
+		if (d->tone != t->toneid) {
+			fprintf(stderr, "%s: belongs to tone %d\n", what, d->tone);
+			failed++;
+			continue;
+		}
+		if (!g->ms)
+			next = k;
+		else if (k < e.num - 1)
+			next = k + 1;
+		else
+			next = e.loop;
+		if (next >= 0)
+			next += first;
+		if (d->samples != (g->ms ? g->ms * 8 : RATE) || d->next != next) {
+			fprintf(stderr, "%s: plays %d samples then %d, "
+				"expected %d then %d\n", what, d->samples,
+				d->next, g->ms ? g->ms * 8 : RATE, next);
+			failed++;
+		}
+		if (!!d->modulate != g->modulate) {
+			fprintf(stderr, "%s: %s modulated\n", what,
+				d->modulate ? "is" : "is not");
+			failed++;
+		}
+		seg_spectrum(g, &sp);
+		failed += check_def(what, d, &sp);
+	}
+	if (!failed) {
+		snprintf(what, sizeof(what), "%s: %s", z->country,
+			 tone_zone_tone_name(t->toneid));
+		failed += check_cadence(what, td, first, &e);
+	}
+	return failed;
+}
+
+/* Signal n, from 1, of a multifrequency code is its n-th pair of
+   frequencies in the order 0+1, 0+2, 1+2, 0+3, 1+3, 2+3, ... */
+static void mf_pair(const int *freqs, int n, int *f1, int *f2)
+{
+	int hi;
+
+	for (hi = 1; n > hi; hi++)
+		n -= hi;
+	*f1 = freqs[n - 1];
+	*f2 = freqs[hi];
+}
+
+/* Check the DTMF and MF definitions, from td[first] in the order the
+   library builds them.  Returns the number of definitions checked */
+static int check_mf(struct tone_zone *z, const struct dahdi_tone_def *td,
+		    int first, int count, int *failed)
+{
+	/* Q.23, Q.320 and Q.441 */
+	static const int dtmf_rows[] = { 697, 770, 852, 941 };
+	static const int dtmf_cols[] = { 1209, 1336, 1477, 1633 };
+	static const char dtmf_keys[] = "123A456B789Cs0pD";
+	static const int r1_freqs[] = { 700, 900, 1100, 1300, 1500 };
+	static const int r1_kp[] = { 1100, 1500, 900, 1300, 700 };
+	static const int r2_fwd[] = { 1380, 1500, 1620, 1740, 1860, 1980 };
+	static const int r2_rev[] = { 1140, 1020, 900, 780, 660, 540 };
+	static const char dtmf_ids[] = "0123456789spABCD";
+	const struct dahdi_tone_def *d;
+	struct spectrum sp;
+	char what[80];
+	int toneid, f1, f2, lo, hi, tmp;
+	int x = first;
+	int n;
+
+	for (toneid = DAHDI_TONE_DTMF_BASE; toneid <= DAHDI_TONE_MFR2_REV_MAX; toneid++) {
+		if (toneid <= DAHDI_TONE_DTMF_MAX) {
+			n = strchr(dtmf_keys, dtmf_ids[toneid - DAHDI_TONE_DTMF_BASE]) - dtmf_keys;
+			f1 = dtmf_rows[n / 4];
+			f2 = dtmf_cols[n % 4];
+			lo = z->dtmf_low_level;
+			hi = z->dtmf_high_level;
+		} else if (toneid < DAHDI_TONE_MFR1_BASE) {
+			continue;
+		} else if (toneid <= DAHDI_TONE_MFR1_MAX) {
+			n = toneid - DAHDI_TONE_MFR1_BASE;
+			if (n >= 10) {
+				f1 = r1_kp[n - 10];
+				f2 = 1700;
+			} else {
+				mf_pair(r1_freqs, n ? n : 10, &f1, &f2);
+			}
+			lo = hi = z->mfr1_level;
+		} else if (toneid < DAHDI_TONE_MFR2_FWD_BASE) {
+			continue;
+		} else if (toneid <= DAHDI_TONE_MFR2_FWD_MAX) {
+			mf_pair(r2_fwd, toneid - DAHDI_TONE_MFR2_FWD_BASE + 1, &f1, &f2);
+			lo = hi = z->mfr2_level;
+		} else if (toneid < DAHDI_TONE_MFR2_REV_BASE) {
+			continue;
+		} else {
+			mf_pair(r2_rev, toneid - DAHDI_TONE_MFR2_REV_BASE + 1, &f1, &f2);
+			lo = hi = z->mfr2_level;
+		}
+		if (f1 > f2) {
+			tmp = f1;
+			f1 = f2;
+			f2 = tmp;
+		}
+		snprintf(what, sizeof(what), "%s: %s", z->country,
+			 tone_zone_tone_name(toneid));
+		if (x >= count) {
+			fprintf(stderr, "%s: missing\n", what);
+			(*failed)++;
+			continue;
+		}
+		d = &td[x++];
+		if (d->tone != toneid || d->samples || d->modulate) {
+			fprintf(stderr, "%s: found tone %d, %d samples%s\n",
+				what, d->tone, d->samples,
+				d->modulate ? ", modulated" : "");
+			(*failed)++;
+			continue;
+		}
+		sp.f1 = f1;
+		sp.f2 = f2;
+		sp.amp1 = dbm0_peak(lo);
+		sp.amp2 = dbm0_peak(hi);
+		sp.modulate = 0;
+		*failed += check_def(what, d, &sp);
+	}
+	return x - first;
+}
+
+/* Everything of one zone.  Returns the number of failures */
+static int check_zone(struct tone_zone *z)
+{
+	static char image[TONE_ZONE_IMAGE_MAX];
+	struct dahdi_tone_def_header *h = (struct dahdi_tone_def_header *)image;
+	struct dahdi_tone_def *td = (struct dahdi_tone_def *)(image + sizeof(*h));
+	double start, build_usec, copy_usec, render_usec;
+	int cur, pos, v[6];
+	const struct known_issue *k;
+	int tones = 0, samples = 0;
+	int failed = 0, known = 0;
+	int len = 0;
+	int i, x, num, res;
+
+	/* The precompiled or cached image, then what build_tone() makes of
+	   the zone, which is checked */
+	start = now_usec();
+	for (i = 0; i < ITERATIONS; i++)
+		tone_zone_build_image(z, image, sizeof(image));
+	copy_usec = (now_usec() - start) / ITERATIONS;
+	start = now_usec();
+	for (i = 0; i < ITERATIONS; i++)
+		len = build_image(z, image, sizeof(image));
+	build_usec = (now_usec() - start) / ITERATIONS;
+	if (len < 0) {
+		fprintf(stderr, "%s: does not build\n", z->country);
+		return 1;
+	}
+
+	if (h->zone != z->zone || strncmp(h->name, z->description, sizeof(h->name) - 1) ||
+	    memcmp(h->ringcadence, z->ringcadence, sizeof(h->ringcadence))) {
+		fprintf(stderr, "%s: header differs from the zone\n", z->country);
+		failed++;
+	}
+	x = 0;
+	for (i = 0; i < DAHDI_TONE_MAX; i++) {
+		if (!z->tones[i].data[0])
+			continue;
+		res = check_tone(z, &z->tones[i], td, x, h->count, &num);
+		k = known_issue(z, z->tones[i].toneid);
+		if (res && k) {
+			printf("%s: %s: known issue (%s), not counted\n",
+			       z->country, tone_zone_tone_name(z->tones[i].toneid),
+			       k->why);
+			known += res;
+		} else {
+			failed += res;
+		}
+		if (!num) {
+			/* Where the other definitions start is not known */
+			printf("%s: rest of the zone not checked\n", z->country);
+			return failed;
+		}
+		x += num;
+		tones++;
+	}
+	x += check_mf(z, td, x, h->count, &failed);
+	if (x != h->count) {
+		fprintf(stderr, "%s: %d definitions, %d expected\n",
+			z->country, h->count, x);
+		failed++;
+	}
+
+	/* A second of every tone, as the kernel plays it */
+	start = now_usec();
+	for (i = 0; i < h->count; i++) {
+		if (i && td[i - 1].tone == td[i].tone)
+			continue;
+		cur = i;
+		kernel_start(td, cur, &pos, v);
+		for (x = 0; x < RATE; x++)
+			rendered = kernel_sample(td, &cur, &pos, v);
+		samples += RATE;
+	}
+	render_usec = now_usec() - start;
+
+	printf("%-6s %2d tones %3d defs %5d bytes: built in %6.1f us, "
+	       "copied in %4.1f us, rendered at %6.1f Msamples/s%s\n",
+	       z->country, tones, h->count, len, build_usec, copy_usec,
+	       samples / render_usec,
+	       failed ? " FAILED" : known ? " known issues" : "");
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	struct tone_zone *z;
+	int failed = 0;
+
+	for (z = builtin_zones; z->zone > -1; z++)
+		failed += check_zone(z);
+	if (failed)
+		fprintf(stderr, "%d failures\n", failed);
+	return failed ? 1 : 0;
+}
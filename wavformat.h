@@ -24,6 +24,11 @@
 
 #include <stdint.h>
 
+/* fmt_compression_code */
+#define WAV_FORMAT_PCM		1
+#define WAV_FORMAT_ALAW		6
+#define WAV_FORMAT_MULAW	7
+
 struct wavheader {
 	/* riff type chunk */
 	char riff_chunk_id[4];
@@ -45,4 +50,33 @@ struct wavheader {
 	uint32_t data_data_size;
 } __attribute__((packed));
 
+/* The formats other than PCM (such as G.711) have a format chunk of 18
+ * bytes and a fact chunk with the number of samples */
+struct wavheader_g711 {
+	/* riff type chunk */
+	char riff_chunk_id[4];
+	uint32_t riff_chunk_size;
+	char riff_type[4];
+
+	/* format chunk */
+	char  fmt_chunk_id[4];
+	uint32_t  fmt_data_size;
+	uint16_t fmt_compression_code;
+	uint16_t fmt_num_channels;
+	uint32_t  fmt_sample_rate;
+	uint32_t  fmt_avg_bytes_per_sec;
+	uint16_t fmt_block_align;
+	uint16_t fmt_significant_bps;
+	uint16_t fmt_extra_size;
+
+	/* fact chunk */
+	char fact_chunk_id[4];
+	uint32_t fact_data_size;
+	uint32_t fact_sample_length;
+
+	/* data chunk */
+	char data_chunk_id[4];
+	uint32_t data_data_size;
+} __attribute__((packed));
+
 #endif
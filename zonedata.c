@@ -264,10 +264,10 @@ struct tone_zone builtin_zones[] =
 			{ DAHDI_TONE_RINGTONE, "400+450/400,0/200,400+450/400,0/2000" },
 			{ DAHDI_TONE_CONGESTION, "400/250,0/250" },
 			{ DAHDI_TONE_CALLWAIT, "400/250,0/250,400/250,0/3250" },
-			{ DAHDI_TONE_DIALRECALL, "!400/100!0/100,!400/100,!0/100,!400/100,!0/100,400" },
+			{ DAHDI_TONE_DIALRECALL, "!400/100,!0/100,!400/100,!0/100,!400/100,!0/100,400" },
 			{ DAHDI_TONE_RECORDTONE, "1400/425,0/15000" },
 			{ DAHDI_TONE_INFO, "400/750,0/100,400/750,0/100,400/750,0/100,400/750,0/400" },
-			{ DAHDI_TONE_STUTTER, "!400/100!0/100,!400/100,!0/100,!400/100,!0/100,!400/100!0/100,!400/100,!0/100,!400/100,!0/100,400" },
+			{ DAHDI_TONE_STUTTER, "!400/100,!0/100,!400/100,!0/100,!400/100,!0/100,!400/100,!0/100,!400/100,!0/100,!400/100,!0/100,400" },
 		},
 	  .dtmf_high_level = -11,
 	  .dtmf_low_level = -9,
@@ -500,7 +500,8 @@ struct tone_zone builtin_zones[] =
 			/* RECORDTONE - not specified */
 			{ DAHDI_TONE_RECORDTONE, "1400/400,0/15000" },
 			{ DAHDI_TONE_INFO, "!950/330,!1400/330,!1800/330,!0/1000,!950/330,!1400/330,!1800/330,!0/1000,!950/330,!1400/330,!1800/330,!0/1000,0" },
-			{ DAHDI_TONE_STUTTER, "350+375+400" },
+			/* STUTTER - 350+375+400, but a tone has at most two frequencies */
+			{ DAHDI_TONE_STUTTER, "350+375" },
 		},
 	  .dtmf_high_level = -9,
 	  .dtmf_low_level = -11,
@@ -616,7 +617,8 @@ struct tone_zone builtin_zones[] =
 			{ DAHDI_TONE_DIALRECALL, "425/650,0/25" },
 			/* RECORDTONE - not specified */
 			{ DAHDI_TONE_RECORDTONE, "1400/500,0/15000" },
-			{ DAHDI_TONE_INFO, "950/0,0/325,950/325,0/30,1400/1300,0/2600" },
+			/* INFO - the special information tone of ITU-T E.180 */
+			{ DAHDI_TONE_INFO, "950/330,1400/330,1800/330,0/1000" },
 			/* STUTTER not specified */
 			{ DAHDI_TONE_STUTTER, "!425/100,!0/100,!425/100,!0/100,!425/100,!0/100,!425/100,!0/100,!425/100,!0/100,!425/100,!0/100,425" },
 		},